@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +8,32 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <signal.h>
 #include <termios.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 void enable_raw_mode() {
   struct termios raw;
@@ -25,72 +49,271 @@ int cmp_strings(const void* a, const void* b) {
 }
 
 
-// Tokenizes input into argv array, returns argc
-int tokenize(char* input, char* argv[], int max_args)
-{
-  if (!input)
-    return 0;
+// A growable byte buffer, always NUL-terminated once anything is in it
+struct strbuf {
+  char* data;
+  size_t len, cap;
+};
+
+bool strbuf_append(struct strbuf* sb, const char* s, size_t n) {
+  if (sb->len + n + 1 > sb->cap) {
+    size_t cap = sb->cap ? sb->cap : 64;
+    while (sb->len + n + 1 > cap)
+      cap *= 2;
+    char* grown = realloc(sb->data, cap);
+    if (!grown)
+      return false;
+    sb->data = grown;
+    sb->cap = cap;
+  }
+  memcpy(sb->data + sb->len, s, n);
+  sb->len += n;
+  sb->data[sb->len] = '\0';
+  return true;
+}
 
-  int argc = 0;
-  char* p = input;
-  char* w = input;
+bool strbuf_putc(struct strbuf* sb, char c) {
+  return strbuf_append(sb, &c, 1);
+}
 
-  while (*p) {
-    while (*p == ' ' || *p == '\t')
-      p++;
-    if (*p == '\0')
-      break;
-    if (argc >= max_args - 1)
+// Appends everything readable from fd
+void strbuf_read_fd(struct strbuf* sb, int fd) {
+  char chunk[65536];
+  while (true) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0 || !strbuf_append(sb, chunk, n))
       break;
+  }
+}
 
-    argv[argc++] = w;
+// Shell variables live in an open-addressed hash table keyed by name.
+// Every change stamps the variable with a fresh generation number, so a
+// cache built from a variable (like the PATH split) only has to compare
+// one number to know it's stale. Unset variables keep their slot with a
+// NULL entry, which keeps lookups free of tombstones and generations
+// monotonic.
+struct shell_var {
+  char* name;              // NULL for an empty slot
+  char* entry;             // "NAME=value" as execve wants it, or NULL if unset
+  uint64_t hash;
+  unsigned long generation;
+  bool exported;
+};
+
+struct shell_var* vars;
+size_t vars_cap, vars_used;
+unsigned long var_generation_counter;
+
+// The environment handed to children, rebuilt from the exported
+// variables only when env_generation has moved since the last build
+char** env_array;
+unsigned long env_generation = 1, env_built;
+
+uint64_t hash_name(const char* name, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
 
-    while (*p && *p != ' ' && *p != '\t') {
-      //Single Quotes Handling
-      if (*p == '\'') {
-        p++;
-        while (*p && *p != '\'')
-          *w++ = *p++;
-        if (*p == '\'')
-          p++;
-      }
+bool is_valid_name(const char* name, size_t len) {
+  if (len == 0 || !(name[0] == '_' || (name[0] >= 'a' && name[0] <= 'z') || (name[0] >= 'A' && name[0] <= 'Z')))
+    return false;
+  for (size_t i = 1; i < len; i++) {
+    char c = name[i];
+    if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+      return false;
+  }
+  return true;
+}
 
-      // Double quotes handling
-      else if (*p == '"') {
-        p++;
-        while (*p && *p != '"') {
-          if (*p == '\\') {
-            char next = *(p + 1);
-            if (next == '"' || next == '\\') {
-              p++;
-              *w++ = *p++;
-            }
-            else {
-              *w++ = *p++;
-            }
-          }
-          else {
-            *w++ = *p++;
-          }
-        }
-        if (*p == '"')
-          p++;
-      }
-      else if (*p == '\\') {
-        p++;
-        if (*p)
-          *w++ = *p++;
+// Finds the slot for name, which is either its variable or the empty slot
+// where it would go
+struct shell_var* var_slot(const char* name, size_t len, uint64_t hash) {
+  size_t mask = vars_cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    struct shell_var* v = &vars[i];
+    if (!v->name || (v->hash == hash && strncmp(v->name, name, len) == 0 && v->name[len] == '\0'))
+      return v;
+  }
+}
+
+struct shell_var* var_find(const char* name, size_t len) {
+  if (vars_cap == 0)
+    return NULL;
+  struct shell_var* v = var_slot(name, len, hash_name(name, len));
+  return v->name ? v : NULL;
+}
+
+// Returns the variable for name, adding an unset one if there is none
+struct shell_var* var_lookup_or_add(const char* name, size_t len) {
+  if ((vars_used + 1) * 10 >= vars_cap * 7) {
+    size_t cap = vars_cap ? vars_cap * 2 : 128;
+    struct shell_var* grown = calloc(cap, sizeof(*grown));
+    if (!grown)
+      return NULL;
+    struct shell_var* old = vars;
+    size_t old_cap = vars_cap;
+    vars = grown;
+    vars_cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].name)
+        *var_slot(old[i].name, strlen(old[i].name), old[i].hash) = old[i];
+    }
+    free(old);
+  }
+
+  uint64_t hash = hash_name(name, len);
+  struct shell_var* v = var_slot(name, len, hash);
+  if (!v->name) {
+    v->name = strndup(name, len);
+    if (!v->name)
+      return NULL;
+    v->hash = hash;
+    vars_used++;
+  }
+  return v;
+}
+
+// Returns the value of name, or NULL if it isn't set
+const char* var_get_n(const char* name, size_t len) {
+  struct shell_var* v = var_find(name, len);
+  return v && v->entry ? v->entry + len + 1 : NULL;
+}
+
+const char* var_get(const char* name) {
+  return var_get_n(name, strlen(name));
+}
+
+// Returns the generation of name's current value, 0 if it was never set
+unsigned long var_generation(const char* name) {
+  struct shell_var* v = var_find(name, strlen(name));
+  return v ? v->generation : 0;
+}
+
+bool var_set(const char* name, size_t len, const char* value) {
+  struct shell_var* v = var_lookup_or_add(name, len);
+  if (!v)
+    return false;
+  size_t vlen = strlen(value);
+  char* entry = malloc(len + vlen + 2);
+  if (!entry)
+    return false;
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  memcpy(entry + len + 1, value, vlen + 1);
+  free(v->entry);
+  v->entry = entry;
+  v->generation = ++var_generation_counter;
+  if (v->exported)
+    env_generation++;
+  return true;
+}
+
+void var_unset(const char* name, size_t len) {
+  struct shell_var* v = var_find(name, len);
+  if (!v || (!v->entry && !v->exported))
+    return;
+  if (v->exported && v->entry)
+    env_generation++;
+  free(v->entry);
+  v->entry = NULL;
+  v->exported = false;
+  v->generation = ++var_generation_counter;
+}
+
+void var_export(struct shell_var* v) {
+  if (!v->exported && v->entry)
+    env_generation++;
+  v->exported = true;
+}
+
+// Loads the environment the shell was started with
+void vars_init(void) {
+  for (char** e = environ; *e; e++) {
+    char* eq = strchr(*e, '=');
+    if (!eq || !is_valid_name(*e, eq - *e))
+      continue;
+    var_set(*e, eq - *e, eq + 1);
+    struct shell_var* v = var_find(*e, eq - *e);
+    if (v)
+      var_export(v);
+  }
+}
+
+// Returns the environment for a child process. The array points straight
+// at the variables' "NAME=value" entries and is only rebuilt after an
+// exported variable changes.
+char** shell_environ(void) {
+  if (env_array && env_built == env_generation)
+    return env_array;
+
+  size_t n = 0;
+  for (size_t i = 0; i < vars_cap; i++)
+    n += vars[i].exported && vars[i].entry;
+  char** envp = malloc((n + 1) * sizeof(char*));
+  if (!envp)
+    return env_array ? env_array : environ;
+  n = 0;
+  for (size_t i = 0; i < vars_cap; i++) {
+    if (vars[i].exported && vars[i].entry)
+      envp[n++] = vars[i].entry;
+  }
+  envp[n] = NULL;
+  free(env_array);
+  env_array = envp;
+  env_built = env_generation;
+  return env_array;
+}
+
+// PATH split into its directories, rebuilt only when PATH's generation
+// changes
+struct path_cache {
+  unsigned long generation;
+  bool valid;
+  char* storage;
+  char** dirs;
+  int count;
+} path_cache;
+
+char** path_dirs(int* count) {
+  unsigned long generation = var_generation("PATH");
+  if (!path_cache.valid || path_cache.generation != generation) {
+    free(path_cache.storage);
+    free(path_cache.dirs);
+    memset(&path_cache, 0, sizeof(path_cache));
+    const char* path = var_get("PATH");
+    if (path) {
+      int n = 1;
+      for (const char* p = path; *p; p++)
+        n += *p == ':';
+      path_cache.storage = strdup(path);
+      path_cache.dirs = malloc(n * sizeof(char*));
+      if (!path_cache.storage || !path_cache.dirs) {
+        free(path_cache.storage);
+        free(path_cache.dirs);
+        memset(&path_cache, 0, sizeof(path_cache));
+        *count = 0;
+        return NULL;
       }
-      else {
-        *w++ = *p++;
+      char* s = path_cache.storage;
+      path_cache.dirs[path_cache.count++] = s;
+      for (; *s; s++) {
+        if (*s == ':') {
+          *s = '\0';
+          path_cache.dirs[path_cache.count++] = s + 1;
+        }
       }
     }
-    if (*p)
-      p++;
-    *w++ = '\0';
+    path_cache.generation = generation;
+    path_cache.valid = true;
   }
-  argv[argc] = NULL;
-  return argc;
+  *count = path_cache.count;
+  return path_cache.dirs;
 }
 
 // Returns full path of executable if found in PATH, else NULL
@@ -100,933 +323,8505 @@ char* find_executable(const char* command)
   if (!command || strlen(command) == 0)
     return NULL;
 
-  char* path_env = getenv("PATH");
-  if (!path_env)
-    return NULL;
-
-  char* path_copy = strdup(path_env);
-  if (!path_copy)
-    return NULL;
-
-  char* token = strtok(path_copy, ":");
-  while (token)
+  int ndirs;
+  char** dirs = path_dirs(&ndirs);
+  for (int i = 0; i < ndirs; i++)
   {
     char full_path[1024];
-    snprintf(full_path, sizeof(full_path), "%s/%s", token, command);
+    if (!dirs[i][0])
+      continue;
+    snprintf(full_path, sizeof(full_path), "%s/%s", dirs[i], command);
 
     // Check if file exists and is executable
     if (access(full_path, X_OK) == 0)
     {
       struct stat path_stat;
       if (stat(full_path, &path_stat) == 0 && S_ISREG(path_stat.st_mode))
-      {
-        free(path_copy);
         return strdup(full_path);
-      }
     }
-    token = strtok(NULL, ":");
   }
 
-  free(path_copy);
   return NULL;
 }
 
-// Executes external commands
-void execute_external(char* argv[])
+// The event loop. SIGINT, SIGCHLD and SIGWINCH are blocked in every
+// thread of the shell and read from a signalfd, so no shell code runs in
+// signal-handler context. Whatever the shell waits on (terminal input, a
+// child's pidfd, the completion worker's eventfd, a timerfd) is added to
+// one epoll set next to the signalfd, and event_wait() handles signals
+// while it waits.
+struct event_source {
+  int fd;
+  bool ready;
+  bool added;
+};
+
+int event_epoll = -1;
+int signal_fd = -1;
+pthread_t event_thread;   // only this thread waits in the epoll set
+bool got_sigint = false;
+int terminal_cols = -1;   // cached width, dropped on SIGWINCH
+
+// Handles the signals that have arrived. Returns true if one was SIGINT.
+bool signals_dispatch() {
+  bool interrupted = false;
+  struct signalfd_siginfo info;
+  while (signal_fd >= 0 && read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGINT) {
+      got_sigint = true;
+      interrupted = true;
+    }
+    else if (info.ssi_signo == SIGWINCH) {
+      terminal_cols = -1;
+    }
+    // SIGCHLD only has to end event_wait(); see wait_for_child()
+  }
+  return interrupted;
+}
+
+void event_epoll_open() {
+  event_epoll = epoll_create1(EPOLL_CLOEXEC);
+  // A NULL source stands for the signalfd
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (event_epoll >= 0 && signal_fd >= 0)
+    epoll_ctl(event_epoll, EPOLL_CTL_ADD, signal_fd, &ev);
+  event_thread = pthread_self();
+}
+
+void events_init() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGWINCH);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  event_epoll_open();
+}
+
+// A forked subshell would otherwise share its parent's epoll set. The
+// signalfd can stay: it reads the signals of whichever process reads it.
+void events_after_fork() {
+  if (event_epoll >= 0)
+    close(event_epoll);
+  event_epoll_open();
+}
+
+// A timerfd that becomes readable after ms milliseconds
+int timer_after(int ms) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  // An all-zero it_value would disarm the timer instead
+  struct itimerspec when = { .it_value = { ms / 1000, (ms % 1000) * 1000000L + (ms == 0) } };
+  if (fd >= 0)
+    timerfd_settime(fd, 0, &when, NULL);
+  return fd;
+}
+
+// Waits until one of the n sources is readable and marks those that are.
+// Returns how many are ready, 0 if a signal other than SIGINT came first,
+// or -1 on SIGINT. Threads other than the shell's main one just poll the
+// sources, leaving signals to it.
+int event_wait(struct event_source* srcs, int n) {
+  int ready = 0;
+  for (int i = 0; i < n; i++)
+    srcs[i].ready = srcs[i].added = false;
+
+  if (event_epoll < 0 || !pthread_equal(pthread_self(), event_thread)) {
+    struct pollfd fds[8];
+    if (n > 8)
+      n = 8;
+    for (int i = 0; i < n; i++)
+      fds[i] = (struct pollfd){ .fd = srcs[i].fd, .events = POLLIN };
+    // With nothing to watch, as when waiting for SIGCHLD, look again soon
+    if (poll(fds, n, n > 0 ? -1 : 10) < 0)
+      return 0;
+    for (int i = 0; i < n; i++) {
+      srcs[i].ready = fds[i].revents != 0;
+      ready += srcs[i].ready;
+    }
+    return ready;
+  }
+
+  for (int i = 0; i < n; i++) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &srcs[i] };
+    if (epoll_ctl(event_epoll, EPOLL_CTL_ADD, srcs[i].fd, &ev) == 0)
+      srcs[i].added = true;
+    // Regular files can't be watched, but they never block either
+    else if (errno == EPERM && !srcs[i].ready) {
+      srcs[i].ready = true;
+      ready++;
+    }
+  }
+
+  bool signalled = false, interrupted = false;
+  while (ready == 0 && !signalled) {
+    struct epoll_event events[8];
+    int got = epoll_wait(event_epoll, events, 8, -1);
+    if (got < 0 && errno != EINTR)
+      break;
+    for (int i = 0; i < got; i++) {
+      struct event_source* src = events[i].data.ptr;
+      if (!src) {
+        signalled = true;
+        interrupted |= signals_dispatch();
+      }
+      else if (!src->ready) {
+        src->ready = true;
+        ready++;
+      }
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (srcs[i].added)
+      epoll_ctl(event_epoll, EPOLL_CTL_DEL, srcs[i].fd, NULL);
+  }
+  return interrupted ? -1 : ready;
+}
+
+// Starts exe as a child process. fds[i], when not -1, becomes the child's
+// descriptor i; the shell's own stdin/stdout/stderr are never touched.
+// Pipes and redirection files are all close-on-exec, so nothing else
+// leaks into the child. Returns the pid, or -1 after reporting the error.
+pid_t spawn_command(const char* exe, char* argv[], const int fds[3])
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] >= 0)
+      posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+  }
+
+  // The shell ignores SIGPIPE so builtins see EPIPE instead of killing
+  // it; children get the default disposition back
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  // and none of the signals the shell keeps blocked for its signalfd
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+  pid_t pid;
+  int err = posix_spawn(&pid, exe, &actions, &attr, argv, shell_environ());
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (err != 0) {
+    dprintf(fds[2] >= 0 ? fds[2] : 2, "%s: %s\n", argv[0], strerror(err));
+    return -1;
+  }
+  return pid;
+}
+
+// Waits for pid and returns its exit status the way the shell reports it.
+// The wait goes through the event loop on the child's pidfd, so signals
+// are handled meanwhile; without pidfds (Linux before 5.3) SIGCHLD wakes
+// the loop and the child is checked with WNOHANG.
+int wait_for_child(pid_t pid)
 {
+  int status;
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  pid_t done;
+  while ((done = waitpid(pid, &status, WNOHANG)) != pid) {
+    if (done < 0 && errno != EINTR)
+      break;
+    struct event_source child = { .fd = pidfd };
+    event_wait(&child, pidfd >= 0);
+  }
+  if (pidfd >= 0)
+    close(pidfd);
+  if (done != pid)
+    return 1;
+  // A Ctrl-C that ended the child was sent to the shell as well
+  signals_dispatch();
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
 
+// Executes external commands
+int execute_external(char* argv[], const int fds[3])
+{
   char* exe_path = find_executable(argv[0]);
   if (!exe_path)
   {
-    printf("%s: command not found\n", argv[0]);
-    return;
+    dprintf(fds[2] >= 0 ? fds[2] : 2, "%s: command not found\n", argv[0]);
+    return 127;
   }
 
-  pid_t pid = fork();
+  pid_t pid = spawn_command(exe_path, argv, fds);
+  free(exe_path);
+  if (pid < 0)
+    return 126;
+  return wait_for_child(pid);
+}
 
-  if (pid == 0)
-  {
-    // child
-    execv(exe_path, argv);
-    perror("execv"); // only runs if exec fails
-    exit(1);
+// Here-document bodies read after a command line, consumed in order by
+// the << operators of that line
+struct heredoc {
+  char* body;
+  size_t len;
+};
+
+struct heredoc heredocs[16];
+int heredoc_count = 0;
+
+enum { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_HEREDOC, REDIR_HERESTRING, REDIR_DUP };
+
+// A redirection with its target expanded, ready to be applied
+struct redirection {
+  int kind;
+  int fd;              // the descriptor it sets
+  char* target;        // file, descriptor number or here-string (owned)
+  const char* data;    // REDIR_HEREDOC: the body
+  size_t len;
+};
+
+#define MAX_REDIRECTIONS 16
+
+// A command's redirections, applied in the order they were written
+struct redirections {
+  struct redirection items[MAX_REDIRECTIONS];
+  int count;
+  bool failed;         // a target couldn't be expanded
+};
+
+void redirections_free(struct redirections* redir) {
+  for (int i = 0; i < redir->count; i++)
+    free(redir->items[i].target);
+  redir->count = 0;
+}
+
+// Data a helper thread writes into a pipe for a reader that starts early
+struct pipe_feed {
+  int fd;
+  char* data;
+  size_t len;
+};
+
+void* pipe_feed_worker(void* arg) {
+  struct pipe_feed* feed = arg;
+  size_t off = 0;
+  while (off < feed->len) {
+    ssize_t n = write(feed->fd, feed->data + off, feed->len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
   }
-  else if (pid > 0)
-  {
-    // parent
-    wait(NULL);
+  close(feed->fd);
+  free(feed->data);
+  free(feed);
+  return NULL;
+}
+
+// Returns a readable fd positioned at the start of data. The data lives in
+// an anonymous memory file, so nothing touches the filesystem; without
+// memfd it goes through a pipe, fed by a helper thread when it won't fit.
+int open_input_data(const char* data, size_t len)
+{
+  int fd = memfd_create("heredoc", MFD_CLOEXEC);
+  if (fd >= 0) {
+    size_t off = 0;
+    while (off < len) {
+      ssize_t n = write(fd, data + off, len - off);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        close(fd);
+        return -1;
+      }
+      off += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
   }
-  else
-  {
-    perror("fork");
+
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) < 0)
+    return -1;
+
+  int capacity = fcntl(p[1], F_GETPIPE_SZ);
+  if (capacity > 0 && len <= (size_t)capacity) {
+    write(p[1], data, len);
+    close(p[1]);
+    return p[0];
   }
-  free(exe_path);
+
+  // Too big for the pipe buffer: stream it from a thread so the reader
+  // can start consuming right away
+  struct pipe_feed* feed = malloc(sizeof(*feed));
+  char* copy = malloc(len);
+  pthread_t thread;
+  if (!feed || !copy) {
+    free(feed);
+    free(copy);
+    close(p[0]);
+    close(p[1]);
+    return -1;
+  }
+  memcpy(copy, data, len);
+  feed->fd = p[1];
+  feed->data = copy;
+  feed->len = len;
+  if (pthread_create(&thread, NULL, pipe_feed_worker, feed) != 0) {
+    free(copy);
+    free(feed);
+    close(p[0]);
+    close(p[1]);
+    return -1;
+  }
+  pthread_detach(thread);
+  return p[0];
+}
+
+void close_redirections(int fds[3])
+{
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] >= 0)
+      close(fds[i]);
+    fds[i] = -1;
+  }
+}
+
+// Pipe ends are owned by the pipeline loop; stages get their own copy so
+// close_redirections() can treat every stage descriptor the same way
+int dup_pipe_end(int fd)
+{
+  return fcntl(fd, F_DUPFD_CLOEXEC, 3);
 }
 
-// Parses redirection in argv, returns output file if found, else NULL
+void heredoc_append(struct heredoc* doc, const char* line, bool strip_tabs)
+{
+  if (strip_tabs) {
+    while (*line == '\t')
+      line++;
+  }
+  size_t n = strlen(line);
+  char* grown = realloc(doc->body, doc->len + n + 2);
+  if (!grown)
+    return;
+  doc->body = grown;
+  memcpy(doc->body + doc->len, line, n);
+  doc->len += n;
+  doc->body[doc->len++] = '\n';
+  doc->body[doc->len] = '\0';
+}
 
-void parse_redirection(char* argv[], char** out_stdout, char** out_stderr, bool* stdout_append, bool* stderr_append)
+void heredocs_clear()
 {
-  *out_stdout = NULL;
-  *out_stderr = NULL;
-  *stdout_append = false;
-  *stderr_append = false;
+  for (int i = 0; i < heredoc_count; i++) {
+    free(heredocs[i].body);
+    heredocs[i].body = NULL;
+    heredocs[i].len = 0;
+  }
+  heredoc_count = 0;
+}
+
+// Shell state used while running compiled commands
+int last_status = 0;        // $?
+int last_substitution_status = 0;
+char** positional = NULL;   // $1, $2, ...
+int npositional = 0;
+const char* shell_name = "shell";
+int loop_depth = 0;
+int break_count = 0;        // loops still to leave for a break
+int continue_count = 0;     // loops to leave before continuing one
+bool returning = false;
+int function_depth = 0;
+
+// Functions defined with name() { ...; }, found by a linear scan as
+// scripts rarely define more than a handful
+struct shell_function {
+  const char* name;
+  struct node* body;
+  struct program* program;
+};
+
+struct shell_function* functions = NULL;
+int nfunctions = 0, functions_cap = 0;
+struct program* running_program = NULL;
+
+struct shell_function* find_function(const char* name) {
+  for (int i = 0; i < nfunctions; i++) {
+    if (strcmp(functions[i].name, name) == 0)
+      return &functions[i];
+  }
+  return NULL;
+}
+
+const char* builtin[] = { "echo", "exit", "type", "pwd", "cd", "history", "mkdir", "rmdir", "rm", "touch", "cp", "mv", "shopt", "cat", "head", "tail", "wc", "tee", "export", "unset", "break", "continue", "return", "test", "[", "true", "false", "pushd", "popd", "dirs", "xargs", "timeout", NULL };
+// Options toggled with the shopt builtin. Numeric options are set with
+// "shopt -s name=value" and "shopt -u name" puts them back to 0 (default).
+bool opt_fuzzycomplete = false;
+bool opt_pipestats = false;
+long opt_pipesize = 0;
+
+struct shell_option {
+  const char* name;
+  bool* value;
+  long* number;
+};
+
+struct shell_option shell_options[] = {
+  { "fuzzycomplete", &opt_fuzzycomplete, NULL },
+  { "pipestats", &opt_pipestats, NULL },
+  { "pipesize", NULL, &opt_pipesize },
+  { NULL, NULL, NULL },
+};
+
+void shopt_print(int out_fd, struct shell_option* opt) {
+  if (opt->number && *opt->number)
+    dprintf(out_fd, "%-15s\t%ld\n", opt->name, *opt->number);
+  else if (opt->number)
+    dprintf(out_fd, "%-15s\t%s\n", opt->name, "default");
+  else
+    dprintf(out_fd, "%-15s\t%s\n", opt->name, *opt->value ? "on" : "off");
+}
 
+// Parses a size such as 65536, 256K or 1M
+bool parse_size(const char* text, long* size) {
+  char* end;
+  errno = 0;
+  long value = strtol(text, &end, 10);
+  if (end == text || errno != 0 || value < 0)
+    return false;
+  if (*end == 'K' || *end == 'k')
+    value <<= 10, end++;
+  else if (*end == 'M' || *end == 'm')
+    value <<= 20, end++;
+  if (*end)
+    return false;
+  *size = value;
+  return true;
+}
 
-  for (int i = 0; argv[i]; i++) {
-    if ((strcmp(argv[i], ">") == 0 || strcmp(argv[i], "1>") == 0) && argv[i + 1]) {
-      *out_stdout = argv[i + 1];
-      argv[i] = NULL;
-      argv[i + 1] = NULL;
-      continue;
+// shopt [-s|-u] [name[=value]...]: sets, unsets or reports shell options
+int shopt_builtin(int argc, char** argv, int out_fd, int err_fd) {
+  int mode = 0; // 1 set, -1 unset, 0 report
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+    mode = 1;
+    first = 2;
+  }
+  else if (argc > 1 && strcmp(argv[1], "-u") == 0) {
+    mode = -1;
+    first = 2;
+  }
+
+  int status = 0;
+  for (int i = 0; shell_options[i].name; i++) {
+    if (first >= argc && mode == 0)
+      shopt_print(out_fd, &shell_options[i]);
+  }
+
+  for (int i = first; i < argc && argv[i]; i++) {
+    char* value = strchr(argv[i], '=');
+    size_t name_len = value ? (size_t)(value - argv[i]) : strlen(argv[i]);
+    struct shell_option* opt = NULL;
+    for (int j = 0; shell_options[j].name; j++) {
+      if (strncmp(shell_options[j].name, argv[i], name_len) == 0 && !shell_options[j].name[name_len])
+        opt = &shell_options[j];
     }
-    else if (strcmp(argv[i], "2>") == 0 && argv[i + 1]) {
-      *out_stderr = argv[i + 1];
-      argv[i] = NULL;
-      argv[i + 1] = NULL;
+    if (!opt || (value && (!opt->number || mode <= 0))) {
+      dprintf(err_fd, "shopt: %s: invalid shell option name\n", argv[i]);
+      status = 1;
       continue;
     }
-    else if ((strcmp(argv[i], ">>") == 0 || strcmp(argv[i], "1>>") == 0) && argv[i + 1]) {
-      *out_stdout = argv[i + 1];
-      argv[i] = NULL;
-      argv[i + 1] = NULL;
-      *stdout_append = true;
-      continue;
+    if (mode == 0) {
+      shopt_print(out_fd, opt);
     }
-    else if (strcmp(argv[i], "2>>") == 0 && argv[i + 1]) {
-      *out_stderr = argv[i + 1];
-      argv[i] = NULL;
-      argv[i + 1] = NULL;
-      *stderr_append = true;
-      continue;
+    else if (opt->number) {
+      if (mode < 0) {
+        *opt->number = 0;
+      }
+      else if (!value || !parse_size(value + 1, opt->number)) {
+        dprintf(err_fd, "shopt: %s: expected %s=SIZE\n", argv[i], opt->name);
+        status = 1;
+      }
+    }
+    else {
+      *opt->value = mode > 0;
     }
   }
+  return status;
 }
 
-void handle_sigint(int sig) {
-  (void)sig;
-  write(STDOUT_FILENO, "\n$ ", 3);
+// Command history, oldest first. Entries removed by erasedups or by the
+// HISTSIZE limit leave NULL holes, which are squeezed out once they
+// outnumber the live entries, so removing an entry never shifts the
+// array. A hash set of entry fingerprints finds the earlier copy of a
+// line without scanning.
+char** history_commands = NULL;
+int history_count = 0;       // slots used, holes included
+int history_cap = 0;
+int history_live = 0;        // entries that aren't holes
+int history_first = 0;       // no live entry below this slot
+int last_appended_index = 0; // slot up to which history -a has written
+
+struct history_slot {
+  uint64_t hash;
+  int index; // -1 empty, -2 deleted
+};
+
+struct history_slot* history_set = NULL;
+int history_set_cap = 0;
+int history_set_used = 0; // live and deleted slots
+
+uint64_t hash_line(const char* line) {
+  return hash_name(line, strlen(line));
 }
-const char* builtin[] = { "echo", "exit", "type", "pwd", "cd", "history", "mkdir", "rmdir", "rm", "touch", "cp", "mv", NULL };
-char history_commands[50][1024];
-int history_count = 0;
-int last_appended_index = 0;
 
-void load_history_from_file(const char* filepath) {
-  if (!filepath) return;
+void history_set_insert(uint64_t hash, int index) {
+  int mask = history_set_cap - 1;
+  int i = hash & mask;
+  while (history_set[i].index >= 0)
+    i = (i + 1) & mask;
+  if (history_set[i].index == -1)
+    history_set_used++;
+  history_set[i].hash = hash;
+  history_set[i].index = index;
+}
 
-  FILE* fp = fopen(filepath, "r");
-  if (!fp) return;
+// Rebuilds the set for the current entries, sized for twice as many
+bool history_set_rebuild(int want) {
+  int cap = 64;
+  while (cap < want * 2)
+    cap *= 2;
+  struct history_slot* set = malloc(cap * sizeof(*set));
+  if (!set)
+    return false;
+  free(history_set);
+  history_set = set;
+  history_set_cap = cap;
+  history_set_used = 0;
+  for (int i = 0; i < cap; i++)
+    set[i].index = -1;
+  for (int i = 0; i < history_count; i++) {
+    if (history_commands[i])
+      history_set_insert(hash_line(history_commands[i]), i);
+  }
+  return true;
+}
 
-  char line[1024];
-  while (fgets(line, sizeof(line), fp)) {
-    line[strcspn(line, "\n")] = '\0';
-    if (strlen(line) == 0) continue;
+// Returns the set slot of the live entry equal to line, or -1
+int history_set_find(const char* line, uint64_t hash) {
+  if (history_set_cap == 0)
+    return -1;
+  int mask = history_set_cap - 1;
+  for (int i = hash & mask; history_set[i].index != -1; i = (i + 1) & mask) {
+    int index = history_set[i].index;
+    if (index >= 0 && history_set[i].hash == hash && strcmp(history_commands[index], line) == 0)
+      return i;
+  }
+  return -1;
+}
 
-    if (history_count < 50) {
-      strncpy(history_commands[history_count], line, sizeof(history_commands[0]) - 1);
-      history_commands[history_count][sizeof(history_commands[0]) - 1] = '\0';
-      history_count++;
-    }
-    else {
-      for (int i = 0; i < 49; i++) {
-        strcpy(history_commands[i], history_commands[i + 1]);
-      }
-      strncpy(history_commands[49], line, sizeof(history_commands[0]) - 1);
-      history_commands[49][sizeof(history_commands[0]) - 1] = '\0';
+void history_erase(int index) {
+  // Look for the index itself, as without erasedups a line can be there
+  // more than once
+  int mask = history_set_cap - 1;
+  for (int i = hash_line(history_commands[index]) & mask; history_set[i].index != -1; i = (i + 1) & mask) {
+    if (history_set[i].index == index) {
+      history_set[i].index = -2;
+      break;
     }
   }
+  free(history_commands[index]);
+  history_commands[index] = NULL;
+  history_live--;
+  while (history_first < history_count && !history_commands[history_first])
+    history_first++;
+}
 
-  fclose(fp);
-  last_appended_index = history_count;
+// Closes the holes, keeping last_appended_index on the same entry
+void history_compact() {
+  int out = 0, appended = 0;
+  for (int i = 0; i < history_count; i++) {
+    if (i == last_appended_index)
+      appended = out;
+    if (history_commands[i])
+      history_commands[out++] = history_commands[i];
+  }
+  last_appended_index = last_appended_index >= history_count ? out : appended;
+  history_count = out;
+  history_first = 0;
+  history_set_rebuild(history_count);
 }
 
-void save_history_on_exit(const char* filepath) {
-  if (!filepath) return;
+// Maximum number of entries kept, from HISTSIZE (default 50)
+// Unset keeps the old limit of 50; an empty, non-numeric or negative
+// HISTSIZE means no limit, as in bash
+long history_limit() {
+  const char* size = var_get("HISTSIZE");
+  if (!size)
+    return 50;
+  char* end;
+  long n = strtol(size, &end, 10);
+  return !*size || *end || n < 0 ? LONG_MAX : n;
+}
 
-  FILE* fp_check = fopen(filepath, "r");
-  bool file_exists = (fp_check != NULL);
-  if (fp_check) fclose(fp_check);
+// Appends line to the history. With erase_dups, an earlier copy of the
+// line is removed first.
+void history_push(const char* line, bool erase_dups) {
+  long limit = history_limit();
+  if (limit == 0)
+    return;
 
-  FILE* fp;
-  if (file_exists) {
-    fp = fopen(filepath, "a");
+  uint64_t hash = hash_line(line);
+  if (erase_dups) {
+    for (int slot; (slot = history_set_find(line, hash)) >= 0;)
+      history_erase(history_set[slot].index);
   }
-  else {
-    fp = fopen(filepath, "w");
+  while (history_live > 0 && history_live >= limit)
+    history_erase(history_first);
+
+  if (history_count - history_live > history_live + 16)
+    history_compact();
+  if (history_count == history_cap) {
+    int cap = history_cap ? history_cap * 2 : 64;
+    char** grown = realloc(history_commands, cap * sizeof(char*));
+    if (!grown)
+      return;
+    history_commands = grown;
+    history_cap = cap;
   }
+  if ((history_set_used + 1) * 2 > history_set_cap && !history_set_rebuild(history_live + 1))
+    return;
 
-  if (!fp) return;
+  char* copy = strdup(line);
+  if (!copy)
+    return;
+  history_commands[history_count] = copy;
+  history_set_insert(hash, history_count);
+  history_count++;
+  history_live++;
+}
 
-  int start_index = file_exists ? last_appended_index : 0;
-  for (int i = start_index; i < history_count; i++) {
-    fprintf(fp, "%s\n", history_commands[i]);
+// Returns the live entry before slot i (or the last one for i == -1),
+// or -1 if there is none
+int history_prev(int i) {
+  for (i = i < 0 ? history_count - 1 : i - 1; i >= history_first; i--) {
+    if (history_commands[i])
+      return i;
   }
-
-  fclose(fp);
+  return -1;
 }
 
-int mkdir_recursive(const char* path, mode_t mode) {
-  char tmp[1024];
-  char* p = NULL;
-  size_t len;
+int history_next(int i) {
+  for (i++; i < history_count; i++) {
+    if (history_commands[i])
+      return i;
+  }
+  return -1;
+}
 
-  snprintf(tmp, sizeof(tmp), "%s", path);
-  len = strlen(tmp);
-  if (tmp[len - 1] == '/')
-    tmp[len - 1] = 0;
+// HISTFILE is a log shared by every session. Each command is appended as
+// soon as it is recorded, under an exclusive flock, and a session only
+// reads what others added past its own offset. Once the file holds more
+// than twice HISTFILESIZE lines it is rewritten to a temporary file and
+// renamed over the old one with the lock held. The compacting session
+// then ends the old file with a handoff record, a line starting with a
+// NUL byte that gives the size of the new file, so the other sessions
+// finish reading the old file and carry on from that offset in the new
+// one.
+struct history_log {
+  char* path;
+  int fd;
+  off_t offset;       // bytes already read or written by this session
+  long lines;         // lines in the file
+  off_t handoff;      // from a handoff record just read, else -1
+  long handoff_lines;
+};
+
+struct history_log history_log = { NULL, -1, 0, 0, -1, 0 };
+
+void history_lock(int fd, int op) {
+  while (flock(fd, op) < 0 && errno == EINTR)
+    ;
+}
 
-  for (p = tmp + 1; *p; p++) {
-    if (*p == '/') {
-      *p = 0;
-      if (mkdir(tmp, mode) != 0 && errno != EEXIST) {
-        return -1;
+// Reads the complete lines past offset, adding them to the history if add
+// is set. A line still being written is left for the next read.
+void history_log_read(bool add) {
+  struct strbuf buf = { 0 };
+  if (lseek(history_log.fd, history_log.offset, SEEK_SET) < 0)
+    return;
+  strbuf_read_fd(&buf, history_log.fd);
+
+  size_t pos = 0;
+  for (char* nl; pos < buf.len && (nl = memchr(buf.data + pos, '\n', buf.len - pos)); pos = nl + 1 - buf.data) {
+    *nl = '\0';
+    if (nl > buf.data + pos && buf.data[pos] == '\0') {
+      long long size;
+      long lines;
+      if (sscanf(buf.data + pos + 1, "%lld %ld", &size, &lines) == 2) {
+        history_log.handoff = size;
+        history_log.handoff_lines = lines;
       }
-      *p = '/';
+      continue;
     }
+    history_log.handoff = -1;
+    history_log.lines++;
+    if (add && nl > buf.data + pos)
+      history_push(buf.data + pos, false);
   }
-  if (mkdir(tmp, mode) != 0 && errno != EEXIST) {
-    return -1;
-  }
-  return 0;
+  history_log.offset += pos;
+  free(buf.data);
 }
 
-int rmdir_recursive(const char* path) {
-  DIR* d = opendir(path);
-  size_t path_len = strlen(path);
-  int r = -1;
-
-  if (d) {
-    struct dirent* p;
-    r = 0;
-
-    while (!r && (p = readdir(d))) {
-      int r2 = -1;
-      char* buf;
-      size_t len;
+void history_log_close() {
+  if (history_log.fd >= 0)
+    close(history_log.fd);
+  free(history_log.path);
+  history_log = (struct history_log){ NULL, -1, 0, 0, -1, 0 };
+}
 
-      if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-        continue;
+// Opens path as the history log and reads it through, loading its lines
+// into the history if load is set
+bool history_log_open(const char* path, bool load) {
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return false;
+  history_log_close();
+  history_log.path = strdup(path);
+  history_log.fd = fd;
+  history_lock(fd, LOCK_SH);
+  history_log_read(load);
+  history_lock(fd, LOCK_UN);
+  return true;
+}
 
-      len = path_len + strlen(p->d_name) + 2;
-      buf = malloc(len);
+// Locks the log for HISTFILE with op (LOCK_SH or LOCK_EX) and adds the
+// lines other sessions appended since we last looked. Returns false,
+// with nothing locked, if there is no usable HISTFILE.
+bool history_log_sync(int op) {
+  const char* path = var_get("HISTFILE");
+  if (!path || !*path) {
+    history_log_close();
+    return false;
+  }
+  // A HISTFILE set after startup is only appended to, as in bash
+  if ((history_log.fd < 0 || strcmp(path, history_log.path) != 0) && !history_log_open(path, false))
+    return false;
+
+  while (true) {
+    history_lock(history_log.fd, op);
+    history_log_read(true);
+    struct stat named, ours;
+    if (stat(path, &named) == 0 && fstat(history_log.fd, &ours) == 0 &&
+        named.st_dev == ours.st_dev && named.st_ino == ours.st_ino)
+      return true;
+    // Replaced by a compaction or history -w. Nothing can be appended to
+    // the old file anymore, and all of it has been read now.
+    off_t handoff = history_log.handoff;
+    long lines = history_log.handoff_lines;
+    int fd = handoff >= 0 ? open(path, O_RDWR | O_APPEND | O_CLOEXEC) : -1;
+    if (fd >= 0) {
+      close(history_log.fd);
+      history_log.fd = fd;
+      history_log.offset = handoff;
+      history_log.lines = lines;
+      history_log.handoff = -1;
+    }
+    else if (!history_log_open(path, false))
+      return false;
+  }
+}
 
-      if (buf) {
-        struct stat statbuf;
-        snprintf(buf, len, "%s/%s", path, p->d_name);
+// Replaces path with data by way of a temporary file in the same
+// directory, so readers see either the old file or the new one. Unless
+// the caller already holds the lock on path, it is taken here so that
+// appends in flight land before the switch.
+int history_write_atomic(const char* path, const char* data, size_t len, bool locked) {
+  int lock_fd = locked ? -1 : open(path, O_RDONLY | O_CLOEXEC);
+  if (lock_fd >= 0)
+    history_lock(lock_fd, LOCK_EX);
 
-        if (!stat(buf, &statbuf)) {
-          if (S_ISDIR(statbuf.st_mode))
-            r2 = rmdir_recursive(buf);
-          else
-            r2 = unlink(buf);
-        }
-        free(buf);
+  size_t path_len = strlen(path);
+  char* tmp = malloc(path_len + 8);
+  int status = -1;
+  if (tmp) {
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".XXXXXX", 8);
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+      size_t done = 0;
+      while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          break;
+        done += n;
+      }
+      if (done == len && fsync(fd) == 0 && close(fd) == 0 && rename(tmp, path) == 0)
+        status = 0;
+      else {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
       }
-      r = r2;
     }
-    closedir(d);
+    free(tmp);
   }
 
-  if (!r)
-    r = rmdir(path);
-
-  return r;
+  if (lock_fd >= 0)
+    close(lock_fd);
+  return status;
 }
 
-void handle_command(char* buffer) {
-  char* argvv[20];
-  char input_copy[100];
-
-  strcpy(input_copy, buffer);
-  int argc = tokenize(input_copy, argvv, 20);
+// Lines HISTFILE is trimmed to, from HISTFILESIZE (default HISTSIZE)
+long history_file_limit() {
+  const char* size = var_get("HISTFILESIZE");
+  if (!size)
+    return history_limit();
+  char* end;
+  long n = strtol(size, &end, 10);
+  return !*size || *end || n < 0 ? LONG_MAX : n;
+}
 
-  if (argc == 0)
+// Rewrites the log with only its last keep lines. Called with the
+// exclusive lock held, after everything in the file has been read.
+void history_log_compact(long keep) {
+  struct strbuf buf = { 0 };
+  if (lseek(history_log.fd, 0, SEEK_SET) < 0)
     return;
+  strbuf_read_fd(&buf, history_log.fd);
+
+  size_t start = buf.len;
+  long kept = 0;
+  while (start > 0 && kept < keep) {
+    const char* nl = memrchr(buf.data, '\n', start - 1);
+    start = nl ? nl + 1 - buf.data : 0;
+    kept++;
+  }
 
-  char* out_stdout, * out_stderr;
-  bool stdout_append, stderr_append;
-  parse_redirection(argvv, &out_stdout, &out_stderr, &stdout_append, &stderr_append);
+  if (history_write_atomic(history_log.path, buf.data + start, buf.len - start, true) == 0) {
+    // Nothing else is appended to the old file once it is renamed over,
+    // so the handoff record is always the last line readers find there
+    dprintf(history_log.fd, "%c%lld %ld\n", '\0', (long long)(buf.len - start), kept);
+    // Open the new file before closing the old one drops its lock
+    int fd = open(history_log.path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd >= 0) {
+      close(history_log.fd);
+      history_log.fd = fd;
+      history_log.offset = buf.len - start;
+      history_log.lines = kept;
+    }
+  }
+  free(buf.data);
+}
 
-  int saved_stdout = -1, saved_stderr = -1;
+// Appends line to the log locked by history_log_sync(LOCK_EX), then
+// releases the lock
+void history_log_append(const char* line) {
+  struct iovec iov[2] = { { (void*)line, strlen(line) }, { "\n", 1 } };
+  ssize_t n;
+  while ((n = writev(history_log.fd, iov, 2)) < 0 && errno == EINTR)
+    ;
+  if (n > 0) {
+    history_log.offset += n;
+    history_log.lines++;
+  }
+  long keep = history_file_limit();
+  if (keep <= LONG_MAX / 2 && history_log.lines > keep * 2)
+    history_log_compact(keep);
+  history_lock(history_log.fd, LOCK_UN);
+}
 
-  if (out_stdout) {
-    int flags = O_WRONLY | O_CREAT |
-      (stdout_append ? O_APPEND : O_TRUNC);
-    saved_stdout = dup(1);
-    int fd = open(out_stdout, flags, 0644);
-    dup2(fd, 1);
+// Batched filesystem operations for the file builtins. Operations are
+// submitted to an io_uring in batches so that thousands of paths cost a
+// handful of syscalls; without io_uring (old kernel, disabled by sysctl,
+// opcode not supported) each one runs as a plain syscall instead.
+struct fs_op {
+  int opcode; // IORING_OP_OPENAT, MKDIRAT, UNLINKAT, RENAMEAT or CLOSE
+  int dirfd;
+  const char* path;
+  const char* path2; // rename target
+  int flags;
+  mode_t mode;
+  int fd;     // for CLOSE
+  int result; // >= 0 on success, -errno on failure
+};
+
+#define FS_RING_ENTRIES 256
+
+struct fs_ring {
+  int fd;
+  unsigned entries;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  bool supported[IORING_OP_LAST];
+};
+
+struct fs_ring fs_ring;
+int fs_ring_state = 0; // 0 not tried yet, 1 ready, -1 unavailable
+pthread_mutex_t fs_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool fs_ring_setup() {
+  struct io_uring_params p = { 0 };
+  int fd = syscall(__NR_io_uring_setup, FS_RING_ENTRIES, &p);
+  if (fd < 0)
+    return false;
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  char* cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
     close(fd);
+    return false;
   }
 
-  if (out_stderr) {
-    int flags = O_WRONLY | O_CREAT |
-      (stderr_append ? O_APPEND : O_TRUNC);
-    saved_stderr = dup(2);
-    int fd = open(out_stderr, flags, 0644);
-    dup2(fd, 2);
-    close(fd);
+  struct fs_ring* r = &fs_ring;
+  r->fd = fd;
+  r->entries = p.sq_entries;
+  r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+  r->sqes = sqes;
+  r->cq_head = (unsigned*)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  // The path opcodes arrived over several kernel releases; ask which exist
+  size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, probe_size);
+  if (probe && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+    for (int i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+      r->supported[probe->ops[i].op] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
   }
+  free(probe);
+  return true;
+}
 
-  // EXIT COMMAND
-  if (argc == 1 && strcmp(argvv[0], "exit") == 0) {
-    char* histfile = getenv("HISTFILE");
-    if (histfile) {
-      save_history_on_exit(histfile);
-    }
-    exit(0);
+void fs_op_sync(struct fs_op* op) {
+  int r = -1;
+  switch (op->opcode) {
+  case IORING_OP_OPENAT:
+    r = openat(op->dirfd, op->path, op->flags, op->mode);
+    break;
+  case IORING_OP_MKDIRAT:
+    r = mkdirat(op->dirfd, op->path, op->mode);
+    break;
+  case IORING_OP_UNLINKAT:
+    r = unlinkat(op->dirfd, op->path, op->flags);
+    break;
+  case IORING_OP_RENAMEAT:
+    r = renameat2(op->dirfd, op->path, op->dirfd, op->path2, op->flags);
+    break;
+  case IORING_OP_CLOSE:
+    r = close(op->fd);
+    break;
   }
+  op->result = r < 0 ? -errno : r;
+}
 
-  // ECHO COMMAND
-  if (strcmp(argvv[0], "echo") == 0)
-  {
-    for (int i = 1; argvv[i]; i++)
-    {
-      printf("%s", argvv[i]);
-      if (argvv[i + 1])
-        printf(" ");
+// Submits ops[0..n) (n <= ring entries) and waits for all completions
+void fs_ring_submit(struct fs_op* ops, int n) {
+  struct fs_ring* r = &fs_ring;
+  unsigned tail = *r->sq_tail;
+  for (int i = 0; i < n; i++, tail++) {
+    struct fs_op* op = &ops[i];
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->opcode;
+    sqe->user_data = i;
+    sqe->fd = op->dirfd;
+    sqe->addr = (uintptr_t)op->path;
+    switch (op->opcode) {
+    case IORING_OP_OPENAT:
+      sqe->open_flags = op->flags;
+      sqe->len = op->mode;
+      break;
+    case IORING_OP_MKDIRAT:
+      sqe->len = op->mode;
+      break;
+    case IORING_OP_UNLINKAT:
+      sqe->unlink_flags = op->flags;
+      break;
+    case IORING_OP_RENAMEAT:
+      sqe->len = op->dirfd;
+      sqe->addr2 = (uintptr_t)op->path2;
+      sqe->rename_flags = op->flags;
+      break;
+    case IORING_OP_CLOSE:
+      sqe->fd = op->fd;
+      sqe->addr = 0;
+      break;
     }
-    printf("\n");
+    r->sq_array[idx] = idx;
   }
-  else if (argc >= 2 && strcmp(argvv[0], "type") == 0)
-  { // TYPE COMMAND
-    const char* cmd = argvv[1];
-    int found = 0;
-
-    for (int i = 0;builtin[i] != NULL; i++)
-    { // Checks command for each builtin
-      if (strcmp(builtin[i], cmd) == 0)
-      {
-        found = 1;
-        break;
-      }
-    }
-    if (found)
-    {
-      printf("%s is a shell builtin\n", cmd);
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < n; i++)
+    ops[i].result = -EIO;
+  int to_submit = n, completed = 0;
+  while (completed < n) {
+    int ret = syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0 && to_submit == 0)
+      break; // left as -EIO
+    if (ret < 0) {
+      // Take back what the kernel didn't accept and do it here
+      for (int i = n - to_submit; i < n; i++)
+        fs_op_sync(&ops[i]);
+      __atomic_store_n(r->sq_tail, tail - to_submit, __ATOMIC_RELEASE);
+      completed += to_submit;
+      to_submit = 0;
+      continue;
     }
-    else
-    {
-      char* exe_path = find_executable(cmd);
-      if (exe_path)
-      {
-        printf("%s is %s\n", cmd, exe_path);
-        free(exe_path);
-      }
-      else
-      {
-        printf("%s: not found\n", cmd);
-      }
+    if (ret > 0)
+      to_submit -= ret;
+
+    unsigned head = *r->cq_head;
+    unsigned cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++) {
+      struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+      ops[cqe->user_data].result = cqe->res;
+      completed++;
     }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
   }
-  else if (strcmp(argvv[0], "pwd") == 0)
-  {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL)
-    {
-      printf("%s\n", cwd);
-    }
+}
+
+// A hash set of paths and path prefixes, stored as (pointer, length) keys
+// into strings that outlive the set. Each key carries a few flag bits.
+struct path_key {
+  const char* s;
+  unsigned len;
+  unsigned flags;
+};
+
+struct path_set {
+  struct path_key* slots;
+  size_t cap; // power of two
+  size_t count;
+};
+
+struct path_key* path_set_slot(struct path_set* set, const char* s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  for (size_t i = h & (set->cap - 1);; i = (i + 1) & (set->cap - 1)) {
+    struct path_key* k = &set->slots[i];
+    if (!k->s || (k->len == len && memcmp(k->s, s, len) == 0))
+      return k;
   }
-  else if (strcmp(argvv[0], "cd") == 0)
-  {
-    const char* path = NULL;
+}
 
-    if (argc == 1)
-    {
-      path = getenv("HOME");
-      if (!path)
-      {
-        fprintf(stderr, "cd: HOME not set\n");
-        goto cleanup;
-      }
-    }
-    else if (argc == 2 && strcmp(argvv[1], "~") == 0)
-    {
-      path = getenv("HOME");
-      if (!path)
-      {
-        fprintf(stderr, "cd: HOME not set\n");
-        goto cleanup;
-      }
-    }
-    else if (argc == 2)
-      path = argvv[1];
-    else
-    {
-      fprintf(stderr, "cd: too many arguments\n");
-      goto cleanup;
-    }
+// Flags of the key, 0 when it isn't in the set
+unsigned path_set_get(struct path_set* set, const char* s, size_t len) {
+  return set->cap ? path_set_slot(set, s, len)->flags : 0;
+}
 
-    if (chdir(path) != 0)
-      fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
-  }
-  else if (strcmp(argvv[0], "mkdir") == 0) {
-    if (argc < 2) {
-      fprintf(stderr, "mkdir: missing operand\n");
-      goto cleanup;
+void path_set_add(struct path_set* set, const char* s, size_t len, unsigned flags) {
+  if ((set->count + 1) * 2 > set->cap) {
+    struct path_set grown = { calloc(set->cap ? set->cap * 2 : 256, sizeof(struct path_key)), set->cap ? set->cap * 2 : 256, 0 };
+    if (!grown.slots)
+      return; // only costs a lookup miss later
+    for (size_t i = 0; i < set->cap; i++) {
+      if (set->slots[i].s)
+        *path_set_slot(&grown, set->slots[i].s, set->slots[i].len) = set->slots[i];
     }
+    grown.count = set->count;
+    free(set->slots);
+    *set = grown;
+  }
+  struct path_key* k = path_set_slot(set, s, len);
+  if (!k->s) {
+    k->s = s;
+    k->len = len;
+    set->count++;
+  }
+  k->flags |= flags;
+}
 
-    bool parents = false;
-    int start_idx = 1;
+void path_set_clear(struct path_set* set) {
+  if (set->count)
+    memset(set->slots, 0, set->cap * sizeof(struct path_key));
+  set->count = 0;
+}
 
-    if (strcmp(argvv[1], "-p") == 0) {
-      parents = true;
-      start_idx = 2;
-      if (argc < 3) {
-        fprintf(stderr, "mkdir: missing operand\n");
-        goto cleanup;
-      }
-    }
+void path_set_free(struct path_set* set) {
+  free(set->slots);
+  *set = (struct path_set){ 0 };
+}
 
-    for (int i = start_idx; argvv[i]; i++) {
-      int result;
-      if (parents) {
-        result = mkdir_recursive(argvv[i], 0755);
-      }
-      else {
-        result = mkdir(argvv[i], 0755);
-      }
+size_t trimmed_length(const char* path) {
+  size_t len = strlen(path);
+  while (len > 1 && path[len - 1] == '/')
+    len--;
+  return len;
+}
 
-      if (result != 0) {
-        fprintf(stderr, "mkdir: cannot create directory '%s': %s\n",
-          argvv[i], strerror(errno));
-      }
-    }
+// Operations in one batch run concurrently, so an operation must not
+// share a batch with one on the same path or on an ancestor or descendant
+// of it ("mkdir a a/b", "rmdir a/b a", "mv x y; mv y z"). The batch's
+// paths are kept in a path_set along with all their ancestors.
+#define BATCH_PATH 1
+#define BATCH_ANCESTOR 2
+
+bool batch_conflicts(struct path_set* set, const char* path) {
+  if (!path)
+    return false;
+  size_t len = trimmed_length(path);
+  if (path_set_get(set, path, len))
+    return true;
+  for (size_t i = 1; i < len; i++) {
+    if (path[i] == '/' && path_set_get(set, path, i) & BATCH_PATH)
+      return true;
   }
-  else if (strcmp(argvv[0], "rmdir") == 0) {
-    if (argc < 2) {
-      fprintf(stderr, "rmdir: missing operand\n");
-      goto cleanup;
-    }
+  return false;
+}
 
-    for (int i = 1; argvv[i]; i++) {
-      if (rmdir(argvv[i]) != 0) {
-        fprintf(stderr, "rmdir: failed to remove '%s': %s\n",
-          argvv[i], strerror(errno));
-      }
-    }
+void batch_add_path(struct path_set* set, const char* path) {
+  if (!path)
+    return;
+  size_t len = trimmed_length(path);
+  path_set_add(set, path, len, BATCH_PATH);
+  for (size_t i = 1; i < len; i++) {
+    if (path[i] == '/')
+      path_set_add(set, path, i, BATCH_ANCESTOR);
   }
-  else if (strcmp(argvv[0], "rm") == 0) {
-    if (argc < 2) {
-      fprintf(stderr, "rm: missing operand\n");
-      goto cleanup;
-    }
+}
 
-    bool recursive = false;
-    bool force = false;
-    int start_idx = 1;
+// Runs every op, filling in op->result. Results are identical to running
+// them one by one in order.
+void fs_batch_run(struct fs_op* ops, int n) {
+  pthread_mutex_lock(&fs_ring_lock);
+  // A single operation isn't worth setting up the ring for
+  if (fs_ring_state == 0 && n > 1)
+    fs_ring_state = fs_ring_setup() ? 1 : -1;
+
+  if (fs_ring_state != 1 || n == 1) {
+    pthread_mutex_unlock(&fs_ring_lock);
+    for (int i = 0; i < n; i++)
+      fs_op_sync(&ops[i]);
+    return;
+  }
 
-    // Parse flags
-    for (int i = 1; argvv[i]; i++) {
-      if (argvv[i][0] == '-') {
-        for (int j = 1; argvv[i][j]; j++) {
-          if (argvv[i][j] == 'r' || argvv[i][j] == 'R') {
-            recursive = true;
-          }
-          else if (argvv[i][j] == 'f') {
-            force = true;
-          }
-        }
-        start_idx = i + 1;
-      }
-      else {
-        break;
-      }
+  struct path_set set = { 0 };
+  int start = 0;
+  for (int i = 0; i <= n; i++) {
+    bool flush = i == n || i - start == (int)fs_ring.entries || !fs_ring.supported[ops[i].opcode] ||
+      batch_conflicts(&set, ops[i].path) || batch_conflicts(&set, ops[i].path2);
+    if (flush && i > start) {
+      fs_ring_submit(ops + start, i - start);
+      path_set_clear(&set);
+    }
+    if (flush)
+      start = i;
+    if (i == n)
+      break;
+    if (!fs_ring.supported[ops[i].opcode]) {
+      fs_op_sync(&ops[i]);
+      start = i + 1;
+      continue;
     }
+    batch_add_path(&set, ops[i].path);
+    batch_add_path(&set, ops[i].path2);
+  }
+  path_set_free(&set);
+  pthread_mutex_unlock(&fs_ring_lock);
+}
+
+// Component boundaries are the slashes that don't follow another slash
+bool is_component_end(const char* path, size_t i) {
+  return path[i] == '/' && i > 0 && path[i - 1] != '/';
+}
 
-    if (!argvv[start_idx]) {
-      fprintf(stderr, "rm: missing operand\n");
-      goto cleanup;
+// mkdir -p for one path. known holds the directories that earlier paths
+// of the same command found or created, so shared ancestors cost nothing
+// the second time. Otherwise the deepest existing ancestor is found by
+// probing backwards with mkdir() itself, which also creates the first
+// missing level it reaches, and the remaining levels are made with
+// mkdirat() relative to an fd on that ancestor. Paths longer than
+// PATH_MAX work because the fd is moved down whenever the relative part
+// would get too long.
+int mkdir_parents(const char* path, mode_t mode, struct path_set* known) {
+  size_t len = trimmed_length(path);
+  if (path_set_get(known, path, len))
+    return 0;
+  char* buf = strndup(path, len);
+  if (!buf)
+    return -1;
+
+  size_t done = 0; // length of the deepest prefix known to exist
+  for (size_t i = len; i-- > 1;) {
+    if (is_component_end(buf, i) && i < PATH_MAX && path_set_get(known, path, i)) {
+      done = i;
+      break;
     }
+  }
 
-    for (int i = start_idx; argvv[i]; i++) {
-      struct stat st;
-      if (stat(argvv[i], &st) == 0) {
-        if (S_ISDIR(st.st_mode)) {
-          if (recursive) {
-            if (rmdir_recursive(argvv[i]) != 0 && !force) {
-              fprintf(stderr, "rm: cannot remove '%s': %s\n",
-                argvv[i], strerror(errno));
-            }
-          }
-          else {
-            fprintf(stderr, "rm: cannot remove '%s': Is a directory\n", argvv[i]);
-          }
+  int r = 0;
+  if (!done) {
+    size_t e = len;
+    while (e > 0) {
+      if (e < PATH_MAX) {
+        buf[e] = '\0';
+        int res = mkdir(buf, mode);
+        int err = errno;
+        if (e < len)
+          buf[e] = '/';
+        if (res == 0 || err == EEXIST) {
+          path_set_add(known, path, e, 1);
+          done = e;
+          break;
         }
-        else {
-          if (unlink(argvv[i]) != 0 && !force) {
-            fprintf(stderr, "rm: cannot remove '%s': %s\n",
-              argvv[i], strerror(errno));
-          }
+        if (err != ENOENT && err != ENAMETOOLONG) {
+          errno = err;
+          r = -1;
+          break;
         }
       }
-      else if (!force) {
-        fprintf(stderr, "rm: cannot remove '%s': %s\n",
-          argvv[i], strerror(errno));
-      }
+      do
+        e--;
+      while (e > 0 && !is_component_end(buf, e));
     }
   }
 
-  else if (strcmp(argvv[0], "touch") == 0) {
-    if (argc < 2) {
-      fprintf(stderr, "touch: missing operand\n");
-      goto cleanup;
+  if (r == 0 && done < len) {
+    int anchor = AT_FDCWD;
+    size_t rel = buf[0] == '/' ? 1 : 0; // where the part relative to anchor starts
+    if (done) {
+      buf[done] = '\0';
+      anchor = open(buf, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      buf[done] = '/';
+      rel = done + 1;
     }
-
-    for (int i = 1; argvv[i]; i++) {
-      int fd = open(argvv[i], O_WRONLY | O_CREAT, 0644);
-      if (fd < 0) {
-        fprintf(stderr, "touch: cannot touch '%s': %s\n",
-          argvv[i], strerror(errno));
-      }
-      else {
-        close(fd);
+    else if (buf[0] == '/') {
+      anchor = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    while (buf[rel] == '/')
+      rel++;
+    if (anchor == -1)
+      r = -1;
+
+    size_t prev = 0;
+    for (size_t i = rel + 1; r == 0 && i <= len; i++) {
+      if (i < len && !is_component_end(buf, i))
+        continue;
+      if (prev && i - rel >= PATH_MAX) {
+        buf[prev] = '\0';
+        int next = openat(anchor, buf + rel, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        buf[prev] = '/';
+        if (anchor >= 0)
+          close(anchor);
+        anchor = next;
+        for (rel = prev + 1; buf[rel] == '/'; rel++)
+          ;
+        if (anchor < 0) {
+          r = -1;
+          break;
+        }
       }
+      char saved = buf[i];
+      buf[i] = '\0';
+      if (mkdirat(anchor, buf + rel, mode) != 0 && errno != EEXIST)
+        r = -1;
+      buf[i] = saved;
+      if (r == 0)
+        path_set_add(known, path, i, 1);
+      prev = i;
     }
+    int saved = errno;
+    if (anchor >= 0)
+      close(anchor);
+    errno = saved;
   }
 
-  else if (strcmp(argvv[0], "cp") == 0) {
-    if (argc < 3) {
-      fprintf(stderr, "cp: missing operand\n");
-      goto cleanup;
-    }
+  int saved = errno;
+  free(buf);
+  errno = saved;
+  return r;
+}
 
-    const char* src = argvv[1];
-    const char* dst = argvv[2];
+// Removes path and everything below it. Subdirectories are handled first;
+// the remaining entries of each directory are then unlinked as one batch
+// relative to the directory's fd. Symlinks are removed, never followed.
+int rmdir_recursive(const char* path) {
+  DIR* d = opendir(path);
+  if (!d)
+    return -1;
 
-    int src_fd = open(src, O_RDONLY);
-    if (src_fd < 0) {
-      fprintf(stderr, "cp: cannot open '%s': %s\n", src, strerror(errno));
-      goto cleanup;
+  int dfd = dirfd(d);
+  size_t path_len = strlen(path);
+  struct fs_op* ops = NULL;
+  int count = 0, cap = 0;
+  int r = 0, saved_errno = 0;
+
+  struct dirent* p;
+  while ((p = readdir(d))) {
+    if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
+      continue;
+
+    bool is_dir = p->d_type == DT_DIR;
+    if (p->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_dir = fstatat(dfd, p->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
     }
 
-    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (dst_fd < 0) {
-      fprintf(stderr, "cp: cannot create '%s': %s\n", dst, strerror(errno));
-      close(src_fd);
-      goto cleanup;
+    if (is_dir) {
+      size_t len = path_len + strlen(p->d_name) + 2;
+      char* buf = malloc(len);
+      if (!buf || (snprintf(buf, len, "%s/%s", path, p->d_name), rmdir_recursive(buf) != 0)) {
+        r = -1;
+        saved_errno = buf ? errno : ENOMEM;
+      }
+      free(buf);
+      continue;
     }
 
-    char buf[4096];
-    ssize_t n;
-    while ((n = read(src_fd, buf, sizeof(buf))) > 0) {
-      if (write(dst_fd, buf, n) != n) {
-        fprintf(stderr, "cp: write error: %s\n", strerror(errno));
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      struct fs_op* grown = realloc(ops, cap * sizeof(*ops));
+      if (!grown) {
+        r = -1;
+        saved_errno = ENOMEM;
         break;
       }
+      ops = grown;
     }
-
-    close(src_fd);
-    close(dst_fd);
+    ops[count++] = (struct fs_op){ .opcode = IORING_OP_UNLINKAT, .dirfd = dfd, .path = strdup(p->d_name) };
   }
 
-  else if (strcmp(argvv[0], "mv") == 0) {
-    if (argc < 3) {
-      fprintf(stderr, "mv: missing operand\n");
-      goto cleanup;
+  fs_batch_run(ops, count);
+  for (int i = 0; i < count; i++) {
+    if (ops[i].result < 0) {
+      r = -1;
+      saved_errno = -ops[i].result;
     }
+    free((char*)ops[i].path);
+  }
+  free(ops);
+  closedir(d);
 
-    const char* src = argvv[1];
-    const char* dst = argvv[2];
+  if (!r)
+    return rmdir(path);
+  errno = saved_errno;
+  return r;
+}
+
+// Byte counting kernel shared by the text builtins, dispatched at startup
+// like find_byte2: one compare and popcount per 16 or 32 input bytes.
+size_t count_byte_scalar(const char* s, size_t n, char c) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++)
+    count += s[i] == c;
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+size_t count_byte_sse2(const char* s, size_t n, char c) {
+  __m128i vc = _mm_set1_epi8(c);
+  size_t count = 0, i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)));
+  }
+  return count + count_byte_scalar(s + i, n - i, c);
+}
 
-    if (rename(src, dst) != 0) {
-      fprintf(stderr, "mv: cannot move '%s' to '%s': %s\n",
-        src, dst, strerror(errno));
+// Matches are accumulated as per-byte counters (cmpeq yields -1) and folded
+// into 64-bit lanes with psadbw before any counter can wrap
+__attribute__((target("avx2")))
+size_t count_byte_avx2(const char* s, size_t n, char c) {
+  __m256i vc = _mm256_set1_epi8(c);
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  while (i + 32 <= n) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int k = 0; k < 255 && i + 32 <= n; k++, i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, vc));
     }
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
   }
-  else if (strcmp(argvv[0], "history") == 0) {
-    if (argc >= 3 && strcmp(argvv[1], "-r") == 0) {
-      const char* filepath = argvv[2];
-      FILE* fp = fopen(filepath, "r");
+  size_t count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+    _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+  return count + count_byte_sse2(s + i, n - i, c);
+}
+#endif
+
+size_t (*count_byte)(const char*, size_t, char) = count_byte_scalar;
+
+// Returns a pointer to the nth occurrence (n >= 1) of c in s, or NULL with
+// *seen set to how many there were. Whole blocks are skipped by count.
+const char* find_nth_byte(const char* s, size_t len, char c, size_t n, size_t* seen) {
+  size_t found = 0, pos = 0;
+  while (pos < len) {
+    size_t block = len - pos < 4096 ? len - pos : 4096;
+    size_t k = count_byte(s + pos, block, c);
+    if (found + k >= n) {
+      const char* p = s + pos;
+      while (true) {
+        p = memchr(p, c, s + pos + block - p);
+        if (++found == n)
+          return p;
+        p++;
+      }
+    }
+    found += k;
+    pos += block;
+  }
+  *seen = found;
+  return NULL;
+}
 
-      if (!fp) {
-        fprintf(stderr, "history: %s: %s\n", filepath, strerror(errno));
-        goto cleanup;
+// Same as find_nth_byte, counting back from the end of s
+const char* find_nth_byte_reverse(const char* s, size_t len, char c, size_t n, size_t* seen) {
+  size_t found = 0, end = len;
+  while (end > 0) {
+    size_t block = end < 4096 ? end : 4096;
+    size_t k = count_byte(s + end - block, block, c);
+    if (found + k >= n) {
+      size_t left = block;
+      while (true) {
+        const char* p = memrchr(s + end - block, c, left);
+        if (++found == n)
+          return p;
+        left = p - (s + end - block);
       }
+    }
+    found += k;
+    end -= block;
+  }
+  *seen = found;
+  return NULL;
+}
 
-      char line[1024];
-      while (fgets(line, sizeof(line), fp)) {
-        line[strcspn(line, "\n")] = '\0';
-        if (strlen(line) == 0) continue;
+int write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
 
-        if (history_count < 50) {
-          strncpy(history_commands[history_count], line, sizeof(history_commands[0]) - 1);
-          history_commands[history_count][sizeof(history_commands[0]) - 1] = '\0';
-          history_count++;
-        }
-        else {
-          for (int i = 0; i < 49; i++) {
-            strcpy(history_commands[i], history_commands[i + 1]);
-          }
-          strncpy(history_commands[49], line, sizeof(history_commands[0]) - 1);
-          history_commands[49][sizeof(history_commands[0]) - 1] = '\0';
-        }
+#define TEXT_BLOCK (128 * 1024)
+
+// Feeds everything readable from fd to fn: a regular file in one piece
+// through mmap, anything else in large read() blocks. fn returns false to
+// stop early. Returns -1 with errno set if reading fails.
+int for_each_chunk(int fd, bool (*fn)(const char*, size_t, void*), void* ctx) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start >= 0 && start < st.st_size) {
+      void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        fn((const char*)map + start, st.st_size - start, ctx);
+        munmap(map, st.st_size);
+        return 0;
       }
-
-      fclose(fp);
     }
-    else if (argc >= 3 && strcmp(argvv[1], "-w") == 0) {
-      const char* filepath = argvv[2];
-      FILE* fp = fopen(filepath, "w");
+  }
 
-      if (!fp) {
-        fprintf(stderr, "history: %s: %s\n", filepath, strerror(errno));
-        goto cleanup;
-      }
+  char* buf = malloc(TEXT_BLOCK);
+  if (!buf)
+    return -1;
+  int result = 0;
+  while (true) {
+    ssize_t n = read(fd, buf, TEXT_BLOCK);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      result = -1;
+    if (n <= 0 || !fn(buf, n, ctx))
+      break;
+  }
+  int saved = errno;
+  free(buf);
+  errno = saved;
+  return result;
+}
 
-      for (int i = 0; i < history_count; i++) {
-        fprintf(fp, "%s\n", history_commands[i]);
+// Runs the external program of the same name instead, for options the
+// builtin versions don't implement and for reading from a terminal
+int delegate_external(char** argv, int in_fd, int out_fd, int err_fd) {
+  char* exe = find_executable(argv[0]);
+  if (!exe) {
+    dprintf(err_fd, "%s: unsupported option\n", argv[0]);
+    return 1;
+  }
+  int fds[3] = { in_fd, out_fd, err_fd };
+  pid_t pid = spawn_command(exe, argv, fds);
+  free(exe);
+  return pid < 0 ? 126 : wait_for_child(pid);
+}
+
+// Copies in to out, moving data inside the kernel when it can: splice
+// whenever either end is a pipe, sendfile from regular files, and plain
+// read/write otherwise. Returns -1 on a read error, -2 on a write error.
+int copy_fd(int in, int out) {
+  struct stat in_st, out_st;
+  bool in_pipe = fstat(in, &in_st) == 0 && S_ISFIFO(in_st.st_mode);
+  bool out_pipe = fstat(out, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+  bool in_reg = !in_pipe && S_ISREG(in_st.st_mode);
+
+  if (in_pipe || out_pipe) {
+    while (true) {
+      ssize_t n = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n == 0)
+        return 0;
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EINVAL)
+          break; // e.g. a terminal on the other end
+        return errno == EPIPE ? -2 : -1;
       }
+    }
+  }
+  else if (in_reg) {
+    while (true) {
+      ssize_t n = sendfile(out, in, NULL, 1 << 30);
+      if (n == 0)
+        return 0;
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EINVAL || errno == ENOSYS)
+          break;
+        return -2;
+      }
+    }
+  }
 
-      fclose(fp);
+  char* buf = malloc(TEXT_BLOCK);
+  if (!buf)
+    return -1;
+  int result = 0;
+  while (true) {
+    ssize_t n = read(in, buf, TEXT_BLOCK);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      result = -1;
+    if (n <= 0)
+      break;
+    if (write_all(out, buf, n) != 0) {
+      result = -2;
+      break;
     }
-    else if (argc >= 3 && strcmp(argvv[1], "-a") == 0) {
-      const char* filepath = argvv[2];
-      FILE* fp = fopen(filepath, "a");
+  }
+  free(buf);
+  return result;
+}
 
-      if (!fp) {
-        fprintf(stderr, "history: %s: %s\n", filepath, strerror(errno));
-        goto cleanup;
-      }
+// Opens a file operand of the text builtins; "-" is standard input
+int open_text_input(const char* name, int in_fd) {
+  if (strcmp(name, "-") == 0)
+    return dup(in_fd);
+  return open(name, O_RDONLY | O_CLOEXEC);
+}
 
-      for (int i = last_appended_index; i < history_count; i++) {
-        fprintf(fp, "%s\n", history_commands[i]);
-      }
+int cat_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd) {
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && argv[i][1])
+      return delegate_external(argv, in_fd, out_fd, err_fd);
+  }
+  if (argc == 1 && isatty(in_fd))
+    return delegate_external(argv, in_fd, out_fd, err_fd);
+
+  int status = 0;
+  for (int i = argc == 1 ? 0 : 1; i < argc; i++) {
+    const char* name = i == 0 ? "-" : argv[i];
+    int fd = open_text_input(name, in_fd);
+    if (fd < 0) {
+      dprintf(err_fd, "cat: %s: %s\n", name, strerror(errno));
+      status = 1;
+      continue;
+    }
+    int r = copy_fd(fd, out_fd);
+    close(fd);
+    if (r == -2)
+      return 1; // reader went away
+    if (r == -1) {
+      dprintf(err_fd, "cat: %s: %s\n", name, strerror(errno));
+      status = 1;
+    }
+  }
+  return status;
+}
 
-      fclose(fp);
-      last_appended_index = history_count;
+// Parses the count of a -n/-c style option, either attached ("-n5") or as
+// the next word. Returns false if it isn't a plain non-negative number.
+bool parse_count_option(char** argv, int* i, size_t skip, long long* value, bool* from_start) {
+  const char* text = argv[*i][skip] ? argv[*i] + skip : argv[++*i];
+  if (!text)
+    return false;
+  if (from_start)
+    *from_start = *text == '+';
+  if (*text == '+')
+    text++;
+  char* end;
+  errno = 0;
+  *value = strtoll(text, &end, 10);
+  return *text >= '0' && *text <= '9' && !*end && errno == 0;
+}
+
+struct head_state {
+  int out_fd;
+  bool bytes;
+  unsigned long long remaining;
+  bool write_failed;
+};
+
+bool head_chunk(const char* data, size_t len, void* arg) {
+  struct head_state* st = arg;
+  size_t take = len;
+  if (st->bytes) {
+    if (take > st->remaining)
+      take = st->remaining;
+    st->remaining -= take;
+  }
+  else {
+    size_t seen = 0;
+    const char* nl = find_nth_byte(data, len, '\n', st->remaining, &seen);
+    if (nl) {
+      take = nl - data + 1;
+      st->remaining = 0;
     }
     else {
-      int n = history_count;
+      st->remaining -= seen;
+    }
+  }
+  if (take > 0 && write_all(st->out_fd, data, take) != 0) {
+    st->write_failed = true;
+    return false;
+  }
+  return st->remaining > 0;
+}
 
-      if (argc == 2) {
-        n = atoi(argvv[1]);
-        if (n < 0) n = 0;
-      }
+int head_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd) {
+  long long count = 10;
+  bool bytes = false;
+  char* files[256];
+  int nfiles = 0;
+
+  for (int i = 1; i < argc; i++) {
+    char* arg = argv[i];
+    bool ok = true;
+    if (strncmp(arg, "-n", 2) == 0)
+      ok = parse_count_option(argv, &i, 2, &count, NULL), bytes = false;
+    else if (strncmp(arg, "-c", 2) == 0)
+      ok = parse_count_option(argv, &i, 2, &count, NULL), bytes = true;
+    else if (arg[0] == '-' && arg[1] >= '0' && arg[1] <= '9')
+      ok = parse_count_option(argv, &i, 1, &count, NULL), bytes = false;
+    else if (arg[0] == '-' && arg[1])
+      ok = false;
+    else if (nfiles < 256)
+      files[nfiles++] = arg;
+    if (!ok)
+      return delegate_external(argv, in_fd, out_fd, err_fd);
+  }
+  if (nfiles == 0) {
+    if (isatty(in_fd))
+      return delegate_external(argv, in_fd, out_fd, err_fd);
+    files[nfiles++] = "-";
+  }
+
+  int status = 0;
+  for (int f = 0; f < nfiles; f++) {
+    int fd = open_text_input(files[f], in_fd);
+    if (fd < 0) {
+      dprintf(err_fd, "head: cannot open '%s' for reading: %s\n", files[f], strerror(errno));
+      status = 1;
+      continue;
+    }
+    if (nfiles > 1)
+      dprintf(out_fd, "%s==> %s <==\n", f > 0 ? "\n" : "", strcmp(files[f], "-") ? files[f] : "standard input");
+
+    struct head_state st = { .out_fd = out_fd, .bytes = bytes, .remaining = count };
+    if (count > 0 && for_each_chunk(fd, head_chunk, &st) != 0) {
+      dprintf(err_fd, "head: error reading '%s': %s\n", files[f], strerror(errno));
+      status = 1;
+    }
+    close(fd);
+    if (st.write_failed)
+      return 1;
+  }
+  return status;
+}
+
+// Reads all of fd into memory, mapping it when it's a regular file
+char* slurp_fd(int fd, size_t* len, bool* mapped) {
+  struct stat st;
+  *mapped = false;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    *len = st.st_size;
+    if (st.st_size == 0)
+      return calloc(1, 1);
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      *mapped = true;
+      return map;
+    }
+  }
+
+  size_t cap = TEXT_BLOCK, used = 0;
+  char* buf = malloc(cap);
+  while (buf) {
+    if (used == cap) {
+      char* grown = realloc(buf, cap * 2);
+      if (!grown)
+        break;
+      buf = grown;
+      cap *= 2;
+    }
+    ssize_t n = read(fd, buf + used, cap - used);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      free(buf);
+      return NULL;
+    }
+    if (n == 0)
+      break;
+    used += n;
+  }
+  *len = used;
+  return buf;
+}
+
+int tail_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd) {
+  long long count = 10;
+  bool bytes = false, from_start = false;
+  char* files[256];
+  int nfiles = 0;
+
+  for (int i = 1; i < argc; i++) {
+    char* arg = argv[i];
+    bool ok = true;
+    if (strncmp(arg, "-n", 2) == 0)
+      ok = parse_count_option(argv, &i, 2, &count, &from_start), bytes = false;
+    else if (strncmp(arg, "-c", 2) == 0)
+      ok = parse_count_option(argv, &i, 2, &count, &from_start), bytes = true;
+    else if (arg[0] == '-' && arg[1] >= '0' && arg[1] <= '9')
+      ok = parse_count_option(argv, &i, 1, &count, NULL), bytes = false;
+    else if (arg[0] == '-' && arg[1])
+      ok = false; // -f and friends
+    else if (nfiles < 256)
+      files[nfiles++] = arg;
+    if (!ok)
+      return delegate_external(argv, in_fd, out_fd, err_fd);
+  }
+  if (nfiles == 0) {
+    if (isatty(in_fd))
+      return delegate_external(argv, in_fd, out_fd, err_fd);
+    files[nfiles++] = "-";
+  }
+
+  int status = 0;
+  for (int f = 0; f < nfiles; f++) {
+    int fd = open_text_input(files[f], in_fd);
+    if (fd < 0) {
+      dprintf(err_fd, "tail: cannot open '%s' for reading: %s\n", files[f], strerror(errno));
+      status = 1;
+      continue;
+    }
+    size_t len;
+    bool mapped;
+    char* data = slurp_fd(fd, &len, &mapped);
+    close(fd);
+    if (!data) {
+      dprintf(err_fd, "tail: error reading '%s': %s\n", files[f], strerror(errno));
+      status = 1;
+      continue;
+    }
+    if (nfiles > 1)
+      dprintf(out_fd, "%s==> %s <==\n", f > 0 ? "\n" : "", strcmp(files[f], "-") ? files[f] : "standard input");
+
+    size_t start;
+    if (bytes) {
+      if (from_start)
+        start = count > 0 ? (size_t)count - 1 : 0;
+      else
+        start = (size_t)count >= len ? 0 : len - count;
+      if (start > len)
+        start = len;
+    }
+    else if (from_start) {
+      // +N: from line N onwards, i.e. after the (N-1)th newline
+      size_t seen;
+      const char* nl = count > 1 ? find_nth_byte(data, len, '\n', count - 1, &seen) : data - 1;
+      start = nl ? (size_t)(nl - data + 1) : len;
+    }
+    else {
+      // The last N lines start after the (N+1)th newline from the end,
+      // not counting a newline that terminates the final line
+      size_t body = len > 0 && data[len - 1] == '\n' ? len - 1 : len;
+      size_t seen;
+      const char* nl = count > 0 ? find_nth_byte_reverse(data, body, '\n', count, &seen) : data + body;
+      start = nl ? (size_t)(nl - data + 1) : 0;
+      if (count == 0)
+        start = len;
+    }
+
+    bool write_failed = write_all(out_fd, data + start, len - start) != 0;
+    if (mapped)
+      munmap(data, len);
+    else
+      free(data);
+    if (write_failed)
+      return 1;
+  }
+  return status;
+}
+
+struct wc_counts {
+  unsigned long long lines, words, bytes;
+  bool in_word;
+  bool count_words;
+};
+
+bool wc_chunk(const char* data, size_t len, void* arg) {
+  struct wc_counts* wc = arg;
+  wc->lines += count_byte(data, len, '\n');
+  wc->bytes += len;
+  if (wc->count_words) {
+    bool in_word = wc->in_word;
+    for (size_t i = 0; i < len; i++) {
+      unsigned char c = data[i];
+      bool space = c == ' ' || (c >= '\t' && c <= '\r');
+      if (!space && !in_word)
+        wc->words++;
+      in_word = !space;
+    }
+    wc->in_word = in_word;
+  }
+  return true;
+}
+
+void wc_print(int out_fd, struct wc_counts* wc, bool lines, bool words, bool bytes, int width, const char* name) {
+  char line[128];
+  int pos = 0;
+  unsigned long long values[3] = { wc->lines, wc->words, wc->bytes };
+  bool shown[3] = { lines, words, bytes };
+  for (int k = 0; k < 3; k++) {
+    if (!shown[k])
+      continue;
+    pos += snprintf(line + pos, sizeof(line) - pos, "%s%*llu", pos ? " " : "", width, values[k]);
+  }
+  if (name)
+    dprintf(out_fd, "%s %s\n", line, name);
+  else
+    dprintf(out_fd, "%s\n", line);
+}
+
+int wc_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd) {
+  bool lines = false, words = false, bytes = false;
+  char* files[256];
+  int nfiles = 0;
+
+  for (int i = 1; i < argc; i++) {
+    char* arg = argv[i];
+    if (arg[0] == '-' && arg[1]) {
+      for (int j = 1; arg[j]; j++) {
+        if (arg[j] == 'l')
+          lines = true;
+        else if (arg[j] == 'w')
+          words = true;
+        else if (arg[j] == 'c')
+          bytes = true;
+        else
+          return delegate_external(argv, in_fd, out_fd, err_fd);
+      }
+    }
+    else if (nfiles < 256) {
+      files[nfiles++] = arg;
+    }
+  }
+  if (!lines && !words && !bytes)
+    lines = words = bytes = true;
+  if (nfiles == 0 && isatty(in_fd))
+    return delegate_external(argv, in_fd, out_fd, err_fd);
+
+  // Column width follows coreutils: one number for a single count of a
+  // single input, 7 when any input isn't a regular file, otherwise wide
+  // enough for the total size of all the files
+  int shown = lines + words + bytes;
+  int width = 1;
+  if (shown > 1 || nfiles > 1) {
+    unsigned long long total_size = 0;
+    bool all_regular = nfiles > 0;
+    for (int f = 0; f < nfiles; f++) {
+      struct stat st;
+      if (strcmp(files[f], "-") == 0 || stat(files[f], &st) != 0 || !S_ISREG(st.st_mode))
+        all_regular = false;
+      else
+        total_size += st.st_size;
+    }
+    if (!all_regular)
+      width = 7;
+    else
+      for (unsigned long long v = total_size; v >= 10; v /= 10)
+        width++;
+  }
+
+  struct wc_counts total = { 0 };
+  int status = 0;
+  for (int f = 0; f < (nfiles ? nfiles : 1); f++) {
+    const char* name = nfiles ? files[f] : "-";
+    int fd = open_text_input(name, in_fd);
+    if (fd < 0) {
+      dprintf(err_fd, "wc: %s: %s\n", name, strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    struct wc_counts wc = { .count_words = words };
+    struct stat st;
+    if (!lines && !words && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+      wc.bytes = st.st_size; // byte count alone needs no reading
+    else if (for_each_chunk(fd, wc_chunk, &wc) != 0) {
+      dprintf(err_fd, "wc: %s: %s\n", name, strerror(errno));
+      status = 1;
+    }
+    close(fd);
+
+    wc_print(out_fd, &wc, lines, words, bytes, width, nfiles ? name : NULL);
+    total.lines += wc.lines;
+    total.words += wc.words;
+    total.bytes += wc.bytes;
+  }
+  if (nfiles > 1)
+    wc_print(out_fd, &total, lines, words, bytes, width, "total");
+  return status;
+}
+
+// One destination of tee: standard output or a named file
+struct tee_output {
+  const char* name;
+  int fd;
+  int scratch[2]; // private pipe holding this output's copy of a round
+  size_t pending; // bytes of the current round waiting in scratch
+  unsigned long long bytes;
+  bool failed;
+};
+
+// splice(2) can move pipe data into pipes and into regular files that
+// aren't in append mode
+bool can_splice_to(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return false;
+  if (S_ISFIFO(st.st_mode))
+    return true;
+  return S_ISREG(st.st_mode) && !(fcntl(fd, F_GETFL) & O_APPEND);
+}
+
+// Moves up to len bytes from pipe in to out; returns how many made it
+size_t splice_exact(int in, int out, size_t len) {
+  size_t moved = 0;
+  while (moved < len) {
+    ssize_t n = splice(in, NULL, out, NULL, len - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    moved += n;
+  }
+  return moved;
+}
+
+// Throws away len bytes still sitting in pipe fd after a failed output
+void discard_bytes(int fd, size_t len) {
+  char sink[4096];
+  while (len > 0) {
+    ssize_t n = read(fd, sink, len < sizeof(sink) ? len : sizeof(sink));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    len -= n;
+  }
+}
+
+void tee_output_failed(struct tee_output* o, int err_fd) {
+  if (errno != EPIPE)
+    dprintf(err_fd, "tee: %s: %s\n", o->name, strerror(errno));
+  o->failed = true;
+}
+
+// Duplicates pipe in to every output without the data entering the
+// shell: each round tee(2) gives all outputs but the last a private copy
+// of what is queued in the pipe, and the last output consumes the
+// original with splice(2). A copy comes up short only if a scratch pipe
+// is smaller than the input, and then that round goes through a buffer.
+void tee_splice(int in, struct tee_output* outs, int nouts, int err_fd) {
+  int in_size = fcntl(in, F_GETPIPE_SZ);
+  for (int i = 0; i < nouts - 1; i++) {
+    if (pipe2(outs[i].scratch, O_CLOEXEC) != 0) {
+      tee_output_failed(&outs[i], err_fd);
+      continue;
+    }
+    if (in_size > 0)
+      fcntl(outs[i].scratch[1], F_SETPIPE_SZ, in_size);
+  }
+
+  char* buf = NULL;
+  while (!outs[0].failed) {
+    int live[256], nlive = 0;
+    for (int i = 0; i < nouts; i++) {
+      if (!outs[i].failed)
+        live[nlive++] = i;
+    }
+    struct tee_output* last = &outs[live[nlive - 1]];
+    bool short_copy = false;
+    ssize_t n = 0;
+
+    for (int k = 0; k < nlive - 1; k++) {
+      struct tee_output* o = &outs[live[k]];
+      ssize_t m;
+      do {
+        m = tee(in, o->scratch[1], k == 0 ? 1 << 20 : (size_t)n, 0);
+      } while (m < 0 && errno == EINTR);
+      if (m < 0)
+        m = 0;
+      if (k == 0)
+        n = m;
+      o->pending = m;
+      short_copy |= m < n;
+    }
+
+    if (nlive == 1) {
+      do {
+        n = splice(in, NULL, last->fd, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+      } while (n < 0 && errno == EINTR);
+      if (n <= 0) {
+        if (n < 0)
+          tee_output_failed(last, err_fd);
+        break;
+      }
+      last->bytes += n;
+      continue;
+    }
+    if (n == 0)
+      break; // end of input
+
+    if (!short_copy) {
+      size_t moved = splice_exact(in, last->fd, n);
+      last->bytes += moved;
+      if (moved < (size_t)n) {
+        tee_output_failed(last, err_fd);
+        discard_bytes(in, n - moved);
+      }
+    }
+    else {
+      if (!buf && !(buf = malloc(1 << 20)))
+        break;
+      size_t got = 0;
+      while (got < (size_t)n) {
+        ssize_t r = read(in, buf + got, n - got);
+        if (r < 0 && errno == EINTR)
+          continue;
+        if (r <= 0)
+          break;
+        got += r;
+      }
+      if (write_all(last->fd, buf, got) != 0)
+        tee_output_failed(last, err_fd);
+      else
+        last->bytes += got;
+    }
+
+    for (int k = 0; k < nlive - 1; k++) {
+      struct tee_output* o = &outs[live[k]];
+      if (o->failed)
+        continue;
+      size_t moved = splice_exact(o->scratch[0], o->fd, o->pending);
+      o->bytes += moved;
+      if (moved < o->pending) {
+        tee_output_failed(o, err_fd);
+        discard_bytes(o->scratch[0], o->pending - moved);
+        continue;
+      }
+      if (o->pending < (size_t)n) {
+        if (write_all(o->fd, buf + o->pending, n - o->pending) != 0)
+          tee_output_failed(o, err_fd);
+        else
+          o->bytes += n - o->pending;
+      }
+    }
+  }
+
+  free(buf);
+  for (int i = 0; i < nouts - 1; i++) {
+    if (outs[i].scratch[0] >= 0) {
+      close(outs[i].scratch[0]);
+      close(outs[i].scratch[1]);
+    }
+  }
+}
+
+// Plain read/write fan-out for inputs and outputs splice can't handle
+void tee_copy(int in, struct tee_output* outs, int nouts, int err_fd) {
+  char* buf = malloc(TEXT_BLOCK);
+  if (!buf)
+    return;
+  while (!outs[0].failed) {
+    ssize_t n = read(in, buf, TEXT_BLOCK);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      dprintf(err_fd, "tee: read error: %s\n", strerror(errno));
+    if (n <= 0)
+      break;
+    for (int i = 0; i < nouts; i++) {
+      if (outs[i].failed)
+        continue;
+      if (write_all(outs[i].fd, buf, n) != 0)
+        tee_output_failed(&outs[i], err_fd);
+      else
+        outs[i].bytes += n;
+    }
+  }
+  free(buf);
+}
+
+// tee [-a] [-v] [file...]: copies standard input to standard output and
+// to each file. -v reports the bytes written to every output on stderr.
+int tee_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd) {
+  bool append = false, verbose = false;
+  struct tee_output outs[256];
+  int nouts = 0;
+  outs[nouts++] = (struct tee_output){ .name = "standard output", .fd = out_fd, .scratch = { -1, -1 } };
+
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && argv[i][1]) {
+      for (int j = 1; argv[i][j]; j++) {
+        if (argv[i][j] == 'a')
+          append = true;
+        else if (argv[i][j] == 'v')
+          verbose = true;
+        else
+          return delegate_external(argv, in_fd, out_fd, err_fd);
+      }
+    }
+  }
+  if (isatty(in_fd))
+    return delegate_external(argv, in_fd, out_fd, err_fd);
+
+  int status = 0;
+  for (int i = 1; i < argc && nouts < 256; i++) {
+    if (argv[i][0] == '-' && argv[i][1])
+      continue;
+    // Appending seeks to the end instead of using O_APPEND, which splice
+    // refuses; tee is the only writer of the file while it runs
+    int fd = open(argv[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+      dprintf(err_fd, "tee: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    if (append)
+      lseek(fd, 0, SEEK_END);
+    outs[nouts++] = (struct tee_output){ .name = argv[i], .fd = fd, .scratch = { -1, -1 } };
+  }
+
+  struct stat st;
+  bool fast = fstat(in_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+  for (int i = 0; i < nouts && fast; i++)
+    fast = can_splice_to(outs[i].fd);
+  if (fast)
+    tee_splice(in_fd, outs, nouts, err_fd);
+  else
+    tee_copy(in_fd, outs, nouts, err_fd);
+
+  for (int i = 0; i < nouts; i++) {
+    if (verbose)
+      dprintf(err_fd, "tee: %s: %llu bytes\n", outs[i].name, outs[i].bytes);
+    if (outs[i].failed)
+      status = 1;
+    if (i > 0)
+      close(outs[i].fd);
+  }
+  return status;
+}
+
+// State of the xargs builtin. Arguments of the batch being built are kept
+// NUL-separated in one buffer, with their offsets, until the batch runs.
+struct xargs_state {
+  char* exe;               // resolved once for every batch
+  char** argv;             // command and initial arguments
+  int nfixed;
+  size_t fixed_size;       // what those cost in the exec size limit
+  size_t limit;            // ARG_MAX less the environment
+  long max_args;           // -n, 0 for no limit
+  int max_procs;           // -P
+  bool trace;              // -t
+  struct strbuf args;
+  size_t* offsets;
+  int nargs, offsets_cap;
+  size_t size;             // fixed_size plus the batch's arguments
+  bool ran;
+  pid_t* running;          // batches still running, up to max_procs
+  int* pidfds;
+  int nrunning;
+  int in_fd, out_fd, err_fd;
+  int status;
+  bool stop;               // a batch exited 255 or was killed
+};
+
+// Collects a finished batch and folds its status into the result the way
+// GNU xargs reports it
+void xargs_reap(struct xargs_state* st, int slot) {
+  int status = wait_for_child(st->running[slot]);
+  if (st->pidfds[slot] >= 0)
+    close(st->pidfds[slot]);
+  st->nrunning--;
+  st->running[slot] = st->running[st->nrunning];
+  st->pidfds[slot] = st->pidfds[st->nrunning];
+
+  if (status == 255) {
+    dprintf(st->err_fd, "xargs: %s: exited with status 255; aborting\n", st->argv[0]);
+    st->status = 124;
+    st->stop = true;
+  }
+  else if (status > 128) {
+    dprintf(st->err_fd, "xargs: %s: terminated by signal %d\n", st->argv[0], status - 128);
+    st->status = 125;
+    st->stop = true;
+  }
+  else if (status != 0 && st->status == 0) {
+    st->status = 123;
+  }
+}
+
+// Waits until one of the running batches finishes
+void xargs_wait_one(struct xargs_state* st) {
+  struct event_source srcs[64];
+  int n = 0;
+  for (int i = 0; i < st->nrunning && n < 64; i++) {
+    if (st->pidfds[i] < 0)
+      break;
+    srcs[n++] = (struct event_source){ .fd = st->pidfds[i] };
+  }
+  // Without pidfds for all of them, the oldest is waited for
+  if (n < st->nrunning) {
+    xargs_reap(st, 0);
+    return;
+  }
+  while (event_wait(srcs, n) <= 0)
+    ;
+  for (int i = n - 1; i >= 0; i--) {
+    if (srcs[i].ready)
+      xargs_reap(st, i);
+  }
+}
+
+// Starts the command with the batch collected so far
+void xargs_run(struct xargs_state* st) {
+  if (st->stop)
+    return;
+  int argc = st->nfixed + st->nargs;
+  char** argv = malloc((argc + 1) * sizeof(char*));
+  if (!argv) {
+    dprintf(st->err_fd, "xargs: %s\n", strerror(ENOMEM));
+    st->status = 1;
+    st->stop = true;
+    return;
+  }
+  memcpy(argv, st->argv, st->nfixed * sizeof(char*));
+  for (int i = 0; i < st->nargs; i++)
+    argv[st->nfixed + i] = st->args.data + st->offsets[i];
+  argv[argc] = NULL;
+
+  if (st->trace) {
+    for (int i = 0; i < argc; i++)
+      dprintf(st->err_fd, "%s%s", i ? " " : "", argv[i]);
+    dprintf(st->err_fd, "\n");
+  }
+
+  while (st->nrunning >= st->max_procs)
+    xargs_wait_one(st);
+
+  // The batches must not read the argument list
+  int fds[3] = { open("/dev/null", O_RDONLY | O_CLOEXEC), st->out_fd, st->err_fd };
+  pid_t pid = spawn_command(st->exe, argv, fds);
+  if (fds[0] >= 0)
+    close(fds[0]);
+  free(argv);
+  if (pid < 0) {
+    st->status = 126;
+    st->stop = true;
+  }
+  else {
+    st->running[st->nrunning] = pid;
+    st->pidfds[st->nrunning] = syscall(SYS_pidfd_open, pid, 0);
+    st->nrunning++;
+  }
+
+  st->ran = true;
+  st->args.len = 0;
+  st->nargs = 0;
+  st->size = st->fixed_size;
+}
+
+// Adds one argument read from the input, first running the batch if the
+// argument would take it past the size or count limit
+void xargs_add(struct xargs_state* st, const char* arg, size_t len) {
+  // Each argument costs its bytes, its NUL and its argv pointer
+  size_t cost = len + 1 + sizeof(char*);
+  if (st->nargs > 0 && (st->size + cost > st->limit || (st->max_args && st->nargs >= st->max_args)))
+    xargs_run(st);
+  if (st->stop)
+    return;
+  if (st->fixed_size + cost > st->limit || len >= 32 * 4096) {
+    dprintf(st->err_fd, "xargs: argument line too long\n");
+    st->status = 1;
+    st->stop = true;
+    return;
+  }
+  if (st->nargs == st->offsets_cap) {
+    int cap = st->offsets_cap ? st->offsets_cap * 2 : 1024;
+    size_t* grown = realloc(st->offsets, cap * sizeof(size_t));
+    if (!grown) {
+      st->stop = true;
+      return;
+    }
+    st->offsets = grown;
+    st->offsets_cap = cap;
+  }
+  st->offsets[st->nargs++] = st->args.len;
+  strbuf_append(&st->args, arg, len);
+  strbuf_putc(&st->args, '\0');
+  st->size += cost;
+}
+
+// xargs [-0] [-d delim] [-n max-args] [-P max-procs] [-r] [-t] [command
+// [initial-args...]]: runs command with the arguments read from standard
+// input, as many per run as fit in ARG_MAX less the environment.
+// Without -0 or -d, arguments are separated by blanks and newlines and
+// may be quoted, as in POSIX xargs. Other options go to the real xargs.
+int xargs_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd) {
+  struct xargs_state st = { .max_procs = 1, .in_fd = in_fd, .out_fd = out_fd, .err_fd = err_fd };
+  int delim = -1; // -1 for blanks with quoting
+  bool no_empty = false;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    const char* opt = argv[i];
+    if (strcmp(opt, "--") == 0) {
+      i++;
+      break;
+    }
+    if (strcmp(opt, "-0") == 0 || strcmp(opt, "--null") == 0)
+      delim = '\0';
+    else if (strcmp(opt, "-r") == 0 || strcmp(opt, "--no-run-if-empty") == 0)
+      no_empty = true;
+    else if (strcmp(opt, "-t") == 0 || strcmp(opt, "--verbose") == 0)
+      st.trace = true;
+    else if (strncmp(opt, "-d", 2) == 0 || strncmp(opt, "-n", 2) == 0 || strncmp(opt, "-P", 2) == 0) {
+      const char* value = opt[2] ? opt + 2 : argv[i + 1];
+      if (!opt[2])
+        i++;
+      if (!value) {
+        dprintf(err_fd, "xargs: option requires an argument -- '%c'\n", opt[1]);
+        return 1;
+      }
+      if (opt[1] == 'd') {
+        if (strcmp(value, "\\n") == 0)
+          delim = '\n';
+        else if (strcmp(value, "\\t") == 0)
+          delim = '\t';
+        else if (strcmp(value, "\\0") == 0)
+          delim = '\0';
+        else if (strlen(value) == 1)
+          delim = (unsigned char)value[0];
+        else
+          return delegate_external(argv, in_fd, out_fd, err_fd);
+        continue;
+      }
+      char* end;
+      long n = strtol(value, &end, 10);
+      if (*end || n < (opt[1] == 'n' ? 1 : 0)) {
+        dprintf(err_fd, "xargs: invalid number \"%s\" for -%c option\n", value, opt[1]);
+        return 1;
+      }
+      if (opt[1] == 'n')
+        st.max_args = n;
+      else
+        st.max_procs = n == 0 ? (int)sysconf(_SC_NPROCESSORS_ONLN) : (int)(n < 64 ? n : 64);
+    }
+    else
+      return delegate_external(argv, in_fd, out_fd, err_fd);
+  }
+  if (st.max_procs < 1)
+    st.max_procs = 1;
+
+  static char* default_command[] = { "echo", NULL };
+  st.argv = i < argc ? argv + i : default_command;
+  st.nfixed = i < argc ? argc - i : 1;
+
+  // The kernel counts the environment against the same limit as argv
+  long arg_max = sysconf(_SC_ARG_MAX);
+  size_t env_size = 0;
+  for (char** e = shell_environ(); *e; e++)
+    env_size += strlen(*e) + 1 + sizeof(char*);
+  size_t headroom = 2048;
+  if (arg_max <= 0)
+    arg_max = 128 * 1024;
+  st.limit = (size_t)arg_max > env_size + headroom ? arg_max - env_size - headroom : 4096;
+  st.fixed_size = sizeof(char*); // the terminating NULL
+  for (int j = 0; j < st.nfixed; j++)
+    st.fixed_size += strlen(st.argv[j]) + 1 + sizeof(char*);
+  st.size = st.fixed_size;
+
+  st.exe = find_executable(st.argv[0]);
+  if (!st.exe) {
+    dprintf(err_fd, "xargs: %s: No such file or directory\n", st.argv[0]);
+    return 127;
+  }
+  st.running = malloc(st.max_procs * sizeof(pid_t));
+  st.pidfds = malloc(st.max_procs * sizeof(int));
+
+  // The input is read in large blocks; a word cut off at the end of a
+  // block waits in word for the rest
+  size_t block = 256 * 1024;
+  char* buf = malloc(block);
+  struct strbuf word = { 0 };
+  bool in_word = false;
+  char quote = 0;
+  bool escaped = false;
+  if (!buf || !st.running || !st.pidfds) {
+    dprintf(err_fd, "xargs: %s\n", strerror(ENOMEM));
+    st.status = 1;
+    st.stop = true;
+  }
+
+  while (!st.stop) {
+    ssize_t n = read(in_fd, buf, block);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      dprintf(err_fd, "xargs: read error: %s\n", strerror(errno));
+      st.status = 1;
+      break;
+    }
+    if (n == 0)
+      break;
+
+    if (delim >= 0) {
+      const char* p = buf;
+      const char* end = buf + n;
+      const char* sep;
+      while (!st.stop && (sep = memchr(p, delim, end - p)) != NULL) {
+        if (word.len > 0) {
+          strbuf_append(&word, p, sep - p);
+          xargs_add(&st, word.data, word.len);
+          word.len = 0;
+        }
+        else {
+          xargs_add(&st, p, sep - p);
+        }
+        p = sep + 1;
+      }
+      strbuf_append(&word, p, end - p);
+      continue;
+    }
+
+    for (ssize_t k = 0; k < n && !st.stop; k++) {
+      char c = buf[k];
+      if (escaped) {
+        strbuf_putc(&word, c);
+        escaped = false;
+      }
+      else if (quote) {
+        if (c == quote)
+          quote = 0;
+        else if (c == '\n') {
+          dprintf(err_fd, "xargs: unmatched %s quote\n", quote == '"' ? "double" : "single");
+          st.status = 1;
+          st.stop = true;
+        }
+        else
+          strbuf_putc(&word, c);
+      }
+      else if (c == ' ' || c == '\t' || c == '\n') {
+        if (in_word)
+          xargs_add(&st, word.data, word.len);
+        word.len = 0;
+        in_word = false;
+        continue;
+      }
+      else if (c == '\\')
+        escaped = true;
+      else if (c == '\'' || c == '"')
+        quote = c;
+      else
+        strbuf_putc(&word, c);
+      in_word = true;
+    }
+  }
+
+  if (quote && !st.stop) {
+    dprintf(err_fd, "xargs: unmatched %s quote\n", quote == '"' ? "double" : "single");
+    st.status = 1;
+    st.stop = true;
+  }
+  // A last argument without a delimiter after it still counts
+  if (!st.stop && (delim >= 0 ? word.len > 0 : in_word))
+    xargs_add(&st, word.data ? word.data : "", word.len);
+  if (!st.stop && (st.nargs > 0 || (!st.ran && !no_empty)))
+    xargs_run(&st);
+  while (st.nrunning > 0)
+    xargs_wait_one(&st);
+
+  free(buf);
+  free(word.data);
+  free(st.args.data);
+  free(st.offsets);
+  free(st.running);
+  free(st.pidfds);
+  free(st.exe);
+  return st.status;
+}
+
+// Parses a timeout duration: a decimal number of seconds with an optional
+// s, m, h or d suffix
+bool parse_duration(const char* text, struct timespec* ts) {
+  char* end;
+  errno = 0;
+  double secs = strtod(text, &end);
+  if (end == text || errno || secs < 0 || secs != secs)
+    return false;
+  switch (*end) {
+  case '\0': case 's': break;
+  case 'm': secs *= 60; break;
+  case 'h': secs *= 3600; break;
+  case 'd': secs *= 86400; break;
+  default: return false;
+  }
+  if (*end && end[1])
+    return false;
+  // Far enough out to be never, without overflowing time_t
+  if (secs > 1e15)
+    secs = 1e15;
+  ts->tv_sec = (time_t)secs;
+  ts->tv_nsec = (long)((secs - ts->tv_sec) * 1e9);
+  // A nonzero duration too short for a nanosecond still has to fire
+  if (secs > 0 && ts->tv_sec == 0 && ts->tv_nsec == 0)
+    ts->tv_nsec = 1;
+  return true;
+}
+
+// A signal number, or a name with or without the SIG prefix
+int parse_signal(const char* text) {
+  char* end;
+  long n = strtol(text, &end, 10);
+  if (end != text && !*end)
+    return n > 0 && n < NSIG ? (int)n : -1;
+  if (strncasecmp(text, "SIG", 3) == 0)
+    text += 3;
+  for (int sig = 1; sig < NSIG; sig++) {
+    const char* name = sigabbrev_np(sig);
+    if (name && strcasecmp(name, text) == 0)
+      return sig;
+  }
+  return -1;
+}
+
+// timeout [-s signal] [-k duration] [-v] [--preserve-status] duration
+// command [arg...]: runs command and sends it signal (TERM by default) if
+// it is still running after duration, then KILL if it outlives the -k
+// grace period too (10s unless given; 0 disables it). The wait is one
+// event_wait() on the child's pidfd and a timerfd, so there is no polling.
+// Exits 124 if the command timed out, unless --preserve-status.
+int timeout_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd) {
+  int sig = SIGTERM;
+  struct timespec kill_after = { 10, 0 };
+  bool verbose = false, preserve = false;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    const char* opt = argv[i];
+    if (strcmp(opt, "--") == 0) {
+      i++;
+      break;
+    }
+    if (strcmp(opt, "--preserve-status") == 0)
+      preserve = true;
+    else if (strcmp(opt, "-v") == 0 || strcmp(opt, "--verbose") == 0)
+      verbose = true;
+    else if ((opt[1] == 's' || opt[1] == 'k') && opt[2] != '-') {
+      const char* value = opt[2] ? opt + 2 : argv[i + 1];
+      if (!opt[2])
+        i++;
+      if (!value) {
+        dprintf(err_fd, "timeout: option requires an argument -- '%c'\n", opt[1]);
+        return 125;
+      }
+      if (opt[1] == 's' && (sig = parse_signal(value)) < 0) {
+        dprintf(err_fd, "timeout: %s: invalid signal\n", value);
+        return 125;
+      }
+      if (opt[1] == 'k' && !parse_duration(value, &kill_after)) {
+        dprintf(err_fd, "timeout: invalid time interval '%s'\n", value);
+        return 125;
+      }
+    }
+    else
+      return delegate_external(argv, in_fd, out_fd, err_fd);
+  }
+  if (argc - i < 2) {
+    dprintf(err_fd, "timeout: missing operand\n");
+    return 125;
+  }
+  struct timespec duration;
+  if (!parse_duration(argv[i], &duration)) {
+    dprintf(err_fd, "timeout: invalid time interval '%s'\n", argv[i]);
+    return 125;
+  }
+  char** cmd = argv + i + 1;
+
+  char* exe = find_executable(cmd[0]);
+  if (!exe) {
+    dprintf(err_fd, "timeout: failed to run command '%s': No such file or directory\n", cmd[0]);
+    return 127;
+  }
+  int fds[3] = { in_fd, out_fd, err_fd };
+  pid_t pid = spawn_command(exe, cmd, fds);
+  free(exe);
+  if (pid < 0)
+    return 126;
+
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  // A zero duration disarms the timer, as it means no timeout
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  struct itimerspec when = { .it_value = duration };
+  if (timer >= 0)
+    timerfd_settime(timer, 0, &when, NULL);
+
+  bool timed_out = false, killed = false;
+  int status;
+  pid_t done;
+  while ((done = waitpid(pid, &status, WNOHANG)) != pid) {
+    if (done < 0 && errno != EINTR)
+      break;
+    // Without a pidfd (Linux before 5.3), SIGCHLD ends the wait instead
+    struct event_source srcs[2] = { { .fd = timer }, { .fd = pidfd } };
+    if (event_wait(srcs, pidfd >= 0 ? 2 : 1) <= 0 || !srcs[0].ready)
+      continue;
+
+    // Only an expiration counts; a wakeup with nothing to read doesn't
+    uint64_t expirations;
+    ssize_t got;
+    while ((got = read(timer, &expirations, sizeof(expirations))) < 0 && errno == EINTR)
+      ;
+    if (got != sizeof(expirations))
+      continue;
+    int send = timed_out ? SIGKILL : sig;
+    if (verbose)
+      dprintf(err_fd, "timeout: sending signal %s to command '%s'\n", sigabbrev_np(send), cmd[0]);
+    // The pidfd can't name a recycled pid, but the child isn't reaped
+    // until waitpid() here, so kill() is safe without one too
+    if (pidfd < 0 || syscall(SYS_pidfd_send_signal, pidfd, send, NULL, 0) < 0)
+      kill(pid, send);
+    // A stopped command couldn't act on the signal
+    if (send != SIGKILL)
+      kill(pid, SIGCONT);
+    killed = timed_out;
+    timed_out = true;
+    if (!killed && send != SIGKILL && (kill_after.tv_sec || kill_after.tv_nsec)) {
+      when.it_value = kill_after;
+      timerfd_settime(timer, 0, &when, NULL);
+    }
+  }
+  if (timer >= 0)
+    close(timer);
+  if (pidfd >= 0)
+    close(pidfd);
+  if (done != pid)
+    return 125;
+  signals_dispatch();
+
+  // Like GNU timeout, a command that had to be killed reports KILL
+  if (killed)
+    return 128 + SIGKILL;
+  if (timed_out && !preserve)
+    return 124;
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+// Copies a regular file's data with copy_file_range, which stays in the
+// kernel and lets filesystems share or offload the blocks; filesystems
+// that can't do it fall back to copy_fd
+int copy_file_data(int in, int out) {
+  bool first = true;
+  while (true) {
+    ssize_t n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    if (n == 0)
+      return 0;
+    if (n > 0) {
+      first = false;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (first && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+      return copy_fd(in, out) == 0 ? 0 : -1;
+    return -1;
+  }
+}
+
+// Copies src (relative to src_dirfd, with lstat result st) to name in
+// dst_dirfd, preserving mode, ownership where permitted, and timestamps.
+// Directories are copied recursively, symlinks as symlinks.
+int copy_tree_at(int src_dirfd, const char* src, const struct stat* st, int dst_dirfd, const char* name) {
+  struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+  if (S_ISLNK(st->st_mode)) {
+    char target[4096];
+    ssize_t len = readlinkat(src_dirfd, src, target, sizeof(target) - 1);
+    if (len < 0)
+      return -1;
+    target[len] = '\0';
+    if (symlinkat(target, dst_dirfd, name) != 0)
+      return -1;
+    fchownat(dst_dirfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+    utimensat(dst_dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+    return 0;
+  }
+
+  if (S_ISREG(st->st_mode)) {
+    int in = openat(src_dirfd, src, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in < 0)
+      return -1;
+    int out = openat(dst_dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+    if (out < 0) {
+      close(in);
+      return -1;
+    }
+    int r = copy_file_data(in, out);
+    if (r == 0) {
+      fchown(out, st->st_uid, st->st_gid);
+      fchmod(out, st->st_mode & 07777);
+      futimens(out, times);
+    }
+    int saved = errno;
+    close(in);
+    close(out);
+    errno = saved;
+    return r;
+  }
+
+  if (!S_ISDIR(st->st_mode)) {
+    // fifos, sockets and device nodes
+    if (mknodat(dst_dirfd, name, st->st_mode, st->st_rdev) != 0)
+      return -1;
+    fchownat(dst_dirfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+    utimensat(dst_dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+    return 0;
+  }
+
+  if (mkdirat(dst_dirfd, name, 0700) != 0)
+    return -1;
+  int in_dir = openat(src_dirfd, src, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+  int out_dir = openat(dst_dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR* d = in_dir >= 0 ? fdopendir(in_dir) : NULL;
+  int r = d && out_dir >= 0 ? 0 : -1;
+
+  struct dirent* e;
+  while (r == 0 && (e = readdir(d))) {
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+      continue;
+    struct stat child;
+    if (fstatat(in_dir, e->d_name, &child, AT_SYMLINK_NOFOLLOW) != 0 ||
+      copy_tree_at(in_dir, e->d_name, &child, out_dir, e->d_name) != 0)
+      r = -1;
+  }
+
+  // The mode goes on last so that copying into a read-only directory works
+  if (r == 0) {
+    fchown(out_dir, st->st_uid, st->st_gid);
+    fchmod(out_dir, st->st_mode & 07777);
+    futimens(out_dir, times);
+  }
+  int saved = errno;
+  if (d)
+    closedir(d);
+  else if (in_dir >= 0)
+    close(in_dir);
+  if (out_dir >= 0)
+    close(out_dir);
+  errno = saved;
+  return r;
+}
+
+atomic_uint mv_temp_counter = 0;
+
+// Moves src to dst across filesystems, where rename() gives EXDEV. The
+// copy is built under a temporary name in dst's directory, flushed to
+// disk, and renamed into place with renameat2, so dst is never seen half
+// written; only then is src removed.
+int move_across_filesystems(const char* src, const char* dst) {
+  struct stat st;
+  if (lstat(src, &st) != 0)
+    return -1;
+
+  // Split dst into its directory and final component
+  size_t len = trimmed_length(dst);
+  const char* slash = memrchr(dst, '/', len);
+  char* dir = slash ? strndup(dst, slash == dst ? 1 : (size_t)(slash - dst)) : strdup(".");
+  char* base = slash ? strndup(slash + 1, len - (slash + 1 - dst)) : strndup(dst, len);
+  int dirfd = dir ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+  if (dirfd < 0 || !base) {
+    int saved = errno;
+    free(dir);
+    free(base);
+    errno = saved;
+    return -1;
+  }
+
+  char tmp[64];
+  int r = -1;
+  for (int attempt = 0; attempt < 100 && r != 0; attempt++) {
+    snprintf(tmp, sizeof(tmp), ".mv-%d-%u.tmp", (int)getpid(), atomic_fetch_add(&mv_temp_counter, 1));
+    r = copy_tree_at(AT_FDCWD, src, &st, dirfd, tmp);
+    if (r != 0 && errno != EEXIST)
+      break;
+  }
+
+  // A single file is flushed on its own; a tree with one syncfs of the
+  // destination filesystem instead of an fsync per file
+  if (r == 0) {
+    if (S_ISREG(st.st_mode)) {
+      int fd = openat(dirfd, tmp, O_RDONLY | O_CLOEXEC);
+      r = fd >= 0 && fsync(fd) == 0 ? 0 : -1;
+      if (fd >= 0)
+        close(fd);
+    }
+    else {
+      r = syncfs(dirfd);
+    }
+  }
+  if (r == 0)
+    r = renameat2(dirfd, tmp, dirfd, base, 0);
+  if (r == 0) {
+    fsync(dirfd);
+    r = S_ISDIR(st.st_mode) ? rmdir_recursive(src) : unlink(src);
+  }
+  else {
+    int saved = errno;
+    size_t path_len = strlen(dir) + strlen(tmp) + 2;
+    char* path = malloc(path_len);
+    if (path) {
+      snprintf(path, path_len, "%s/%s", dir, tmp);
+      if (S_ISDIR(st.st_mode))
+        rmdir_recursive(path);
+      else
+        unlink(path);
+      free(path);
+    }
+    errno = saved;
+  }
+
+  int saved = errno;
+  close(dirfd);
+  free(dir);
+  free(base);
+  errno = saved;
+  return r;
+}
+
+// mv source dest, or mv source... directory. Renames are batched; those
+// that cross filesystems are copied instead.
+int mv_builtin(int argc, char** argv, int err_fd) {
+  if (argc < 3) {
+    dprintf(err_fd, "mv: missing operand\n");
+    return 1;
+  }
+
+  const char* dst = argv[argc - 1];
+  int count = argc - 2;
+  struct stat st;
+  bool into_dir = stat(dst, &st) == 0 && S_ISDIR(st.st_mode);
+  if (count > 1 && !into_dir) {
+    dprintf(err_fd, "mv: target '%s' is not a directory\n", dst);
+    return 1;
+  }
+
+  struct fs_op* ops = calloc(count, sizeof(*ops));
+  if (!ops)
+    return 1;
+  for (int i = 0; i < count; i++) {
+    const char* src = argv[i + 1];
+    char* target = (char*)dst;
+    if (into_dir) {
+      size_t len = trimmed_length(src);
+      const char* slash = memrchr(src, '/', len);
+      const char* base = slash ? slash + 1 : src;
+      size_t base_len = len - (base - src);
+      size_t dst_len = trimmed_length(dst);
+      target = malloc(dst_len + base_len + 2);
+      if (target)
+        sprintf(target, "%.*s/%.*s", (int)dst_len, dst, (int)base_len, base);
+    }
+    ops[i] = (struct fs_op){ .opcode = IORING_OP_RENAMEAT, .dirfd = AT_FDCWD, .path = src, .path2 = target };
+  }
+  fs_batch_run(ops, count);
+
+  int status = 0;
+  for (int i = 0; i < count; i++) {
+    const char* src = ops[i].path;
+    const char* target = ops[i].path2;
+    int err = -ops[i].result;
+    if (err == EXDEV)
+      err = move_across_filesystems(src, target) == 0 ? 0 : errno;
+    if (err) {
+      dprintf(err_fd, "mv: cannot move '%s' to '%s': %s\n",
+        src, target, strerror(err));
+      status = 1;
+    }
+    if (target != dst)
+      free((char*)target);
+  }
+  free(ops);
+  return status;
+}
+
+// Set while the stages of a pipeline run side by side. Each stage works
+// on the shell's variables as they were, as if it ran in a subshell, so
+// assignments made there are dropped.
+bool vars_frozen = false;
+
+int cmp_var_names(const void* a, const void* b) {
+  return strcmp((*(struct shell_var* const*)a)->name, (*(struct shell_var* const*)b)->name);
+}
+
+// Prints exported variables in a form that can be read back as input
+void export_print(int out_fd) {
+  struct shell_var** list = malloc((vars_used + 1) * sizeof(*list));
+  if (!list)
+    return;
+  size_t n = 0;
+  for (size_t i = 0; i < vars_cap; i++) {
+    if (vars[i].name && vars[i].exported)
+      list[n++] = &vars[i];
+  }
+  qsort(list, n, sizeof(*list), cmp_var_names);
+
+  struct strbuf out = { 0 };
+  for (size_t i = 0; i < n; i++) {
+    strbuf_append(&out, "declare -x ", 11);
+    strbuf_append(&out, list[i]->name, strlen(list[i]->name));
+    if (list[i]->entry) {
+      strbuf_append(&out, "=\"", 2);
+      for (const char* v = list[i]->entry + strlen(list[i]->name) + 1; *v; v++) {
+        if (*v == '"' || *v == '\\' || *v == '$' || *v == '`')
+          strbuf_putc(&out, '\\');
+        strbuf_putc(&out, *v);
+      }
+      strbuf_putc(&out, '"');
+    }
+    strbuf_putc(&out, '\n');
+  }
+  if (out.len)
+    write_all(out_fd, out.data, out.len);
+  free(out.data);
+  free(list);
+}
+
+int export_builtin(int argc, char** argv, int out_fd, int err_fd) {
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-p") == 0)
+    first = 2;
+  if (first == argc) {
+    export_print(out_fd);
+    return 0;
+  }
+
+  int status = 0;
+  for (int i = first; i < argc; i++) {
+    char* eq = strchr(argv[i], '=');
+    size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+    if (!is_valid_name(argv[i], len)) {
+      dprintf(err_fd, "export: `%s': not a valid identifier\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    if (vars_frozen)
+      continue;
+    if (eq && !var_set(argv[i], len, eq + 1)) {
+      dprintf(err_fd, "export: %s\n", strerror(ENOMEM));
+      return 1;
+    }
+    struct shell_var* v = var_lookup_or_add(argv[i], len);
+    if (v)
+      var_export(v);
+  }
+  return status;
+}
+
+// test and [. Expressions are parsed by recursive descent over argv with
+// the usual precedence: ! binds tighter than -a, which binds tighter than
+// -o. Every file test is answered from one fstatat(); -r, -w and -x are
+// checked against the mode bits instead of a second access() call.
+struct test_state {
+  char** argv;
+  int pos, end;
+  int err_fd;
+  const char* name;
+  bool error;
+};
+
+gid_t* shell_groups = NULL;
+int nshell_groups = -1;
+
+bool in_shell_groups(gid_t gid) {
+  if (gid == getegid())
+    return true;
+  if (nshell_groups < 0) {
+    int n = getgroups(0, NULL);
+    shell_groups = n > 0 ? malloc(n * sizeof(gid_t)) : NULL;
+    nshell_groups = shell_groups ? getgroups(n, shell_groups) : 0;
+    if (nshell_groups < 0)
+      nshell_groups = 0;
+  }
+  for (int i = 0; i < nshell_groups; i++) {
+    if (shell_groups[i] == gid)
+      return true;
+  }
+  return false;
+}
+
+// Whether the shell may access a file with mode bits st for R_OK, W_OK or
+// X_OK, as access() would decide for the effective ids
+bool stat_allows(const struct stat* st, int want) {
+  if (geteuid() == 0)
+    return want != X_OK || (st->st_mode & 0111) || S_ISDIR(st->st_mode);
+  int shift = st->st_uid == geteuid() ? 6 : in_shell_groups(st->st_gid) ? 3 : 0;
+  int bit = want == R_OK ? 4 : want == W_OK ? 2 : 1;
+  return (st->st_mode >> shift) & bit;
+}
+
+bool test_unary_op(const char* op) {
+  return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghkLnOprsStuwxzGN", op[1]);
+}
+
+bool test_binary_op(const char* op) {
+  const char* ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+  for (int i = 0; ops[i]; i++) {
+    if (strcmp(op, ops[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+bool test_integer(struct test_state* ts, const char* s, long long* value) {
+  char* end;
+  errno = 0;
+  while (*s == ' ' || *s == '\t')
+    s++;
+  *value = strtoll(s, &end, 10);
+  while (*end == ' ' || *end == '\t')
+    end++;
+  if (end == s || *end || errno) {
+    dprintf(ts->err_fd, "%s: %s: integer expression expected\n", ts->name, s);
+    ts->error = true;
+    return false;
+  }
+  return true;
+}
+
+bool test_unary(struct test_state* ts, char op, const char* arg) {
+  if (op == 'n')
+    return arg[0] != '\0';
+  if (op == 'z')
+    return arg[0] == '\0';
+  if (op == 't') {
+    long long fd;
+    return test_integer(ts, arg, &fd) && isatty((int)fd);
+  }
+
+  struct stat st;
+  int flags = op == 'L' || op == 'h' ? AT_SYMLINK_NOFOLLOW : 0;
+  if (fstatat(AT_FDCWD, arg, &st, flags) != 0)
+    return false;
+  switch (op) {
+  case 'e': return true;
+  case 'f': return S_ISREG(st.st_mode);
+  case 'd': return S_ISDIR(st.st_mode);
+  case 'b': return S_ISBLK(st.st_mode);
+  case 'c': return S_ISCHR(st.st_mode);
+  case 'p': return S_ISFIFO(st.st_mode);
+  case 'S': return S_ISSOCK(st.st_mode);
+  case 'L':
+  case 'h': return S_ISLNK(st.st_mode);
+  case 's': return st.st_size > 0;
+  case 'g': return st.st_mode & S_ISGID;
+  case 'u': return st.st_mode & S_ISUID;
+  case 'k': return st.st_mode & S_ISVTX;
+  case 'O': return st.st_uid == geteuid();
+  case 'G': return st.st_gid == getegid();
+  case 'N': return st.st_mtim.tv_sec > st.st_atim.tv_sec ||
+    (st.st_mtim.tv_sec == st.st_atim.tv_sec && st.st_mtim.tv_nsec > st.st_atim.tv_nsec);
+  case 'r': return stat_allows(&st, R_OK);
+  case 'w': return stat_allows(&st, W_OK);
+  case 'x': return stat_allows(&st, X_OK);
+  }
+  return false;
+}
+
+bool test_binary(struct test_state* ts, const char* left, const char* op, const char* right) {
+  if (op[0] != '-') {
+    int cmp = strcmp(left, right);
+    if (op[0] == '<')
+      return cmp < 0;
+    if (op[0] == '>')
+      return cmp > 0;
+    return op[0] == '!' ? cmp != 0 : cmp == 0;
+  }
+
+  if ((op[1] == 'n' && op[2] == 't') || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+    struct stat a, b;
+    bool has_a = stat(left, &a) == 0, has_b = stat(right, &b) == 0;
+    if (op[1] == 'e')
+      return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    if (!has_a || !has_b)
+      return op[1] == 'n' ? has_a : has_b;
+    const struct timespec* newer = op[1] == 'n' ? &a.st_mtim : &b.st_mtim;
+    const struct timespec* older = op[1] == 'n' ? &b.st_mtim : &a.st_mtim;
+    return newer->tv_sec > older->tv_sec || (newer->tv_sec == older->tv_sec && newer->tv_nsec > older->tv_nsec);
+  }
+
+  long long l, r;
+  if (!test_integer(ts, left, &l) || !test_integer(ts, right, &r))
+    return false;
+  if (strcmp(op, "-eq") == 0) return l == r;
+  if (strcmp(op, "-ne") == 0) return l != r;
+  if (strcmp(op, "-lt") == 0) return l < r;
+  if (strcmp(op, "-le") == 0) return l <= r;
+  if (strcmp(op, "-gt") == 0) return l > r;
+  return l >= r;
+}
+
+bool test_or(struct test_state* ts);
+
+bool test_primary(struct test_state* ts) {
+  int left = ts->end - ts->pos;
+  char** a = ts->argv + ts->pos;
+  if (left <= 0) {
+    dprintf(ts->err_fd, "%s: argument expected\n", ts->name);
+    ts->error = true;
+    return false;
+  }
+
+  // A binary operator in second place wins, so [ -n = x ] compares strings
+  if (left >= 3 && test_binary_op(a[1])) {
+    ts->pos += 3;
+    return test_binary(ts, a[0], a[1], a[2]);
+  }
+  if (strcmp(a[0], "(") == 0 && left >= 2) {
+    ts->pos++;
+    bool value = test_or(ts);
+    if (ts->pos >= ts->end || strcmp(ts->argv[ts->pos], ")") != 0) {
+      if (!ts->error)
+        dprintf(ts->err_fd, "%s: `)' expected\n", ts->name);
+      ts->error = true;
+      return false;
+    }
+    ts->pos++;
+    return value;
+  }
+  if (left >= 2 && test_unary_op(a[0])) {
+    ts->pos += 2;
+    return test_unary(ts, a[0][1], a[1]);
+  }
+  ts->pos++;
+  return a[0][0] != '\0';
+}
+
+bool test_not(struct test_state* ts) {
+  if (ts->pos < ts->end - 1 && strcmp(ts->argv[ts->pos], "!") == 0) {
+    ts->pos++;
+    return !test_not(ts);
+  }
+  return test_primary(ts);
+}
+
+bool test_and(struct test_state* ts) {
+  bool value = test_not(ts);
+  while (!ts->error && ts->pos < ts->end && strcmp(ts->argv[ts->pos], "-a") == 0) {
+    ts->pos++;
+    bool right = test_not(ts);
+    value = value && right;
+  }
+  return value;
+}
+
+bool test_or(struct test_state* ts) {
+  bool value = test_and(ts);
+  while (!ts->error && ts->pos < ts->end && strcmp(ts->argv[ts->pos], "-o") == 0) {
+    ts->pos++;
+    bool right = test_and(ts);
+    value = value || right;
+  }
+  return value;
+}
+
+// Returns 0 for true, 1 for false and 2 for a malformed expression
+int test_builtin(int argc, char** argv, int err_fd) {
+  struct test_state ts = { .argv = argv, .pos = 1, .end = argc, .err_fd = err_fd, .name = argv[0] };
+  if (strcmp(argv[0], "[") == 0) {
+    if (argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+      dprintf(err_fd, "[: missing `]'\n");
+      return 2;
+    }
+    ts.end--;
+  }
+  if (ts.pos == ts.end)
+    return 1;
+
+  bool value = test_or(&ts);
+  if (!ts.error && ts.pos < ts.end) {
+    dprintf(err_fd, "%s: %s: unexpected argument\n", ts.name, argv[ts.pos]);
+    ts.error = true;
+  }
+  return ts.error ? 2 : !value;
+}
+
+int unset_builtin(int argc, char** argv, int err_fd) {
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-v") == 0)
+    first = 2;
+
+  int status = 0;
+  for (int i = first; i < argc; i++) {
+    size_t len = strlen(argv[i]);
+    if (!is_valid_name(argv[i], len)) {
+      dprintf(err_fd, "unset: `%s': not a valid identifier\n", argv[i]);
+      status = 1;
+    }
+    else if (!vars_frozen) {
+      var_unset(argv[i], len);
+    }
+  }
+  return status;
+}
+
+int is_builtin(const char* cmd) {
+  for (int i = 0; builtin[i]; i++) {
+    if (strcmp(builtin[i], cmd) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// The shell's logical working directory: the path the way the user got
+// there, symlinks and all, as in bash. cd keeps it up to date lexically,
+// so pwd prints a string and never has to call getcwd().
+char* shell_cwd = NULL;
+
+// Resolves "." and ".." in an absolute path lexically, the way cd -L
+// treats them, and squeezes repeated slashes
+char* canonical_path(const char* path) {
+  char* out = malloc(strlen(path) + 2);
+  if (!out)
+    return NULL;
+  size_t len = 0;
+  for (const char* p = path; *p;) {
+    while (*p == '/')
+      p++;
+    const char* end = strchrnul(p, '/');
+    size_t seg = end - p;
+    if (seg == 2 && p[0] == '.' && p[1] == '.') {
+      while (len > 0 && out[--len] != '/')
+        ;
+    }
+    else if (seg > 0 && !(seg == 1 && p[0] == '.')) {
+      out[len++] = '/';
+      memcpy(out + len, p, seg);
+      len += seg;
+    }
+    p = end;
+  }
+  if (len == 0)
+    out[len++] = '/';
+  out[len] = '\0';
+  return out;
+}
+
+// dir on its own if absolute, otherwise under base
+char* path_under(const char* base, const char* dir) {
+  if (dir[0] == '/')
+    return canonical_path(dir);
+  size_t blen = strlen(base), dlen = strlen(dir);
+  char* joined = malloc(blen + dlen + 2);
+  if (!joined)
+    return NULL;
+  memcpy(joined, base, blen);
+  joined[blen] = '/';
+  memcpy(joined + blen + 1, dir, dlen + 1);
+  char* path = canonical_path(joined);
+  free(joined);
+  return path;
+}
+
+void set_exported(const char* name, const char* value) {
+  var_set(name, strlen(name), value);
+  struct shell_var* v = var_find(name, strlen(name));
+  if (v)
+    var_export(v);
+}
+
+// Takes $PWD from the environment if it still names the directory we are
+// in, so a logical path survives into child shells; otherwise asks the
+// kernel once
+void cwd_init() {
+  const char* pwd = var_get("PWD");
+  struct stat named, dot;
+  if (pwd && pwd[0] == '/' && stat(pwd, &named) == 0 && stat(".", &dot) == 0 &&
+      named.st_dev == dot.st_dev && named.st_ino == dot.st_ino)
+    shell_cwd = canonical_path(pwd);
+  if (!shell_cwd)
+    shell_cwd = getcwd(NULL, 0);
+  if (shell_cwd)
+    set_exported("PWD", shell_cwd);
+}
+
+// Makes path the logical working directory after a successful change,
+// moving the old one to OLDPWD
+void set_cwd(char* path) {
+  if (shell_cwd)
+    set_exported("OLDPWD", shell_cwd);
+  free(shell_cwd);
+  shell_cwd = path;
+  set_exported("PWD", path);
+}
+
+// CDPATH split into its directories, rebuilt only when the variable
+// changes. Absolute entries keep an O_PATH descriptor, so looking a name
+// up in them is one fstatat that never walks the entry's own path again.
+// Relative entries depend on where we are and are looked up as paths.
+struct cdpath_dir {
+  char* path;
+  int fd;
+};
+
+struct cdpath_cache {
+  struct cdpath_dir* dirs;
+  int count;
+  unsigned long generation;
+  bool valid;
+} cdpath_cache;
+
+struct cdpath_cache* cdpath_dirs() {
+  unsigned long generation = var_generation("CDPATH");
+  if (cdpath_cache.valid && cdpath_cache.generation == generation)
+    return &cdpath_cache;
+
+  for (int i = 0; i < cdpath_cache.count; i++) {
+    free(cdpath_cache.dirs[i].path);
+    if (cdpath_cache.dirs[i].fd >= 0)
+      close(cdpath_cache.dirs[i].fd);
+  }
+  free(cdpath_cache.dirs);
+  memset(&cdpath_cache, 0, sizeof(cdpath_cache));
+
+  const char* cdpath = var_get("CDPATH");
+  if (cdpath && *cdpath) {
+    int n = 1;
+    for (const char* p = cdpath; *p; p++)
+      n += *p == ':';
+    cdpath_cache.dirs = calloc(n, sizeof(struct cdpath_dir));
+    for (const char* p = cdpath; cdpath_cache.dirs; p++) {
+      const char* end = strchrnul(p, ':');
+      struct cdpath_dir* d = &cdpath_cache.dirs[cdpath_cache.count];
+      d->path = strndup(p, end - p);
+      d->fd = d->path && d->path[0] == '/' ? open(d->path, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+      if (d->path)
+        cdpath_cache.count++;
+      if (!*end)
+        break;
+      p = end;
+    }
+  }
+  cdpath_cache.generation = generation;
+  cdpath_cache.valid = true;
+  return &cdpath_cache;
+}
+
+// Finds dir through CDPATH. On success returns the logical path and sets
+// *fd to an O_PATH descriptor for it when the entry had one cached;
+// returns NULL if no entry has it, or if an empty entry (the current
+// directory) does.
+char* cdpath_find(const char* dir, int* fd) {
+  struct cdpath_cache* cache = cdpath_dirs();
+  for (int i = 0; i < cache->count; i++) {
+    struct cdpath_dir* d = &cache->dirs[i];
+    struct stat st;
+    if (d->fd >= 0) {
+      int found = openat(d->fd, dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      if (found >= 0) {
+        *fd = found;
+        return path_under(d->path, dir);
+      }
+      continue;
+    }
+    char* base = path_under(shell_cwd ? shell_cwd : ".", d->path);
+    char* path = base ? path_under(base, dir) : NULL;
+    free(base);
+    if (path && stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      // Found through an empty entry: an ordinary cd, not printed
+      if (!d->path[0]) {
+        free(path);
+        return NULL;
+      }
+      return path;
+    }
+    free(path);
+  }
+  return NULL;
+}
+
+// Changes to dir the way cd does: through CDPATH for a relative name that
+// doesn't start with "." or "..", then lexically (-L) or by following
+// symlinks (-P). Prints the new directory when CDPATH chose it or when
+// print is set. While a pipeline runs, the stage acts as a subshell and
+// only checks that it could change directory.
+int cd_to(const char* dir, bool physical, bool print, int out_fd, int err_fd, const char* cmd) {
+  bool dotted = dir[0] == '.' && (dir[1] == '\0' || dir[1] == '/' ||
+    (dir[1] == '.' && (dir[2] == '\0' || dir[2] == '/')));
+  int fd = -1;
+  char* path = NULL;
+  if (dir[0] != '/' && !dotted && (path = cdpath_find(dir, &fd)) != NULL)
+    print = true;
+  else
+    path = path_under(shell_cwd ? shell_cwd : ".", dir);
+  if (!path) {
+    dprintf(err_fd, "%s: %s\n", cmd, strerror(ENOMEM));
+    return 1;
+  }
+
+  int r;
+  if (vars_frozen) {
+    struct stat st;
+    r = fd >= 0 ? 0 : stat(physical ? dir : path, &st);
+    if (r == 0 && fd < 0 && !S_ISDIR(st.st_mode)) {
+      r = -1;
+      errno = ENOTDIR;
+    }
+  }
+  else if (fd >= 0)
+    r = fchdir(fd);
+  else
+    r = chdir(physical ? dir : path);
+  // When the logical parent is gone (a ".." out of a symlinked directory
+  // that was removed), fall back to the physical path like bash
+  if (r < 0 && !physical && !vars_frozen && chdir(dir) == 0) {
+    r = 0;
+    physical = true;
+  }
+  if (fd >= 0)
+    close(fd);
+  if (r < 0) {
+    dprintf(err_fd, "%s: %s: %s\n", cmd, dir, strerror(errno));
+    free(path);
+    return 1;
+  }
+  if (vars_frozen) {
+    free(path);
+    return 0;
+  }
+
+  if (physical) {
+    char* real = getcwd(NULL, 0);
+    if (real) {
+      free(path);
+      path = real;
+    }
+  }
+  set_cwd(path);
+  if (print)
+    dprintf(out_fd, "%s\n", shell_cwd);
+  return 0;
+}
+
+// Directories saved by pushd, most recent first. The current directory is
+// the top of the stack and isn't stored. Each entry keeps an O_PATH
+// descriptor, so popd gets back with a single fchdir.
+struct saved_dir {
+  char* path;
+  int fd;
+};
+
+struct saved_dir* dir_stack = NULL;
+int dir_depth = 0, dir_cap = 0;
+
+// Prints a stack entry, with $HOME shortened to ~ unless long_form
+void print_dir(int out_fd, const char* path, bool long_form) {
+  const char* home = var_get("HOME");
+  size_t hlen = home ? strlen(home) : 0;
+  if (!long_form && hlen > 1 && strncmp(path, home, hlen) == 0 && (path[hlen] == '/' || !path[hlen]))
+    dprintf(out_fd, "~%s", path + hlen);
+  else
+    dprintf(out_fd, "%s", path);
+}
+
+// Entry i of the whole stack, 0 being the current directory
+const char* dir_stack_entry(int i) {
+  return i == 0 ? (shell_cwd ? shell_cwd : ".") : dir_stack[i - 1].path;
+}
+
+void dirs_print(int out_fd, bool long_form, bool per_line, bool numbered) {
+  for (int i = 0; i <= dir_depth; i++) {
+    if (numbered)
+      dprintf(out_fd, "%2d  ", i);
+    print_dir(out_fd, dir_stack_entry(i), long_form);
+    dprintf(out_fd, "%s", per_line || i == dir_depth ? "\n" : " ");
+  }
+}
+
+// Parses the +N/-N that pushd, popd and dirs take into an index of the
+// whole stack. Returns -1 if arg isn't one, -2 if it is out of range.
+int dir_stack_index(const char* arg) {
+  if ((arg[0] != '+' && arg[0] != '-') || arg[1] < '0' || arg[1] > '9')
+    return -1;
+  char* end;
+  long n = strtol(arg + 1, &end, 10);
+  if (*end)
+    return -1;
+  if (n > dir_depth)
+    return -2;
+  return arg[0] == '+' ? n : dir_depth - n;
+}
+
+// The current directory as a stack entry
+bool save_cwd(struct saved_dir* out) {
+  out->fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  out->path = strdup(shell_cwd ? shell_cwd : ".");
+  if (out->fd >= 0 && out->path)
+    return true;
+  if (out->fd >= 0)
+    close(out->fd);
+  free(out->path);
+  return false;
+}
+
+// Goes back to a saved directory. A directory removed since has no links
+// left, which fchdir alone wouldn't notice.
+int restore_dir(struct saved_dir* dir, const char* cmd, int err_fd) {
+  struct stat st;
+  if (fstat(dir->fd, &st) == 0 && st.st_nlink == 0)
+    errno = ENOENT;
+  else if (fchdir(dir->fd) == 0) {
+    char* path = strdup(dir->path);
+    if (path)
+      set_cwd(path);
+    return 0;
+  }
+  dprintf(err_fd, "%s: %s: %s\n", cmd, dir->path, strerror(errno));
+  return 1;
+}
+
+void saved_dir_free(struct saved_dir* dir) {
+  free(dir->path);
+  close(dir->fd);
+}
+
+int pushd_builtin(int argc, char** argv, int out_fd, int err_fd) {
+  if (argc > 2) {
+    dprintf(err_fd, "pushd: too many arguments\n");
+    return 1;
+  }
+  if (vars_frozen)
+    return argc == 2 && dir_stack_index(argv[1]) == -1 ? cd_to(argv[1], false, false, out_fd, err_fd, "pushd") : 0;
+
+  if (dir_depth == dir_cap) {
+    int cap = dir_cap ? dir_cap * 2 : 8;
+    struct saved_dir* grown = realloc(dir_stack, cap * sizeof(*grown));
+    if (!grown) {
+      dprintf(err_fd, "pushd: %s\n", strerror(ENOMEM));
+      return 1;
+    }
+    dir_stack = grown;
+    dir_cap = cap;
+  }
+
+  // Without an argument the top two entries swap places
+  bool swap = argc == 1;
+  int index = swap ? 1 : dir_stack_index(argv[1]);
+  if (swap && dir_depth == 0) {
+    dprintf(err_fd, "pushd: no other directory\n");
+    return 1;
+  }
+  if (index == -2) {
+    dprintf(err_fd, "pushd: %s: directory stack index out of range\n", argv[1]);
+    return 1;
+  }
+
+  struct saved_dir current;
+  if (!save_cwd(&current)) {
+    dprintf(err_fd, "pushd: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (index == -1) {
+    // pushd dir: the current directory goes on the stack
+    if (cd_to(argv[1], false, false, out_fd, err_fd, "pushd") != 0) {
+      saved_dir_free(&current);
+      return 1;
+    }
+    memmove(dir_stack + 1, dir_stack, dir_depth * sizeof(*dir_stack));
+    dir_stack[0] = current;
+    dir_depth++;
+  }
+  else if (index == 0) {
+    saved_dir_free(&current);
+  }
+  else if (swap) {
+    if (restore_dir(&dir_stack[0], "pushd", err_fd) != 0) {
+      saved_dir_free(&current);
+      return 1;
+    }
+    saved_dir_free(&dir_stack[0]);
+    dir_stack[0] = current;
+  }
+  else {
+    // Rotate the whole stack so that entry index comes to the top
+    struct saved_dir target = dir_stack[index - 1];
+    if (restore_dir(&target, "pushd", err_fd) != 0) {
+      saved_dir_free(&current);
+      return 1;
+    }
+    int n = dir_depth;
+    struct saved_dir* rotated = malloc(n * sizeof(*rotated));
+    if (!rotated) {
+      saved_dir_free(&current);
+      return 1;
+    }
+    // Whole stack: current, dir_stack[0..n-1]; the new order starts after target
+    int k = 0;
+    for (int i = index; i < n; i++)
+      rotated[k++] = dir_stack[i];
+    rotated[k++] = current;
+    for (int i = 0; i < index - 1; i++)
+      rotated[k++] = dir_stack[i];
+    saved_dir_free(&target);
+    memcpy(dir_stack, rotated, n * sizeof(*rotated));
+    free(rotated);
+  }
+  dirs_print(out_fd, false, false, false);
+  return 0;
+}
+
+int popd_builtin(int argc, char** argv, int out_fd, int err_fd) {
+  if (argc > 2) {
+    dprintf(err_fd, "popd: too many arguments\n");
+    return 1;
+  }
+  int index = argc == 2 ? dir_stack_index(argv[1]) : 0;
+  if (argc == 2 && index == -1) {
+    dprintf(err_fd, "popd: %s: invalid argument\n", argv[1]);
+    return 1;
+  }
+  if (dir_depth == 0) {
+    dprintf(err_fd, "popd: directory stack empty\n");
+    return 1;
+  }
+  if (index == -2) {
+    dprintf(err_fd, "popd: %s: directory stack index out of range\n", argv[1]);
+    return 1;
+  }
+  if (vars_frozen)
+    return 0;
+
+  // Removing the top means going to the next entry
+  if (index == 0) {
+    if (restore_dir(&dir_stack[0], "popd", err_fd) != 0)
+      return 1;
+    index = 1;
+  }
+  saved_dir_free(&dir_stack[index - 1]);
+  memmove(dir_stack + index - 1, dir_stack + index, (dir_depth - index) * sizeof(*dir_stack));
+  dir_depth--;
+  dirs_print(out_fd, false, false, false);
+  return 0;
+}
+
+int dirs_builtin(int argc, char** argv, int out_fd, int err_fd) {
+  bool long_form = false, per_line = false, numbered = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0) {
+      for (int j = 0; j < dir_depth && !vars_frozen; j++)
+        saved_dir_free(&dir_stack[j]);
+      if (!vars_frozen)
+        dir_depth = 0;
+      return 0;
+    }
+    int index = dir_stack_index(argv[i]);
+    if (index >= 0) {
+      print_dir(out_fd, dir_stack_entry(index), long_form);
+      dprintf(out_fd, "\n");
+      return 0;
+    }
+    if (index == -2) {
+      dprintf(err_fd, "dirs: %s: directory stack index out of range\n", argv[i]);
+      return 1;
+    }
+    if (argv[i][0] != '-' || !argv[i][1]) {
+      dprintf(err_fd, "dirs: %s: invalid option\n", argv[i]);
+      return 1;
+    }
+    for (const char* o = argv[i] + 1; *o; o++) {
+      if (*o == 'l')
+        long_form = true;
+      else if (*o == 'p')
+        per_line = true;
+      else if (*o == 'v')
+        per_line = numbered = true;
+      else {
+        dprintf(err_fd, "dirs: -%c: invalid option\n", *o);
+        return 1;
+      }
+    }
+  }
+  dirs_print(out_fd, long_form, per_line, numbered);
+  return 0;
+}
+
+// Runs a builtin with in_fd, out_fd and err_fd standing in for stdin,
+// stdout and stderr, so redirections and pipes never have to swap the
+// shell's own descriptors. Returns the exit status.
+int run_builtin(int argc, char** argv, int in_fd, int out_fd, int err_fd)
+{
+  // Set to 1 by the branches below when any operand fails
+  int status = 0;
+
+  if (strcmp(argv[0], "echo") == 0)
+  {
+    bool failed = false;
+    for (int i = 1; argv[i]; i++)
+    {
+      failed |= dprintf(out_fd, "%s", argv[i]) < 0;
+      if (argv[i + 1])
+        failed |= dprintf(out_fd, " ") < 0;
+    }
+    failed |= dprintf(out_fd, "\n") < 0;
+    // A reader that went away is not worth a message, as a process
+    // killed by SIGPIPE would leave none
+    if (failed && errno != EPIPE)
+      dprintf(err_fd, "echo: write error: %s\n", strerror(errno));
+    if (failed)
+      status = 1;
+  }
+  else if (argc >= 2 && strcmp(argv[0], "type") == 0)
+  { // TYPE COMMAND
+    for (int arg = 1; arg < argc; arg++)
+    {
+      const char* cmd = argv[arg];
+      if (find_function(cmd))
+      {
+        dprintf(out_fd, "%s is a function\n", cmd);
+      }
+      else if (is_builtin(cmd))
+      {
+        dprintf(out_fd, "%s is a shell builtin\n", cmd);
+      }
+      else
+      {
+        char* exe_path = find_executable(cmd);
+        if (exe_path)
+        {
+          dprintf(out_fd, "%s is %s\n", cmd, exe_path);
+          free(exe_path);
+        }
+        else
+        {
+          dprintf(out_fd, "%s: not found\n", cmd);
+          status = 1;
+        }
+      }
+    }
+    return status;
+  }
+  else if (strcmp(argv[0], "pwd") == 0)
+  {
+    bool physical = false;
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-P") == 0)
+        physical = true;
+      else if (strcmp(argv[i], "-L") == 0)
+        physical = false;
+      else {
+        dprintf(err_fd, "pwd: %s: invalid option\n", argv[i]);
+        return 2;
+      }
+    }
+    if (physical || !shell_cwd) {
+      char* cwd = getcwd(NULL, 0);
+      if (!cwd) {
+        dprintf(err_fd, "pwd: %s\n", strerror(errno));
+        return 1;
+      }
+      dprintf(out_fd, "%s\n", cwd);
+      free(cwd);
+    }
+    else {
+      dprintf(out_fd, "%s\n", shell_cwd);
+    }
+  }
+  else if (strcmp(argv[0], "cd") == 0)
+  {
+    bool physical = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+      if (strcmp(argv[i], "--") == 0) {
+        i++;
+        break;
+      }
+      if (strcmp(argv[i], "-P") == 0)
+        physical = true;
+      else if (strcmp(argv[i], "-L") == 0)
+        physical = false;
+      else {
+        dprintf(err_fd, "cd: %s: invalid option\n", argv[i]);
+        return 2;
+      }
+    }
+
+    const char* path = NULL;
+    char* home_path = NULL;
+    bool print = false;
+    if (argc - i > 1)
+    {
+      dprintf(err_fd, "cd: too many arguments\n");
+      return 1;
+    }
+    else if (i == argc || strcmp(argv[i], "~") == 0)
+    {
+      path = var_get("HOME");
+      if (!path)
+      {
+        dprintf(err_fd, "cd: HOME not set\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "-") == 0)
+    {
+      path = var_get("OLDPWD");
+      if (!path)
+      {
+        dprintf(err_fd, "cd: OLDPWD not set\n");
+        return 1;
+      }
+      print = true;
+    }
+    else if (strncmp(argv[i], "~/", 2) == 0)
+    {
+      // Tab completion produces "~/dir/", so accept it here too
+      const char* home = var_get("HOME");
+      if (!home)
+      {
+        dprintf(err_fd, "cd: HOME not set\n");
+        return 1;
+      }
+      home_path = path_under(home, argv[i] + 2);
+      path = home_path;
+    }
+    else
+      path = argv[i];
+
+    status = path ? cd_to(path, physical, print, out_fd, err_fd, "cd") : 1;
+    free(home_path);
+    return status;
+  }
+  else if (strcmp(argv[0], "pushd") == 0) {
+    return pushd_builtin(argc, argv, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "popd") == 0) {
+    return popd_builtin(argc, argv, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "dirs") == 0) {
+    return dirs_builtin(argc, argv, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "mkdir") == 0) {
+    if (argc < 2) {
+      dprintf(err_fd, "mkdir: missing operand\n");
+      return 1;
+    }
+
+    bool parents = false;
+    int start_idx = 1;
+
+    if (strcmp(argv[1], "-p") == 0) {
+      parents = true;
+      start_idx = 2;
+      if (argc < 3) {
+        dprintf(err_fd, "mkdir: missing operand\n");
+        return 1;
+      }
+    }
+
+    int count = argc - start_idx;
+    struct fs_op* ops = calloc(count, sizeof(*ops));
+    if (!ops)
+      return 1;
+    struct path_set known = { 0 };
+    for (int i = 0; i < count; i++) {
+      ops[i] = (struct fs_op){ .opcode = IORING_OP_MKDIRAT, .dirfd = AT_FDCWD, .path = argv[start_idx + i], .mode = 0755 };
+      if (parents)
+        ops[i].result = mkdir_parents(ops[i].path, 0755, &known) != 0 ? -errno : 0;
+    }
+    path_set_free(&known);
+    if (!parents)
+      fs_batch_run(ops, count);
+
+    for (int i = 0; i < count; i++) {
+      if (ops[i].result < 0) {
+        dprintf(err_fd, "mkdir: cannot create directory '%s': %s\n",
+          ops[i].path, strerror(-ops[i].result));
+        status = 1;
+      }
+    }
+    free(ops);
+  }
+  else if (strcmp(argv[0], "rmdir") == 0) {
+    if (argc < 2) {
+      dprintf(err_fd, "rmdir: missing operand\n");
+      return 1;
+    }
+
+    int count = argc - 1;
+    struct fs_op* ops = calloc(count, sizeof(*ops));
+    if (!ops)
+      return 1;
+    for (int i = 0; i < count; i++)
+      ops[i] = (struct fs_op){ .opcode = IORING_OP_UNLINKAT, .dirfd = AT_FDCWD, .path = argv[i + 1], .flags = AT_REMOVEDIR };
+    fs_batch_run(ops, count);
+
+    for (int i = 0; i < count; i++) {
+      if (ops[i].result < 0) {
+        dprintf(err_fd, "rmdir: failed to remove '%s': %s\n",
+          ops[i].path, strerror(-ops[i].result));
+        status = 1;
+      }
+    }
+    free(ops);
+  }
+  else if (strcmp(argv[0], "rm") == 0) {
+    if (argc < 2) {
+      dprintf(err_fd, "rm: missing operand\n");
+      return 1;
+    }
+
+    bool recursive = false;
+    bool force = false;
+    int start_idx = 1;
+
+    // Parse flags
+    for (int i = 1; argv[i]; i++) {
+      if (argv[i][0] == '-') {
+        for (int j = 1; argv[i][j]; j++) {
+          if (argv[i][j] == 'r' || argv[i][j] == 'R') {
+            recursive = true;
+          }
+          else if (argv[i][j] == 'f') {
+            force = true;
+          }
+        }
+        start_idx = i + 1;
+      }
+      else {
+        break;
+      }
+    }
+
+    if (!argv[start_idx]) {
+      dprintf(err_fd, "rm: missing operand\n");
+      return 1;
+    }
+
+    // Unlink everything as one batch; unlink fails with EISDIR on
+    // directories, which are then removed recursively with -r
+    int count = argc - start_idx;
+    struct fs_op* ops = calloc(count, sizeof(*ops));
+    if (!ops)
+      return 1;
+    for (int i = 0; i < count; i++)
+      ops[i] = (struct fs_op){ .opcode = IORING_OP_UNLINKAT, .dirfd = AT_FDCWD, .path = argv[start_idx + i] };
+    fs_batch_run(ops, count);
+
+    for (int i = 0; i < count; i++) {
+      const char* path = ops[i].path;
+      // -f only keeps quiet about files that don't exist
+      if (ops[i].result == -EISDIR && recursive) {
+        if (rmdir_recursive(path) != 0 && !(force && errno == ENOENT)) {
+          dprintf(err_fd, "rm: cannot remove '%s': %s\n",
+            path, strerror(errno));
+          status = 1;
+        }
+      }
+      else if (ops[i].result == -EISDIR) {
+        dprintf(err_fd, "rm: cannot remove '%s': Is a directory\n", path);
+        status = 1;
+      }
+      else if (ops[i].result < 0 && !(force && ops[i].result == -ENOENT)) {
+        dprintf(err_fd, "rm: cannot remove '%s': %s\n",
+          path, strerror(-ops[i].result));
+        status = 1;
+      }
+    }
+    free(ops);
+  }
+
+  else if (strcmp(argv[0], "touch") == 0) {
+    if (argc < 2) {
+      dprintf(err_fd, "touch: missing operand\n");
+      return 1;
+    }
+
+    // One batch of opens, then one batch closing what was opened
+    int count = argc - 1;
+    struct fs_op* ops = calloc(count * 2, sizeof(*ops));
+    if (!ops)
+      return 1;
+    for (int i = 0; i < count; i++)
+      ops[i] = (struct fs_op){ .opcode = IORING_OP_OPENAT, .dirfd = AT_FDCWD, .path = argv[i + 1], .flags = O_WRONLY | O_CREAT | O_CLOEXEC, .mode = 0644 };
+    fs_batch_run(ops, count);
+
+    struct fs_op* closes = ops + count;
+    int opened = 0;
+    for (int i = 0; i < count; i++) {
+      if (ops[i].result < 0) {
+        dprintf(err_fd, "touch: cannot touch '%s': %s\n",
+          ops[i].path, strerror(-ops[i].result));
+        status = 1;
+      }
+      else {
+        closes[opened++] = (struct fs_op){ .opcode = IORING_OP_CLOSE, .fd = ops[i].result };
+      }
+    }
+    fs_batch_run(closes, opened);
+    free(ops);
+  }
+
+  else if (strcmp(argv[0], "cp") == 0) {
+    if (argc < 3) {
+      dprintf(err_fd, "cp: missing operand\n");
+      return 1;
+    }
+
+    const char* src = argv[1];
+    const char* dst = argv[2];
+
+    int src_fd = open(src, O_RDONLY);
+    if (src_fd < 0) {
+      dprintf(err_fd, "cp: cannot open '%s': %s\n", src, strerror(errno));
+      return 1;
+    }
+
+    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst_fd < 0) {
+      dprintf(err_fd, "cp: cannot create '%s': %s\n", dst, strerror(errno));
+      close(src_fd);
+      return 1;
+    }
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(src_fd, buf, sizeof(buf))) > 0) {
+      if (write(dst_fd, buf, n) != n) {
+        dprintf(err_fd, "cp: write error: %s\n", strerror(errno));
+        status = 1;
+        break;
+      }
+    }
+    if (n < 0) {
+      dprintf(err_fd, "cp: error reading '%s': %s\n", src, strerror(errno));
+      status = 1;
+    }
+
+    close(src_fd);
+    close(dst_fd);
+  }
+
+  else if (strcmp(argv[0], "mv") == 0) {
+    return mv_builtin(argc, argv, err_fd);
+  }
+  else if (strcmp(argv[0], "shopt") == 0) {
+    return shopt_builtin(argc, argv, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "cat") == 0) {
+    return cat_builtin(argc, argv, in_fd, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "head") == 0) {
+    return head_builtin(argc, argv, in_fd, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "tail") == 0) {
+    return tail_builtin(argc, argv, in_fd, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "wc") == 0) {
+    return wc_builtin(argc, argv, in_fd, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "export") == 0) {
+    return export_builtin(argc, argv, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "unset") == 0) {
+    return unset_builtin(argc, argv, err_fd);
+  }
+  else if (strcmp(argv[0], "test") == 0 || strcmp(argv[0], "[") == 0) {
+    return test_builtin(argc, argv, err_fd);
+  }
+  else if (strcmp(argv[0], "true") == 0) {
+    return 0;
+  }
+  else if (strcmp(argv[0], "false") == 0) {
+    return 1;
+  }
+  else if (strcmp(argv[0], "break") == 0 || strcmp(argv[0], "continue") == 0) {
+    if (loop_depth == 0) {
+      dprintf(err_fd, "%s: only meaningful in a `for', `while', or `until' loop\n", argv[0]);
+      return 0;
+    }
+    long n = 1;
+    if (argc > 1) {
+      char* end;
+      n = strtol(argv[1], &end, 10);
+      if (*end || n < 1) {
+        dprintf(err_fd, "%s: %s: loop count out of range\n", argv[0], argv[1]);
+        return 1;
+      }
+    }
+    if (n > loop_depth)
+      n = loop_depth;
+    if (argv[0][0] == 'b')
+      break_count = n;
+    else
+      continue_count = n;
+  }
+  else if (strcmp(argv[0], "return") == 0) {
+    if (function_depth == 0) {
+      dprintf(err_fd, "return: can only `return' from a function\n");
+      return 1;
+    }
+    returning = true;
+    return argc > 1 ? atoi(argv[1]) & 255 : last_status;
+  }
+  else if (strcmp(argv[0], "tee") == 0) {
+    return tee_builtin(argc, argv, in_fd, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "xargs") == 0) {
+    return xargs_builtin(argc, argv, in_fd, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "timeout") == 0) {
+    return timeout_builtin(argc, argv, in_fd, out_fd, err_fd);
+  }
+  else if (strcmp(argv[0], "history") == 0) {
+    if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+      const char* filepath = argv[2];
+      FILE* fp = fopen(filepath, "r");
+
+      if (!fp) {
+        dprintf(err_fd, "history: %s: %s\n", filepath, strerror(errno));
+        return 1;
+      }
+      history_lock(fileno(fp), LOCK_SH);
+
+      char line[1024];
+      while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strlen(line) == 0) continue;
+
+        history_push(line, false);
+      }
+
+      fclose(fp);
+    }
+    else if (argc >= 3 && strcmp(argv[1], "-w") == 0) {
+      // Replaced in one rename so that a session sharing the file never
+      // sees it half written
+      const char* filepath = argv[2];
+      struct strbuf text = { 0 };
+      for (int i = 0; i < history_count; i++) {
+        if (history_commands[i]) {
+          strbuf_append(&text, history_commands[i], strlen(history_commands[i]));
+          strbuf_putc(&text, '\n');
+        }
+      }
+
+      int written = history_write_atomic(filepath, text.data, text.len, false);
+      free(text.data);
+      if (written < 0) {
+        dprintf(err_fd, "history: %s: %s\n", filepath, strerror(errno));
+        return 1;
+      }
+    }
+    else if (argc >= 3 && strcmp(argv[1], "-a") == 0) {
+      const char* filepath = argv[2];
+      FILE* fp = fopen(filepath, "a");
+
+      if (!fp) {
+        dprintf(err_fd, "history: %s: %s\n", filepath, strerror(errno));
+        return 1;
+      }
+      // Held until fclose has flushed the lines
+      history_lock(fileno(fp), LOCK_EX);
+
+      for (int i = last_appended_index; i < history_count; i++) {
+        if (history_commands[i])
+          fprintf(fp, "%s\n", history_commands[i]);
+      }
+
+      if (ferror(fp) | fclose(fp)) {
+        dprintf(err_fd, "history: %s: %s\n", filepath, strerror(errno));
+        return 1;
+      }
+      last_appended_index = history_count;
+    }
+    else {
+      int n = history_live;
+
+      if (argc == 2) {
+        char* end;
+        long count = strtol(argv[1], &end, 10);
+        if (!argv[1][0] || *end) {
+          dprintf(err_fd, "history: %s: numeric argument required\n", argv[1]);
+          return 1;
+        }
+        n = count < 0 ? 0 : count > history_live ? history_live : (int)count;
+      }
+
+      // Entries are numbered by position, not counting erased ones
+      int number = 0;
+      for (int i = history_first; i < history_count; i++) {
+        if (!history_commands[i])
+          continue;
+        number++;
+        if (number > history_live - n)
+          dprintf(out_fd, "%5d  %s\n", number, history_commands[i]);
+      }
+    }
+  }
+
+  return status;
+}
+
+// Opens the redirections of a command in the order written, so a later one
+// wins and "2>&1 >f" differs from ">f 2>&1". fds[i] receives the
+// descriptor that replaces stdin, stdout or stderr, or -1 where nothing is
+// redirected. defaults[i] is what descriptor i is otherwise (the shell's
+// own, or a pipe), which N>&M copies when M isn't redirected itself.
+// Everything is opened close-on-exec; children get them via dup2.
+// Reports the failure and returns -1 (leaving nothing open) on error.
+int open_redirections(struct redirections* redir, int fds[3], const int defaults[3])
+{
+  fds[0] = fds[1] = fds[2] = -1;
+  if (redir->failed)
+    return -1;
+
+  for (int i = 0; i < redir->count; i++) {
+    struct redirection* r = &redir->items[i];
+    const char* what = r->target;
+    int fd = -1;
+    if (r->fd > 2) {
+      fprintf(stderr, "%d: redirecting descriptors above 2 is not supported\n", r->fd);
+      close_redirections(fds);
+      return -1;
+    }
+
+    switch (r->kind) {
+    case REDIR_IN:
+      fd = open(r->target, O_RDONLY | O_CLOEXEC);
+      break;
+    case REDIR_OUT:
+    case REDIR_APPEND:
+      fd = open(r->target, O_WRONLY | O_CREAT | O_CLOEXEC | (r->kind == REDIR_APPEND ? O_APPEND : O_TRUNC), 0644);
+      break;
+    case REDIR_HEREDOC:
+      what = "here-document";
+      fd = open_input_data(r->data, r->len);
+      break;
+    case REDIR_HERESTRING: {
+      // Delivered with a trailing newline
+      what = "here-string";
+      size_t n = strlen(r->target);
+      r->target[n] = '\n';
+      fd = open_input_data(r->target, n + 1);
+      r->target[n] = '\0';
+      break;
+    }
+    default: {
+      char* end;
+      long from = strtol(r->target, &end, 10);
+      if (!r->target[0] || *end || from < 0 || from > 2) {
+        fprintf(stderr, "%s: %s\n", r->target, strcmp(r->target, "-") == 0 ?
+          "closing a descriptor is not supported" : "bad file descriptor");
+        close_redirections(fds);
+        return -1;
+      }
+      fd = fcntl(fds[from] >= 0 ? fds[from] : defaults[from], F_DUPFD_CLOEXEC, 3);
+      break;
+    }
+    }
+
+    if (fd < 0) {
+      fprintf(stderr, "%s: %s\n", what, strerror(errno));
+      close_redirections(fds);
+      return -1;
+    }
+    if (fds[r->fd] >= 0)
+      close(fds[r->fd]);
+    fds[r->fd] = fd;
+  }
+  return 0;
+}
+
+// Glob characters that were quoted or escaped are preceded by this byte in
+// the lexer's output, so pathname expansion can tell them from live ones.
+// expand_words() removes the marks.
+#define GLOB_QUOTE '\x01'
+
+// The words of a command. Every string a word points into is owned by
+// blocks: one per expanded word, one packed string table per
+// glob-expanded word.
+struct word_list {
+  char** words; // NULL-terminated
+  int count, cap;
+  char** blocks;
+  int nblocks, blocks_cap;
+};
+
+bool word_list_add(struct word_list* wl, char* word) {
+  if (wl->count + 1 >= wl->cap) {
+    int cap = wl->cap ? wl->cap * 2 : 32;
+    char** grown = realloc(wl->words, cap * sizeof(char*));
+    if (!grown)
+      return false;
+    wl->words = grown;
+    wl->cap = cap;
+  }
+  wl->words[wl->count++] = word;
+  wl->words[wl->count] = NULL;
+  return true;
+}
+
+bool word_list_own(struct word_list* wl, char* block) {
+  if (wl->nblocks == wl->blocks_cap) {
+    int cap = wl->blocks_cap ? wl->blocks_cap * 2 : 32;
+    char** grown = realloc(wl->blocks, cap * sizeof(char*));
+    if (!grown) {
+      free(block);
+      return false;
+    }
+    wl->blocks = grown;
+    wl->blocks_cap = cap;
+  }
+  wl->blocks[wl->nblocks++] = block;
+  return true;
+}
+
+void word_list_free(struct word_list* wl) {
+  for (int i = 0; i < wl->nblocks; i++)
+    free(wl->blocks[i]);
+  free(wl->blocks);
+  free(wl->words);
+  memset(wl, 0, sizeof(*wl));
+}
+
+// Pathname expansion. Each word with live glob characters is split into
+// path components, and each component is compiled once into a short list
+// of match ops. Directories are read once per command with their d_type,
+// so matching needs no stat() except where d_type is unknown, and matches
+// are collected in a packed string table sorted through an offset array.
+enum { GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_op {
+  unsigned char kind;
+  bool negate;           // [!...]
+  unsigned short len;    // GLOB_LITERAL
+  const char* lit;       // GLOB_LITERAL, points into glob_component.text
+  uint32_t bits[8];      // GLOB_CLASS, one bit per byte value
+};
+
+struct glob_component {
+  char* text;          // the component with quote marks removed
+  struct glob_op* ops;
+  int nops;
+  bool literal;        // nothing to match, just a name
+  bool globstar;       // the component is exactly **
+  bool dot_ok;         // starts with a literal '.', so it can match dotfiles
+  const char* prefix;  // literal the name must start with
+  size_t prefix_len;
+  const char* suffix;  // literal the name must end with
+  size_t suffix_len;
+};
+
+bool has_live_glob(const char* word) {
+  for (const char* p = word; *p; p++) {
+    if (*p == GLOB_QUOTE && p[1])
+      p++;
+    else if (*p == '*' || *p == '?' || *p == '[')
+      return true;
+  }
+  return false;
+}
+
+void strip_glob_quotes(char* word) {
+  char* w = word;
+  for (char* p = word; *p; p++) {
+    if (*p == GLOB_QUOTE && p[1])
+      p++;
+    *w++ = *p;
+  }
+  *w = '\0';
+}
+
+// Parses a bracket expression starting after '['. Returns the length
+// consumed including the closing ']', or 0 if there is none (then the '['
+// is an ordinary character).
+size_t compile_glob_class(const char* p, size_t len, struct glob_op* op) {
+  size_t i = 0;
+  memset(op->bits, 0, sizeof(op->bits));
+  op->kind = GLOB_CLASS;
+  op->negate = i < len && (p[i] == '!' || p[i] == '^');
+  if (op->negate)
+    i++;
+  bool first = true;
+  while (i < len && (p[i] != ']' || first)) {
+    first = false;
+    if (p[i] == GLOB_QUOTE && i + 1 < len)
+      i++;
+    unsigned char lo = p[i++], hi = lo;
+    if (i + 1 < len && p[i] == '-' && p[i + 1] != ']') {
+      i++;
+      if (p[i] == GLOB_QUOTE && i + 1 < len)
+        i++;
+      hi = p[i++];
+    }
+    for (unsigned c = lo; c <= hi; c++)
+      op->bits[c >> 5] |= 1u << (c & 31);
+  }
+  return i < len ? i + 1 : 0;
+}
+
+bool compile_glob_component(const char* p, size_t len, struct glob_component* gc) {
+  memset(gc, 0, sizeof(*gc));
+  gc->text = malloc(len + 1);
+  gc->ops = malloc((len + 1) * sizeof(struct glob_op));
+  if (!gc->text || !gc->ops)
+    return false;
+
+  gc->globstar = len == 2 && p[0] == '*' && p[1] == '*';
+  gc->dot_ok = len > 0 && p[0] == '.';
+  size_t t = 0;
+  for (size_t i = 0; i < len;) {
+    struct glob_op* op = &gc->ops[gc->nops];
+    if (p[i] == '*') {
+      while (i < len && p[i] == '*')
+        i++;
+      op->kind = GLOB_STAR;
+      gc->nops++;
+      continue;
+    }
+    if (p[i] == '?') {
+      op->kind = GLOB_ANY;
+      gc->nops++;
+      i++;
+      continue;
+    }
+    if (p[i] == '[') {
+      size_t used = compile_glob_class(p + i + 1, len - i - 1, op);
+      if (used) {
+        gc->nops++;
+        i += 1 + used;
+        continue;
+      }
+    }
+
+    // A literal run, extending the previous one if there is one
+    if (p[i] == GLOB_QUOTE && i + 1 < len)
+      i++;
+    if (gc->nops == 0 || gc->ops[gc->nops - 1].kind != GLOB_LITERAL) {
+      op->kind = GLOB_LITERAL;
+      op->lit = gc->text + t;
+      op->len = 0;
+      gc->nops++;
+    }
+    gc->text[t++] = p[i++];
+    gc->ops[gc->nops - 1].len++;
+  }
+  gc->text[t] = '\0';
+
+  gc->literal = gc->nops == 0 || (gc->nops == 1 && gc->ops[0].kind == GLOB_LITERAL);
+  if (gc->nops > 1 && gc->ops[0].kind == GLOB_LITERAL) {
+    gc->prefix = gc->ops[0].lit;
+    gc->prefix_len = gc->ops[0].len;
+  }
+  if (gc->nops > 1 && gc->ops[gc->nops - 1].kind == GLOB_LITERAL) {
+    gc->suffix = gc->ops[gc->nops - 1].lit;
+    gc->suffix_len = gc->ops[gc->nops - 1].len;
+  }
+  return true;
+}
+
+// Matches name against the compiled ops. A mismatch after a '*' retries
+// with the star taking one more character; only the last star needs
+// revisiting, so this is linear for the usual patterns.
+bool glob_match(const struct glob_component* gc, const char* name) {
+  if (name[0] == '.' && !gc->dot_ok)
+    return false;
+  size_t name_len = strlen(name);
+  if (gc->prefix_len && (name_len < gc->prefix_len || memcmp(name, gc->prefix, gc->prefix_len) != 0))
+    return false;
+  if (gc->suffix_len && (name_len < gc->suffix_len ||
+    memcmp(name + name_len - gc->suffix_len, gc->suffix, gc->suffix_len) != 0))
+    return false;
+
+  const char* s = name;
+  int i = 0, star = -1;
+  const char* star_s = NULL;
+  while (true) {
+    if (i < gc->nops) {
+      const struct glob_op* op = &gc->ops[i];
+      unsigned char c = *s;
+      if (op->kind == GLOB_STAR) {
+        if (i == gc->nops - 1)
+          return true;
+        star = i++;
+        star_s = s;
+        continue;
+      }
+      if (op->kind == GLOB_LITERAL && strncmp(s, op->lit, op->len) == 0) {
+        s += op->len;
+        i++;
+        continue;
+      }
+      if (op->kind == GLOB_ANY && c) {
+        s++;
+        i++;
+        continue;
+      }
+      if (op->kind == GLOB_CLASS && c && (bool)(op->bits[c >> 5] & (1u << (c & 31))) != op->negate) {
+        s++;
+        i++;
+        continue;
+      }
+    }
+    else if (*s == '\0') {
+      return true;
+    }
+    if (star < 0 || *star_s == '\0')
+      return false;
+    s = ++star_s;
+    i = star + 1;
+  }
+}
+
+// One directory as read during an expansion
+struct glob_dir {
+  char* path;
+  char* names; // packed, NUL-separated
+  int* offsets;
+  unsigned char* types;
+  int count;
+  bool failed;
+};
+
+// State of one expand_words() call: the directories read so far, indexed
+// by path, and the matches of the word being expanded
+struct glob_ctx {
+  struct glob_dir** dirs; // stable while walks hold on to them
+  int ndirs, dir_cap;
+  struct path_set dir_index; // flags hold the index into dirs plus one
+
+  char* data; // matches, packed
+  size_t data_len, data_cap;
+  size_t* offsets;
+  int count, cap;
+};
+
+struct glob_dir* glob_read_dir(struct glob_ctx* ctx, const char* path, size_t path_len) {
+  unsigned idx = path_set_get(&ctx->dir_index, path, path_len);
+  if (idx)
+    return ctx->dirs[idx - 1];
+
+  if (ctx->ndirs == ctx->dir_cap) {
+    int cap = ctx->dir_cap ? ctx->dir_cap * 2 : 16;
+    struct glob_dir** grown = realloc(ctx->dirs, cap * sizeof(*grown));
+    if (!grown)
+      return NULL;
+    ctx->dirs = grown;
+    ctx->dir_cap = cap;
+  }
+  struct glob_dir* gd = calloc(1, sizeof(*gd));
+  if (gd)
+    gd->path = strndup(path, path_len);
+  if (!gd || !gd->path) {
+    free(gd);
+    return NULL;
+  }
+  ctx->dirs[ctx->ndirs++] = gd;
+  path_set_add(&ctx->dir_index, gd->path, path_len, ctx->ndirs);
+
+  DIR* d = opendir(path_len ? gd->path : ".");
+  if (!d) {
+    gd->failed = true;
+    return gd;
+  }
+  size_t names_len = 0, names_cap = 4096;
+  int cap = 64;
+  gd->names = malloc(names_cap);
+  gd->offsets = malloc(cap * sizeof(int));
+  gd->types = malloc(cap);
+  struct dirent* e;
+  while (gd->names && gd->offsets && gd->types && (e = readdir(d))) {
+    if (e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2])))
+      continue;
+    size_t n = strlen(e->d_name) + 1;
+    if (names_len + n > names_cap) {
+      while (names_len + n > names_cap)
+        names_cap *= 2;
+      char* grown = realloc(gd->names, names_cap);
+      if (!grown)
+        break;
+      gd->names = grown;
+    }
+    if (gd->count == cap) {
+      cap *= 2;
+      int* offsets = realloc(gd->offsets, cap * sizeof(int));
+      unsigned char* types = offsets ? realloc(gd->types, cap) : NULL;
+      if (offsets)
+        gd->offsets = offsets;
+      if (!types)
+        break;
+      gd->types = types;
+    }
+    memcpy(gd->names + names_len, e->d_name, n);
+    gd->offsets[gd->count] = names_len;
+    gd->types[gd->count++] = e->d_type;
+    names_len += n;
+  }
+  closedir(d);
+  return gd;
+}
+
+void glob_add_match(struct glob_ctx* ctx, const char* prefix, size_t prefix_len, const char* name, bool slash) {
+  size_t name_len = strlen(name);
+  size_t need = prefix_len + name_len + slash + 1;
+  if (ctx->data_len + need > ctx->data_cap) {
+    size_t cap = ctx->data_cap ? ctx->data_cap : 4096;
+    while (ctx->data_len + need > cap)
+      cap *= 2;
+    char* grown = realloc(ctx->data, cap);
+    if (!grown)
+      return;
+    ctx->data = grown;
+    ctx->data_cap = cap;
+  }
+  if (ctx->count == ctx->cap) {
+    int cap = ctx->cap ? ctx->cap * 2 : 64;
+    size_t* grown = realloc(ctx->offsets, cap * sizeof(size_t));
+    if (!grown)
+      return;
+    ctx->offsets = grown;
+    ctx->cap = cap;
+  }
+  char* out = ctx->data + ctx->data_len;
+  memcpy(out, prefix, prefix_len);
+  memcpy(out + prefix_len, name, name_len);
+  if (slash)
+    out[prefix_len + name_len] = '/';
+  out[need - 1] = '\0';
+  ctx->offsets[ctx->count++] = ctx->data_len;
+  ctx->data_len += need;
+}
+
+// d_type says whether an entry is a directory, except for symlinks
+// (followed, as with any other path) and filesystems that don't fill it in
+bool glob_entry_is_dir(const char* prefix, size_t prefix_len, const char* name, unsigned char type) {
+  if (type == DT_DIR)
+    return true;
+  if (type != DT_LNK && type != DT_UNKNOWN)
+    return false;
+  char* path = malloc(prefix_len + strlen(name) + 1);
+  if (!path)
+    return false;
+  memcpy(path, prefix, prefix_len);
+  strcpy(path + prefix_len, name);
+  struct stat st;
+  bool dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+  free(path);
+  return dir;
+}
+
+// Matches components[i..] against the directory named by prefix (which
+// ends with '/' unless empty). dirs_only is set for a trailing '/'.
+void glob_walk(struct glob_ctx* ctx, struct glob_component* comps, int ncomps, int i,
+  const char* prefix, size_t prefix_len, bool dirs_only) {
+  struct glob_component* gc = &comps[i];
+  bool last = i == ncomps - 1;
+
+  if (gc->literal) {
+    size_t len = strlen(gc->text);
+    char* next = malloc(prefix_len + len + 2);
+    if (!next)
+      return;
+    memcpy(next, prefix, prefix_len);
+    memcpy(next + prefix_len, gc->text, len);
+    next[prefix_len + len] = '\0';
+    if (last) {
+      struct stat st;
+      if (dirs_only ? stat(next, &st) == 0 && S_ISDIR(st.st_mode) : lstat(next, &st) == 0)
+        glob_add_match(ctx, prefix, prefix_len, gc->text, dirs_only);
+    }
+    else {
+      next[prefix_len + len] = '/';
+      glob_walk(ctx, comps, ncomps, i + 1, next, prefix_len + len + 1, dirs_only);
+    }
+    free(next);
+    return;
+  }
+
+  // ** matches this directory and every directory below it that isn't
+  // hidden, without following symlinks
+  if (gc->globstar && !last)
+    glob_walk(ctx, comps, ncomps, i + 1, prefix, prefix_len, dirs_only);
+  else if (gc->globstar && dirs_only && prefix_len > 0)
+    glob_add_match(ctx, prefix, prefix_len, "", false);
+
+  struct glob_dir* gd = glob_read_dir(ctx, prefix, prefix_len);
+  if (!gd || gd->failed)
+    return;
+  for (int k = 0; k < gd->count; k++) {
+    const char* name = gd->names + gd->offsets[k];
+    if (gc->globstar ? name[0] == '.' : !glob_match(gc, name))
+      continue;
+
+    bool is_dir;
+    if (gc->globstar)
+      is_dir = gd->types[k] == DT_DIR || (gd->types[k] == DT_UNKNOWN && glob_entry_is_dir(prefix, prefix_len, name, DT_UNKNOWN));
+    else if (last && !dirs_only)
+      is_dir = false; // not needed
+    else
+      is_dir = glob_entry_is_dir(prefix, prefix_len, name, gd->types[k]);
+
+    if (last && (!dirs_only || is_dir))
+      glob_add_match(ctx, prefix, prefix_len, name, dirs_only);
+    if (!is_dir || (last && !gc->globstar))
+      continue;
+
+    size_t name_len = strlen(name);
+    char* next = malloc(prefix_len + name_len + 2);
+    if (!next)
+      continue;
+    memcpy(next, prefix, prefix_len);
+    memcpy(next + prefix_len, name, name_len);
+    next[prefix_len + name_len] = '/';
+    next[prefix_len + name_len + 1] = '\0';
+    glob_walk(ctx, comps, ncomps, gc->globstar ? i : i + 1, next, prefix_len + name_len + 1, dirs_only);
+    free(next);
+  }
+}
+
+int cmp_glob_offsets(const void* a, const void* b, void* data) {
+  return strcmp((const char*)data + *(const size_t*)a, (const char*)data + *(const size_t*)b);
+}
+
+// Expands one word into ctx's match table. Returns the number of matches.
+int glob_expand_word(struct glob_ctx* ctx, const char* word) {
+  ctx->data_len = 0;
+  ctx->count = 0;
+
+  int ncomps = 1;
+  for (const char* p = word; *p; p++)
+    ncomps += *p == '/';
+  struct glob_component* comps = calloc(ncomps, sizeof(*comps));
+  if (!comps)
+    return 0;
+
+  // Split into components, dropping empty ones from repeated slashes
+  const char* p = word;
+  bool absolute = *p == '/';
+  int n = 0;
+  bool ok = true;
+  while (*p && ok) {
+    while (*p == '/')
+      p++;
+    if (!*p)
+      break;
+    const char* end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    ok = compile_glob_component(p, len, &comps[n++]);
+    p += len;
+  }
+  bool dirs_only = p > word && p[-1] == '/';
+
+  if (ok && n > 0)
+    glob_walk(ctx, comps, n, 0, absolute ? "/" : "", absolute, dirs_only);
+
+  for (int i = 0; i < n; i++) {
+    free(comps[i].text);
+    free(comps[i].ops);
+  }
+  free(comps);
+
+  if (ctx->count > 1) {
+    qsort_r(ctx->offsets, ctx->count, sizeof(size_t), cmp_glob_offsets, ctx->data);
+    // ** patterns can reach the same path twice
+    int kept = 1;
+    for (int i = 1; i < ctx->count; i++) {
+      if (strcmp(ctx->data + ctx->offsets[i], ctx->data + ctx->offsets[kept - 1]) != 0)
+        ctx->offsets[kept++] = ctx->offsets[i];
+    }
+    ctx->count = kept;
+  }
+  return ctx->count;
+}
+
+// Performs pathname expansion on the words of tokens, moving them into
+// out. A word whose pattern matches nothing is kept as typed, without its
+// quote marks.
+void expand_words(struct word_list* tokens, struct word_list* out) {
+  memset(out, 0, sizeof(*out));
+  struct glob_ctx ctx = { 0 };
+
+  for (int i = 0; i < tokens->count; i++) {
+    char* word = tokens->words[i];
+    if (!has_live_glob(word) || glob_expand_word(&ctx, word) == 0) {
+      strip_glob_quotes(word);
+      word_list_add(out, word);
+      continue;
+    }
+
+    // Hand the match table over to the word list as one block
+    if (!word_list_own(out, ctx.data)) {
+      ctx.data = NULL;
+      ctx.data_cap = 0;
+      continue;
+    }
+    for (int k = 0; k < ctx.count; k++)
+      word_list_add(out, ctx.data + ctx.offsets[k]);
+    ctx.data = NULL;
+    ctx.data_cap = 0;
+  }
+
+  // The unexpanded words still live in the tokens' blocks
+  for (int i = 0; i < tokens->nblocks; i++)
+    word_list_own(out, tokens->blocks[i]);
+  free(tokens->blocks);
+  free(tokens->words);
+  memset(tokens, 0, sizeof(*tokens));
+
+  for (int i = 0; i < ctx.ndirs; i++) {
+    free(ctx.dirs[i]->path);
+    free(ctx.dirs[i]->names);
+    free(ctx.dirs[i]->offsets);
+    free(ctx.dirs[i]->types);
+    free(ctx.dirs[i]);
+  }
+  free(ctx.dirs);
+  path_set_free(&ctx.dir_index);
+  free(ctx.data);
+  free(ctx.offsets);
+  if (!out->words)
+    out->words = calloc(1, sizeof(char*));
+}
+
+// Copies a quoted character into the word being built, marking it if it
+// would otherwise be taken as a glob character
+void put_quoted(struct strbuf* word, char c) {
+  if (c == '*' || c == '?' || c == '[')
+    strbuf_putc(word, GLOB_QUOTE);
+  strbuf_putc(word, c);
+}
+
+// Given p just past "$(", returns the matching ')', skipping quoted text
+// and nested parentheses, or NULL if there is none
+const char* skip_substitution(const char* p) {
+  int depth = 1;
+  while (*p) {
+    if (*p == '\\' && p[1]) {
+      p += 2;
+      continue;
+    }
+    if (*p == '\'') {
+      p = strchr(p + 1, '\'');
+      if (!p)
+        return NULL;
+    }
+    else if (*p == '"') {
+      for (p++; *p && *p != '"'; p++) {
+        if (*p == '\\' && p[1])
+          p++;
+        else if (*p == '$' && p[1] == '(' && !(p = skip_substitution(p + 2)))
+          return NULL;
+      }
+      if (!*p)
+        return NULL;
+    }
+    else if (*p == '(') {
+      depth++;
+    }
+    else if (*p == ')' && --depth == 0) {
+      return p;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+// The command language. A command line is compiled once into a tree of
+// nodes. The lexer keeps every word as a list of parts (literal text,
+// variable references, command substitutions), so running a node again,
+// as loop bodies and functions do, only expands the parts and never
+// re-reads the source. All of a compiled line lives in one arena.
+struct arena {
+  char** blocks;
+  int nblocks, cap;
+  char* next;
+  size_t left;
+};
+
+#define ARENA_BLOCK 16384
+
+void* arena_alloc(struct arena* a, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (size > a->left) {
+    if (a->nblocks == a->cap) {
+      int cap = a->cap ? a->cap * 2 : 8;
+      char** grown = realloc(a->blocks, cap * sizeof(char*));
+      if (!grown)
+        return NULL;
+      a->blocks = grown;
+      a->cap = cap;
+    }
+    size_t block = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+    char* b = malloc(block);
+    if (!b)
+      return NULL;
+    a->blocks[a->nblocks++] = b;
+    a->next = b;
+    a->left = block;
+  }
+  void* p = a->next;
+  a->next += size;
+  a->left -= size;
+  memset(p, 0, size);
+  return p;
+}
+
+char* arena_strndup(struct arena* a, const char* s, size_t len) {
+  char* copy = arena_alloc(a, len + 1);
+  if (copy) {
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+void arena_free(struct arena* a) {
+  for (int i = 0; i < a->nblocks; i++)
+    free(a->blocks[i]);
+  free(a->blocks);
+  memset(a, 0, sizeof(*a));
+}
+
+enum { PART_TEXT, PART_VAR, PART_SUBST };
+
+struct word_part {
+  unsigned char kind;
+  bool quoted;         // inside double quotes
+  const char* text;    // PART_TEXT: literal with glob marks; PART_VAR: name
+  size_t len;
+  struct node* subst;  // PART_SUBST: the compiled command
+  struct word_part* next;
+};
+
+struct word {
+  struct word_part* parts;
+  const char* plain;   // the text when the word is unquoted literal text
+  bool quoted;         // some of it was quoted or escaped
+  struct word* next;
+};
+
+// A redirection as written: the operator, the descriptor it sets and the
+// word naming the file, descriptor, here-string or here-document delimiter
+struct redirect {
+  int kind;
+  int fd;
+  struct word* target;
+  struct redirect* next;
+};
+
+enum {
+  NODE_SIMPLE, NODE_PIPELINE, NODE_NOT, NODE_AND, NODE_OR, NODE_SEQ,
+  NODE_GROUP, NODE_IF, NODE_WHILE, NODE_UNTIL, NODE_FOR, NODE_FUNCTION
+};
+
+struct node {
+  int kind;
+  struct node* a;        // operand, condition, or body of a group/function
+  struct node* b;        // second operand, or the body of if/while/for
+  struct node* c;        // else branch
+  struct word* words;    // SIMPLE: the command; FOR: the values
+  int nwords;
+  int nassign;           // SIMPLE: leading NAME=value words
+  struct redirect* redirects; // SIMPLE: in the order written
+  int heredoc_base;      // SIMPLE: heredocs[] index of its first <<
+  bool has_list;         // FOR: "in" was given
+  const char* name;      // FOR: the variable; FUNCTION: the name
+  struct node** stages;  // PIPELINE
+  int nstages;
+};
+
+// A compiled command line. Functions defined by it keep a reference, as
+// their bodies live in its arena.
+struct program {
+  struct arena arena;
+  struct node* root;
+  int refs;
+};
+
+enum { TOK_WORD, TOK_REDIR, TOK_NEWLINE, TOK_SEMI, TOK_AND, TOK_OR, TOK_PIPE, TOK_LPAREN, TOK_RPAREN, TOK_END };
+
+struct parser {
+  const char* p;
+  struct arena* arena;
+  int tok;
+  struct word* word;     // TOK_WORD
+  int redir_kind;        // TOK_REDIR: the operator,
+  int redir_fd;          // the descriptor it sets
+  bool redir_strip;      // and for <<-, that tabs are stripped
+  const char* tok_start; // for error messages
+  int heredocs;
+  bool incomplete;       // input ended inside a construct
+  bool failed;
+};
+
+struct node* parse_program(struct parser* ps);
+
+// Reports a syntax error at the current token, unless the input merely
+// stopped early (the caller then asks for more lines)
+void parse_error(struct parser* ps) {
+  if (ps->failed)
+    return;
+  ps->failed = true;
+  if (ps->tok == TOK_END) {
+    ps->incomplete = true;
+    return;
+  }
+  const char* start = ps->tok_start;
+  size_t len = ps->p - start;
+  if (ps->tok == TOK_NEWLINE)
+    start = "newline", len = 7;
+  fprintf(stderr, "syntax error near unexpected token `%.*s'\n", (int)len, start);
+}
+
+void parse_oom(struct parser* ps) {
+  if (!ps->failed)
+    fprintf(stderr, "shell: %s\n", strerror(ENOMEM));
+  ps->failed = true;
+}
+
+bool is_name_char(char c, bool first) {
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+// Adds the literal text gathered so far to the word as a PART_TEXT
+bool flush_text(struct parser* ps, struct strbuf* text, bool* pending, struct word_part*** tail) {
+  if (!*pending)
+    return true;
+  struct word_part* part = arena_alloc(ps->arena, sizeof(*part));
+  if (!part || !(part->text = arena_strndup(ps->arena, text->data ? text->data : "", text->len)))
+    return false;
+  part->kind = PART_TEXT;
+  part->len = text->len;
+  **tail = part;
+  *tail = &part->next;
+  text->len = 0;
+  *pending = false;
+  return true;
+}
+
+// Lexes the $NAME, ${NAME}, special parameter or $(...) at ps->p into a
+// part. Returns NULL with ps->p unchanged when what follows the '$' isn't
+// an expansion, so the '$' is literal.
+struct word_part* lex_dollar(struct parser* ps, bool quoted) {
+  const char* p = ps->p + 1;
+  struct word_part* part;
+
+  if (*p == '(') {
+    const char* close = skip_substitution(p + 1);
+    if (!close) {
+      ps->incomplete = ps->failed = true;
+      return NULL;
+    }
+    struct parser inner = { .arena = ps->arena, .heredocs = ps->heredocs };
+    char* text = arena_strndup(ps->arena, p + 1, close - (p + 1));
+    part = arena_alloc(ps->arena, sizeof(*part));
+    if (!text || !part) {
+      parse_oom(ps);
+      return NULL;
+    }
+    inner.p = text;
+    part->kind = PART_SUBST;
+    part->quoted = quoted;
+    part->subst = parse_program(&inner);
+    ps->heredocs = inner.heredocs;
+    if (inner.failed) {
+      ps->failed = true;
+      return NULL;
+    }
+    ps->p = close + 1;
+    return part;
+  }
+
+  const char* name = p;
+  const char* end;
+  bool braced = *p == '{';
+  if (braced) {
+    name++;
+    end = strchr(name, '}');
+    if (!end || end == name)
+      return NULL;
+    bool special = end - name == 1 && strchr("?#@*$", *name);
+    bool digits = true;
+    for (const char* q = name; q < end; q++)
+      digits = digits && *q >= '0' && *q <= '9';
+    if (!special && !digits && !is_valid_name(name, end - name))
+      return NULL;
+  }
+  else if (*p && (strchr("?#@*$", *p) || (*p >= '0' && *p <= '9'))) {
+    end = p + 1;
+  }
+  else {
+    end = p;
+    while (is_name_char(*end, end == p))
+      end++;
+    if (end == p)
+      return NULL;
+  }
+
+  part = arena_alloc(ps->arena, sizeof(*part));
+  if (!part || !(part->text = arena_strndup(ps->arena, name, end - name))) {
+    parse_oom(ps);
+    return NULL;
+  }
+  part->kind = PART_VAR;
+  part->quoted = quoted;
+  part->len = end - name;
+  ps->p = braced ? end + 1 : end;
+  return part;
+}
+
+// Long command lines are mostly runs of ordinary bytes. The lexer copies
+// each run in one piece, finding its end with a vectorized scan: a block of
+// 16 or 32 bytes is classified at once and the first byte of the stop set
+// ends the run. The input is NUL-terminated rather than sized, so blocks
+// are loaded aligned (an aligned load can't cross into an unmapped page)
+// and '\0' is always in the set.
+struct byte_set {
+  bool member[256];
+  unsigned char bytes[16];
+  int n;
+  // c is a member when lo[c & 15] & hi[c >> 4]: each high nibble in the
+  // set gets its own bit, so at most 8 distinct high nibbles
+  unsigned char lo[16], hi[16];
+};
+
+void byte_set_init(struct byte_set* set, const char* chars, size_t n) {
+  memset(set, 0, sizeof(*set));
+  int bits = 0;
+  for (size_t i = 0; i <= n; i++) {
+    unsigned char c = i < n ? chars[i] : '\0';
+    if (set->member[c])
+      continue;
+    set->member[c] = true;
+    set->bytes[set->n++] = c;
+    if (!set->hi[c >> 4])
+      set->hi[c >> 4] = 1 << bits++;
+    set->lo[c & 15] |= set->hi[c >> 4];
+  }
+}
+
+size_t span_plain_scalar(const char* s, const struct byte_set* set) {
+  const unsigned char* p = (const unsigned char*)s;
+  while (!set->member[*p])
+    p++;
+  return p - (const unsigned char*)s;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+size_t span_plain_sse2(const char* s, const struct byte_set* set) {
+  size_t skip = (uintptr_t)s & 15;
+  const char* block = s - skip;
+  for (;;) {
+    __m128i v = _mm_load_si128((const __m128i*)block);
+    __m128i hit = _mm_setzero_si128();
+    for (int i = 0; i < set->n; i++)
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(set->bytes[i])));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hit) >> skip;
+    if (mask)
+      return block + skip - s + __builtin_ctz(mask);
+    block += 16;
+    skip = 0;
+  }
+}
+
+__attribute__((target("avx2")))
+size_t span_plain_avx2(const char* s, const struct byte_set* set) {
+  __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)set->lo));
+  __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)set->hi));
+  __m256i nibble = _mm256_set1_epi8(15);
+  size_t skip = (uintptr_t)s & 31;
+  const char* block = s - skip;
+  for (;;) {
+    __m256i v = _mm256_load_si256((const __m256i*)block);
+    __m256i vlo = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+    __m256i vhi = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(vlo, vhi), _mm256_setzero_si256());
+    uint64_t mask = (uint32_t)~_mm256_movemask_epi8(miss) >> skip;
+    if (mask)
+      return block + skip - s + __builtin_ctzll(mask);
+    block += 32;
+    skip = 0;
+  }
+}
+#endif
+
+size_t (*span_plain)(const char*, const struct byte_set*) = span_plain_scalar;
+
+// What ends a literal run unquoted, in single quotes and in double quotes.
+// Quoted glob characters are marked, so they end a run too.
+struct byte_set word_stops, squote_stops, dquote_stops;
+
+void lexer_init() {
+  byte_set_init(&word_stops, " \t\n;|()<>&\\'\"$", 14);
+  byte_set_init(&squote_stops, "'*?[", 4);
+  byte_set_init(&dquote_stops, "\"\\$*?[", 6);
+}
+
+// shell --selftest: runs each vectorized span_plain kernel this CPU has
+// against the scalar one over random strings at random alignments, with
+// random bytes left after the terminating NUL. Returns 0 if they agree.
+int selftest() {
+  struct { const char* name; size_t (*fn)(const char*, const struct byte_set*); } kernels[2];
+  int nkernels = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  kernels[nkernels].name = "sse2";
+  kernels[nkernels++].fn = span_plain_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[nkernels].name = "avx2";
+    kernels[nkernels++].fn = span_plain_avx2;
+  }
+#endif
+  const struct byte_set* sets[] = { &word_stops, &squote_stops, &dquote_stops };
+  const char* set_names[] = { "unquoted", "single-quoted", "double-quoted" };
+  const char specials[] = " \t\n;|()<>&\\'\"$*?[";
+
+  // Room for a string at any offset within 64 bytes, and for the aligned
+  // blocks the kernels read past its end
+  enum { BUFFER = 512, ROUNDS = 100000 };
+  char* buffer = aligned_alloc(64, BUFFER);
+  if (!buffer)
+    return 1;
+  srand(1);
+  int checks = 0, failures = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    // How often a stop byte shows up varies, so runs are long and short
+    int every = (int[]){ 0, 128, 16, 2 }[rand() % 4];
+    for (int i = 0; i < BUFFER; i++) {
+      if (every && rand() % every == 0)
+        buffer[i] = specials[rand() % (sizeof(specials) - 1)];
+      else if (rand() % 4 == 0)
+        buffer[i] = (char)(0x80 + rand() % 128);
+      else
+        buffer[i] = 'a' + rand() % 26;
+    }
+    char* text = buffer + rand() % 64;
+    text[rand() % (BUFFER - 64 - 64)] = '\0';
+
+    for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+      size_t want = span_plain_scalar(text, sets[s]);
+      for (int k = 0; k < nkernels; k++) {
+        size_t got = kernels[k].fn(text, sets[s]);
+        checks++;
+        if (got != want && failures++ < 10)
+          fprintf(stderr, "selftest: span_plain_%s on %s text at offset %d: %zu, scalar %zu\n",
+            kernels[k].name, set_names[s], (int)(text - buffer), got, want);
+      }
+    }
+  }
+  free(buffer);
+  printf("selftest: %d kernels, %d checks, %d failures\n", nkernels, checks, failures);
+  return failures > 0;
+}
+
+// Lexes the redirection operator at p. fd is the number written right
+// before it, or -1.
+void lex_redirect(struct parser* ps, const char* p, int fd) {
+  bool in = *p == '<';
+  int kind = in ? REDIR_IN : REDIR_OUT;
+  int len = 1;
+  ps->redir_strip = false;
+  if (in && p[1] == '<' && p[2] == '<') {
+    kind = REDIR_HERESTRING;
+    len = 3;
+  }
+  else if (in && p[1] == '<') {
+    kind = REDIR_HEREDOC;
+    ps->redir_strip = p[2] == '-';
+    len = ps->redir_strip ? 3 : 2;
+  }
+  else if (p[1] == '&') {
+    kind = REDIR_DUP;
+    len = 2;
+  }
+  else if (!in && (p[1] == '>' || p[1] == '|')) {
+    kind = p[1] == '>' ? REDIR_APPEND : REDIR_OUT;
+    len = 2;
+  }
+  ps->tok = TOK_REDIR;
+  ps->redir_kind = kind;
+  ps->redir_fd = fd >= 0 ? fd : !in;
+  ps->p = p + len;
+}
+
+// Lexes the inside of double quotes at ps->p, up to the closing '"'. In a
+// here-document body (heredoc) '"' is an ordinary character, cannot be
+// escaped, and the text runs to the end of the input.
+void lex_double_quoted(struct parser* ps, struct strbuf* text, bool* pending, struct word_part*** tail, bool heredoc) {
+  while ((heredoc || *ps->p != '"') && !ps->failed) {
+    size_t run = span_plain(ps->p, &dquote_stops);
+    if (run) {
+      strbuf_append(text, ps->p, run);
+      ps->p += run;
+      continue;
+    }
+    if (*ps->p == '\0') {
+      if (!heredoc)
+        ps->incomplete = ps->failed = true;
+      break;
+    }
+    if (*ps->p == '"') {
+      strbuf_putc(text, *ps->p++);
+      continue;
+    }
+    // A backslash ending the input leaves the quote open, like any
+    // other end of input inside it
+    if (*ps->p == '\\' && ps->p[1] && strchr(heredoc ? "\\$`\n" : "\"\\$`\n", ps->p[1])) {
+      if (ps->p[1] != '\n')
+        strbuf_putc(text, ps->p[1]);
+      ps->p += 2;
+      continue;
+    }
+    if (*ps->p == '$') {
+      const char* at = ps->p;
+      struct word_part* part = lex_dollar(ps, true);
+      if (part) {
+        if (!flush_text(ps, text, pending, tail)) {
+          parse_oom(ps);
+          break;
+        }
+        **tail = part;
+        *tail = &part->next;
+        *pending = true; // "$x" is a word even when $x is empty
+        continue;
+      }
+      if (ps->failed)
+        break;
+      ps->p = at;
+    }
+    put_quoted(text, *ps->p++);
+  }
+}
+
+// Reads the next token into ps->tok
+void next_token(struct parser* ps) {
+  const char* p = ps->p;
+  while (*p == ' ' || *p == '\t' || (*p == '\\' && p[1] == '\n'))
+    p += *p == '\\' ? 2 : 1;
+  if (*p == '#') {
+    while (*p && *p != '\n')
+      p++;
+  }
+
+  ps->tok_start = p;
+  ps->word = NULL;
+
+  // Redirection operators are only recognized here, unquoted, never in
+  // the text of a word. A number right before one is its descriptor.
+  const char* op = p;
+  while (*op >= '0' && *op <= '9')
+    op++;
+  if (*op == '<' || *op == '>') {
+    int fd = -1;
+    if (op > p)
+      fd = op - p > 3 ? 1000 : atoi(p);
+    lex_redirect(ps, op, fd);
+    return;
+  }
+
+  int len = 1;
+  switch (*p) {
+  case '\0': ps->tok = TOK_END; len = 0; break;
+  case '\n': ps->tok = TOK_NEWLINE; break;
+  case ';': ps->tok = TOK_SEMI; break;
+  case '(': ps->tok = TOK_LPAREN; break;
+  case ')': ps->tok = TOK_RPAREN; break;
+  case '|':
+    ps->tok = p[1] == '|' ? TOK_OR : TOK_PIPE;
+    len = p[1] == '|' ? 2 : 1;
+    break;
+  case '&':
+    if (p[1] == '&') {
+      ps->tok = TOK_AND;
+      len = 2;
+      break;
+    }
+    // A lone '&' is part of a word
+    [[fallthrough]];
+  default:
+    len = -1;
+  }
+  if (len >= 0) {
+    ps->p = p + len;
+    return;
+  }
+
+  // A word: literal runs are gathered in text, expansions become parts
+  struct word* word = arena_alloc(ps->arena, sizeof(*word));
+  if (!word) {
+    parse_oom(ps);
+    ps->tok = TOK_END;
+    return;
+  }
+  struct word_part** tail = &word->parts;
+  struct strbuf text = { 0 };
+  bool pending = false; // text holds something, or quotes were seen
+  bool plain = true;
+  ps->p = p;
+
+  while (!ps->failed) {
+    size_t run = span_plain(ps->p, &word_stops);
+    if (run) {
+      strbuf_append(&text, ps->p, run);
+      ps->p += run;
+      pending = true;
+      continue;
+    }
+
+    char c = *ps->p;
+    if (c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == ';' || c == '|' ||
+      c == '(' || c == ')' || c == '<' || c == '>' || (c == '&' && ps->p[1] == '&'))
+      break;
+
+    if (c == '\\') {
+      ps->p++;
+      plain = false;
+      word->quoted = true;
+      if (*ps->p == '\n') {
+        ps->p++;
+      }
+      else if (*ps->p) {
+        put_quoted(&text, *ps->p++);
+        pending = true;
+      }
+    }
+    else if (c == '\'') {
+      const char* close = strchr(ps->p + 1, '\'');
+      if (!close) {
+        ps->incomplete = ps->failed = true;
+        break;
+      }
+      for (const char* q = ps->p + 1; q < close;) {
+        size_t run = span_plain(q, &squote_stops);
+        strbuf_append(&text, q, run);
+        q += run;
+        if (q < close)
+          put_quoted(&text, *q++);
+      }
+      ps->p = close + 1;
+      pending = true;
+      plain = false;
+      word->quoted = true;
+    }
+    else if (c == '"') {
+      ps->p++;
+      pending = true;
+      plain = false;
+      word->quoted = true;
+      lex_double_quoted(ps, &text, &pending, &tail, false);
+      if (!ps->failed)
+        ps->p++;
+    }
+    else if (c == '$') {
+      struct word_part* part = lex_dollar(ps, false);
+      if (part) {
+        if (!flush_text(ps, &text, &pending, &tail)) {
+          parse_oom(ps);
+          break;
+        }
+        *tail = part;
+        tail = &part->next;
+        plain = false;
+        continue;
+      }
+      if (ps->failed)
+        break;
+      strbuf_putc(&text, *ps->p++);
+      pending = true;
+    }
+    else {
+      strbuf_putc(&text, *ps->p++);
+      pending = true;
+    }
+  }
+
+  if (!ps->failed && !flush_text(ps, &text, &pending, &tail))
+    parse_oom(ps);
+  free(text.data);
+  if (ps->failed) {
+    ps->tok = TOK_END;
+    return;
+  }
+  if (plain && word->parts)
+    word->plain = word->parts->text;
+  ps->tok = TOK_WORD;
+  ps->word = word;
+}
+
+bool at_keyword(struct parser* ps, const char* keyword) {
+  return ps->tok == TOK_WORD && ps->word->plain && strcmp(ps->word->plain, keyword) == 0;
+}
+
+// Words that end the list before them, so they can't start a command
+bool at_list_end(struct parser* ps) {
+  const char* ends[] = { "then", "elif", "else", "fi", "do", "done", "}", NULL };
+  if (ps->tok == TOK_END || ps->tok == TOK_RPAREN)
+    return true;
+  for (int i = 0; ends[i]; i++) {
+    if (at_keyword(ps, ends[i]))
+      return true;
+  }
+  return false;
+}
+
+void skip_newlines(struct parser* ps) {
+  while (ps->tok == TOK_NEWLINE)
+    next_token(ps);
+}
+
+bool expect_keyword(struct parser* ps, const char* keyword) {
+  if (!at_keyword(ps, keyword)) {
+    parse_error(ps);
+    return false;
+  }
+  next_token(ps);
+  return true;
+}
+
+struct node* new_node(struct parser* ps, int kind) {
+  struct node* n = arena_alloc(ps->arena, sizeof(*n));
+  if (!n) {
+    parse_oom(ps);
+    return NULL;
+  }
+  n->kind = kind;
+  return n;
+}
+
+struct node* parse_list(struct parser* ps);
+struct node* parse_command(struct parser* ps);
+
+// A list that must have at least one command, as in if/while/for bodies
+struct node* parse_body(struct parser* ps) {
+  struct node* body = parse_list(ps);
+  if (!body && !ps->failed)
+    parse_error(ps);
+  return body;
+}
+
+struct node* parse_if(struct parser* ps) {
+  struct node* n = new_node(ps, NODE_IF);
+  if (!n)
+    return NULL;
+  next_token(ps);
+  if (!(n->a = parse_body(ps)) || !expect_keyword(ps, "then") || !(n->b = parse_body(ps)))
+    return NULL;
+  if (at_keyword(ps, "elif")) {
+    n->c = parse_if(ps); // consumes the fi
+    return n->c ? n : NULL;
+  }
+  if (at_keyword(ps, "else")) {
+    next_token(ps);
+    if (!(n->c = parse_body(ps)))
+      return NULL;
+  }
+  return expect_keyword(ps, "fi") ? n : NULL;
+}
+
+struct node* parse_loop(struct parser* ps, int kind) {
+  struct node* n = new_node(ps, kind);
+  if (!n)
+    return NULL;
+  next_token(ps);
+
+  if (kind == NODE_FOR) {
+    if (ps->tok != TOK_WORD || !ps->word->plain || !is_valid_name(ps->word->plain, strlen(ps->word->plain))) {
+      parse_error(ps);
+      return NULL;
+    }
+    n->name = ps->word->plain;
+    next_token(ps);
+    skip_newlines(ps);
+    if (at_keyword(ps, "in")) {
+      n->has_list = true;
+      next_token(ps);
+      struct word** tail = &n->words;
+      while (ps->tok == TOK_WORD) {
+        *tail = ps->word;
+        tail = &ps->word->next;
+        n->nwords++;
+        next_token(ps);
+      }
+      if (ps->tok != TOK_SEMI && ps->tok != TOK_NEWLINE) {
+        parse_error(ps);
+        return NULL;
+      }
+      next_token(ps);
+    }
+    else if (ps->tok == TOK_SEMI) {
+      next_token(ps);
+    }
+    skip_newlines(ps);
+  }
+  else if (!(n->a = parse_body(ps))) {
+    return NULL;
+  }
+
+  if (!expect_keyword(ps, "do") || !(n->b = parse_body(ps)) || !expect_keyword(ps, "done"))
+    return NULL;
+  return n;
+}
+
+struct node* parse_group(struct parser* ps) {
+  struct node* n = new_node(ps, NODE_GROUP);
+  if (!n)
+    return NULL;
+  next_token(ps);
+  if (!(n->a = parse_body(ps)) || !expect_keyword(ps, "}"))
+    return NULL;
+  return n;
+}
+
+// The body of a function: any compound command
+struct node* parse_function_body(struct parser* ps, const char* name) {
+  skip_newlines(ps);
+  if (!at_keyword(ps, "{") && !at_keyword(ps, "if") && !at_keyword(ps, "while") &&
+    !at_keyword(ps, "until") && !at_keyword(ps, "for")) {
+    parse_error(ps);
+    return NULL;
+  }
+  struct node* n = new_node(ps, NODE_FUNCTION);
+  if (!n || !(n->a = parse_command(ps)))
+    return NULL;
+  n->name = name;
+  return n;
+}
+
+struct node* parse_command(struct parser* ps) {
+  if ((ps->tok != TOK_WORD && ps->tok != TOK_REDIR) || at_list_end(ps)) {
+    parse_error(ps);
+    return NULL;
+  }
+  if (at_keyword(ps, "if"))
+    return parse_if(ps);
+  if (at_keyword(ps, "while"))
+    return parse_loop(ps, NODE_WHILE);
+  if (at_keyword(ps, "until"))
+    return parse_loop(ps, NODE_UNTIL);
+  if (at_keyword(ps, "for"))
+    return parse_loop(ps, NODE_FOR);
+  if (at_keyword(ps, "{"))
+    return parse_group(ps);
+  if (at_keyword(ps, "function")) {
+    next_token(ps);
+    if (ps->tok != TOK_WORD || !ps->word->plain) {
+      parse_error(ps);
+      return NULL;
+    }
+    const char* name = ps->word->plain;
+    next_token(ps);
+    if (ps->tok == TOK_LPAREN) {
+      next_token(ps);
+      if (ps->tok != TOK_RPAREN) {
+        parse_error(ps);
+        return NULL;
+      }
+      next_token(ps);
+    }
+    return parse_function_body(ps, name);
+  }
+
+  struct node* n = new_node(ps, NODE_SIMPLE);
+  if (!n)
+    return NULL;
+  n->heredoc_base = ps->heredocs;
+  struct word** tail = &n->words;
+  struct redirect** redirect_tail = &n->redirects;
+  bool assigning = true;
+  while (ps->tok == TOK_WORD || ps->tok == TOK_REDIR) {
+    if (ps->tok == TOK_REDIR) {
+      struct redirect* r = arena_alloc(ps->arena, sizeof(*r));
+      if (!r) {
+        parse_oom(ps);
+        return NULL;
+      }
+      r->kind = ps->redir_kind;
+      r->fd = ps->redir_fd;
+      next_token(ps);
+      if (ps->tok != TOK_WORD) {
+        parse_error(ps);
+        return NULL;
+      }
+      r->target = ps->word;
+      *redirect_tail = r;
+      redirect_tail = &r->next;
+      if (r->kind == REDIR_HEREDOC)
+        ps->heredocs++;
+      next_token(ps);
+      continue;
+    }
+
+    struct word* w = ps->word;
+    *tail = w;
+    tail = &w->next;
+    n->nwords++;
+
+    // NAME=value words before the command name are assignments
+    const char* text = w->parts && w->parts->kind == PART_TEXT ? w->parts->text : "";
+    const char* eq = strchr(text, '=');
+    if (assigning && eq && is_valid_name(text, eq - text))
+      n->nassign++;
+    else
+      assigning = false;
+    next_token(ps);
+  }
+
+  // name() compound-command defines a function
+  if (ps->tok == TOK_LPAREN && n->nwords == 1 && n->words->plain && !n->redirects) {
+    next_token(ps);
+    if (ps->tok != TOK_RPAREN) {
+      parse_error(ps);
+      return NULL;
+    }
+    next_token(ps);
+    return parse_function_body(ps, n->words->plain);
+  }
+  return n;
+}
+
+struct node* parse_pipeline(struct parser* ps) {
+  bool negate = at_keyword(ps, "!");
+  if (negate)
+    next_token(ps);
+
+  struct node* stages[32];
+  int nstages = 0;
+  while (true) {
+    if (nstages == 32) {
+      fprintf(stderr, "Invalid pipeline\n");
+      ps->failed = true;
+      return NULL;
+    }
+    if (!(stages[nstages++] = parse_command(ps)))
+      return NULL;
+    if (ps->tok != TOK_PIPE)
+      break;
+    next_token(ps);
+    skip_newlines(ps);
+  }
+
+  struct node* n = stages[0];
+  if (nstages > 1) {
+    if (!(n = new_node(ps, NODE_PIPELINE)) || !(n->stages = arena_alloc(ps->arena, nstages * sizeof(struct node*))))
+      return NULL;
+    memcpy(n->stages, stages, nstages * sizeof(struct node*));
+    n->nstages = nstages;
+  }
+  if (negate) {
+    struct node* not = new_node(ps, NODE_NOT);
+    if (!not)
+      return NULL;
+    not->a = n;
+    n = not;
+  }
+  return n;
+}
+
+struct node* parse_and_or(struct parser* ps) {
+  struct node* left = parse_pipeline(ps);
+  while (left && (ps->tok == TOK_AND || ps->tok == TOK_OR)) {
+    struct node* n = new_node(ps, ps->tok == TOK_AND ? NODE_AND : NODE_OR);
+    if (!n)
+      return NULL;
+    next_token(ps);
+    skip_newlines(ps);
+    n->a = left;
+    if (!(n->b = parse_pipeline(ps)))
+      return NULL;
+    left = n;
+  }
+  return left;
+}
+
+// Commands separated by ';' or newlines, up to a word that closes the
+// enclosing construct. Returns NULL for an empty list.
+struct node* parse_list(struct parser* ps) {
+  struct node* list = NULL;
+  while (true) {
+    skip_newlines(ps);
+    if (ps->failed || at_list_end(ps))
+      break;
+    struct node* n = parse_and_or(ps);
+    if (!n)
+      return NULL;
+    if (list) {
+      struct node* seq = new_node(ps, NODE_SEQ);
+      if (!seq)
+        return NULL;
+      seq->a = list;
+      seq->b = n;
+      n = seq;
+    }
+    list = n;
+    if (ps->tok != TOK_SEMI && ps->tok != TOK_NEWLINE)
+      break;
+    next_token(ps);
+  }
+  return list;
+}
+
+struct node* parse_program(struct parser* ps) {
+  next_token(ps);
+  struct node* root = parse_list(ps);
+  if (!ps->failed && ps->tok != TOK_END)
+    parse_error(ps);
+  return ps->failed ? NULL : root;
+}
+
+// Compiles a command line. Returns NULL on a syntax error, which has been
+// reported, or when the line is incomplete, which *incomplete tells apart
+// so the caller can read more lines.
+struct program* compile_program(const char* text, bool* incomplete) {
+  struct program* prog = calloc(1, sizeof(*prog));
+  if (!prog) {
+    *incomplete = false;
+    return NULL;
+  }
+  struct parser ps = { .p = text, .arena = &prog->arena };
+  prog->root = parse_program(&ps);
+  *incomplete = ps.incomplete;
+  if (ps.failed) {
+    arena_free(&prog->arena);
+    free(prog);
+    return NULL;
+  }
+  prog->refs = 1;
+  return prog;
+}
+
+void program_release(struct program* prog) {
+  if (prog && --prog->refs == 0) {
+    arena_free(&prog->arena);
+    free(prog);
+  }
+}
+
+int run_node(struct node* node);
+
+// Set in forked subshells, which must not act as the interactive shell
+bool in_subshell = false;
+
+// Builtins that change the shell's own state, including control flow and
+// the history list. Inside $(...) that state must stay untouched, so they
+// run in a forked subshell.
+bool builtin_changes_shell(const char* name) {
+  return strcmp(name, "cd") == 0 || strcmp(name, "exit") == 0 || strcmp(name, "shopt") == 0 ||
+    strcmp(name, "export") == 0 || strcmp(name, "unset") == 0 || strcmp(name, "pushd") == 0 ||
+    strcmp(name, "popd") == 0 || strcmp(name, "dirs") == 0 || strcmp(name, "return") == 0 ||
+    strcmp(name, "break") == 0 || strcmp(name, "continue") == 0 || strcmp(name, "history") == 0;
+}
+
+// The words of a simple command after its NAME=value prefix
+struct word* command_words(struct node* node) {
+  struct word* w = node->words;
+  for (int i = 0; i < node->nassign; i++)
+    w = w->next;
+  return w;
+}
+
+void expand_command_words(struct word* words, int n, struct word_list* out);
+void expand_redirections(struct node* node, struct redirections* redir);
+
+// Runs a compiled $(...) and appends its standard output to out. A
+// builtin runs in-process and writes into a memfd, so there is no fork
+// and no pipe; an external command is spawned and read through a pipe;
+// anything else runs in a forked subshell.
+void command_substitution(struct node* cmd, struct strbuf* out) {
+  if (!cmd)
+    return;
+
+  struct word_list words = { 0 };
+  struct redirections redir = { 0 };
+  int argc = 0;
+  bool simple = false;
+  if (cmd->kind == NODE_SIMPLE) {
+    // Assignments alone would only change the subshell
+    if (cmd->nassign == cmd->nwords)
+      return;
+    expand_command_words(command_words(cmd), cmd->nwords - cmd->nassign, &words);
+    expand_redirections(cmd, &redir);
+    argc = words.count;
+    if (argc == 0) {
+      word_list_free(&words);
+      redirections_free(&redir);
+      return;
+    }
+    // A NAME=value prefix is set in the subshell
+    simple = !find_function(words.words[0]) && cmd->nassign == 0;
+  }
+  int fds[3];
+  int status = 0;
+
+  if (simple && is_builtin(words.words[0]) && !builtin_changes_shell(words.words[0])) {
+    int mem = memfd_create("substitution", MFD_CLOEXEC);
+    if (mem >= 0 && open_redirections(&redir, fds, (const int[3]){ 0, mem, 2 }) == 0) {
+      status = run_builtin(argc, words.words, fds[0] >= 0 ? fds[0] : 0, fds[1] >= 0 ? fds[1] : mem, fds[2] >= 0 ? fds[2] : 2);
+      close_redirections(fds);
+      lseek(mem, 0, SEEK_SET);
+      strbuf_read_fd(out, mem);
+    }
+    if (mem >= 0)
+      close(mem);
+  }
+  else {
+    int p[2];
+    pid_t pid = -1;
+    if (pipe2(p, O_CLOEXEC) != 0) {
+      perror("pipe");
+      word_list_free(&words);
+      redirections_free(&redir);
+      return;
+    }
+    if (simple && !is_builtin(words.words[0])) {
+      if (open_redirections(&redir, fds, (const int[3]){ 0, p[1], 2 }) == 0) {
+        bool to_pipe = fds[1] < 0;
+        if (to_pipe)
+          fds[1] = p[1];
+        char* exe = find_executable(words.words[0]);
+        if (!exe) {
+          dprintf(fds[2] >= 0 ? fds[2] : 2, "%s: command not found\n", words.words[0]);
+          status = 127;
+        }
+        else {
+          pid = spawn_command(exe, words.words, fds);
+          free(exe);
+        }
+        if (to_pipe)
+          fds[1] = -1;
+        close_redirections(fds);
+      }
+    }
+    else {
+      // The child shares everything copy-on-write and only writes to the
+      // pipe; its changes to variables or the directory stay in it
+      pid = fork();
+      if (pid == 0) {
+        in_subshell = true;
+        events_after_fork();
+        dup2(p[1], STDOUT_FILENO);
+        _exit(run_node(cmd));
+      }
+    }
+    close(p[1]);
+    strbuf_read_fd(out, p[0]);
+    close(p[0]);
+    if (pid > 0)
+      status = wait_for_child(pid);
+  }
+  last_substitution_status = status;
+  word_list_free(&words);
+  redirections_free(&redir);
+}
+
+// Ends the word being built, if any, and moves it into out
+void finish_word(struct strbuf* word, bool* in_word, struct word_list* out) {
+  if (!*in_word)
+    return;
+  char* s = word->data ? word->data : strdup("");
+  memset(word, 0, sizeof(*word));
+  *in_word = false;
+  if (s && word_list_own(out, s))
+    word_list_add(out, s);
+}
+
+// Appends the text of an expansion to the word being built. Unquoted, the
+// text is split into words at whitespace and glob characters in it stay
+// live; quoted, it becomes part of the word as it is.
+void append_expansion(const char* text, size_t len, bool quoted,
+  struct strbuf* word, bool* in_word, struct word_list* out) {
+  if (quoted)
+    *in_word = true;
+  for (size_t i = 0; i < len; i++) {
+    char c = text[i];
+    if (quoted) {
+      put_quoted(word, c);
+    }
+    else if (c == ' ' || c == '\t' || c == '\n') {
+      finish_word(word, in_word, out);
+    }
+    else {
+      strbuf_putc(word, c);
+      *in_word = true;
+    }
+  }
+}
+
+// Appends the value of a variable or special parameter to the word being
+// built. "$@" gives one word per positional parameter.
+void append_variable(const char* name, size_t len, bool quoted,
+  struct strbuf* word, bool* in_word, struct word_list* out) {
+  char number[32];
+  const char* value = NULL;
+
+  if (len == 1 && (*name == '@' || *name == '*')) {
+    for (int i = 0; i < npositional; i++) {
+      if (i > 0 && quoted && *name == '@')
+        finish_word(word, in_word, out);
+      else if (i > 0)
+        append_expansion(" ", 1, quoted, word, in_word, out);
+      append_expansion(positional[i], strlen(positional[i]), quoted, word, in_word, out);
+    }
+    if (quoted && *name == '*')
+      *in_word = true;
+    return;
+  }
+
+  if (len == 1 && *name == '?') {
+    snprintf(number, sizeof(number), "%d", last_status);
+    value = number;
+  }
+  else if (len == 1 && *name == '#') {
+    snprintf(number, sizeof(number), "%d", npositional);
+    value = number;
+  }
+  else if (len == 1 && *name == '$') {
+    snprintf(number, sizeof(number), "%d", (int)getpid());
+    value = number;
+  }
+  else if (*name >= '0' && *name <= '9') {
+    long n = strtol(name, NULL, 10);
+    value = n == 0 ? shell_name : n <= npositional ? positional[n - 1] : NULL;
+  }
+  else {
+    value = var_get_n(name, len);
+  }
+
+  if (value)
+    append_expansion(value, strlen(value), quoted, word, in_word, out);
+  else if (quoted)
+    *in_word = true;
+}
+
+// Expands the parts of one word into out: variables, command
+// substitutions and word splitting. Glob characters stay marked for
+// expand_words(). With as_one set (assignments), nothing is split.
+void expand_word(struct word* w, bool as_one, struct word_list* out) {
+  struct strbuf word = { 0 };
+  bool in_word = false;
+
+  for (struct word_part* part = w->parts; part; part = part->next) {
+    bool quoted = part->quoted || as_one;
+    if (part->kind == PART_TEXT) {
+      strbuf_append(&word, part->text, part->len);
+      in_word = true;
+    }
+    else if (part->kind == PART_VAR) {
+      append_variable(part->text, part->len, quoted, &word, &in_word, out);
+    }
+    else {
+      struct strbuf result = { 0 };
+      command_substitution(part->subst, &result);
+      while (result.len > 0 && result.data[result.len - 1] == '\n')
+        result.len--;
+      append_expansion(result.data, result.len, quoted, &word, &in_word, out);
+      free(result.data);
+    }
+  }
+  finish_word(&word, &in_word, out);
+  free(word.data);
+}
+
+// Expands compiled words into the arguments of a command, including
+// pathname expansion
+void expand_command_words(struct word* words, int n, struct word_list* out) {
+  struct word_list tokens = { 0 };
+  for (struct word* w = words; w && n-- > 0; w = w->next)
+    expand_word(w, false, &tokens);
+  expand_words(&tokens, out);
+}
+
+// Expands a word into one string, without field splitting or pathname
+// expansion, as for assignments and here-strings. NULL if it gives nothing.
+char* expand_word_string(struct word* w) {
+  struct word_list value = { 0 };
+  struct strbuf text = { 0 };
+  expand_word(w, true, &value);
+  for (int i = 0; i < value.count; i++) {
+    if (i > 0)
+      strbuf_putc(&text, ' ');
+    strbuf_append(&text, value.words[i], strlen(value.words[i]));
+  }
+  word_list_free(&value);
+  if (text.data)
+    strip_glob_quotes(text.data);
+  return text.data;
+}
+
+// Expands a here-document body as if it were between double quotes, except
+// that '"' is an ordinary character. NULL if a $(...) in it is malformed.
+char* expand_heredoc(const char* body) {
+  struct arena arena = { 0 };
+  struct parser ps = { .p = body, .arena = &arena };
+  struct word word = { 0 };
+  struct word_part** tail = &word.parts;
+  struct strbuf text = { 0 };
+  bool pending = true;
+  lex_double_quoted(&ps, &text, &pending, &tail, true);
+  if (!ps.failed && !flush_text(&ps, &text, &pending, &tail))
+    parse_oom(&ps);
+  free(text.data);
+
+  char* result = NULL;
+  if (!ps.failed) {
+    result = expand_word_string(&word);
+    if (!result)
+      result = strdup("");
+  }
+  else if (ps.incomplete) {
+    fprintf(stderr, "here-document: unterminated $(\n");
+  }
+  arena_free(&arena);
+  return result;
+}
+
+// Expands the targets of a command's redirections. A file name has to
+// expand to exactly one word. Here-documents take their bodies from
+// heredocs[] in order, starting at the command's first.
+void expand_redirections(struct node* node, struct redirections* redir) {
+  memset(redir, 0, sizeof(*redir));
+  int heredoc = node->heredoc_base;
+  for (struct redirect* r = node->redirects; r; r = r->next) {
+    if (redir->count == MAX_REDIRECTIONS) {
+      fprintf(stderr, "too many redirections\n");
+      redir->failed = true;
+      return;
+    }
+    struct redirection* item = &redir->items[redir->count++];
+    item->kind = r->kind;
+    item->fd = r->fd;
+
+    if (r->kind == REDIR_HEREDOC) {
+      item->data = heredoc < heredoc_count && heredocs[heredoc].body ? heredocs[heredoc].body : "";
+      item->len = heredoc < heredoc_count ? heredocs[heredoc].len : 0;
+      heredoc++;
+      // With the delimiter unquoted, the body is expanded
+      if (r->target->quoted)
+        continue;
+      if (!(item->target = expand_heredoc(item->data))) {
+        redir->failed = true;
+        return;
+      }
+      item->data = item->target;
+      item->len = strlen(item->target);
+      continue;
+    }
+    if (r->kind == REDIR_HERESTRING) {
+      item->target = expand_word_string(r->target);
+      if (!item->target)
+        item->target = strdup("");
+    }
+    else {
+      struct word_list words;
+      expand_command_words(r->target, 1, &words);
+      if (words.count == 1)
+        item->target = strdup(words.words[0]);
+      else
+        fprintf(stderr, "ambiguous redirect\n");
+      word_list_free(&words);
+    }
+    if (!item->target) {
+      redir->failed = true;
+      return;
+    }
+  }
+}
+
+// Scans a command line for << operators and records their delimiters so
+// the body lines typed next can be collected. Returns how many were found.
+int find_heredoc_delimiters(const char* line, char delims[][256], bool strip_tabs[], int max)
+{
+  struct arena arena = { 0 };
+  struct parser ps = { .p = line, .arena = &arena };
+  struct strbuf text = { 0 };
+
+  int found = 0;
+  for (next_token(&ps); ps.tok != TOK_END && found < max; next_token(&ps)) {
+    if (ps.tok != TOK_REDIR || ps.redir_kind != REDIR_HEREDOC)
+      continue;
+    bool strip = ps.redir_strip;
+    next_token(&ps);
+    if (ps.tok != TOK_WORD)
+      break;
+    struct word* delim = ps.word;
+
+    // The delimiter is taken literally, so $ in it stays as typed
+    text.len = 0;
+    for (struct word_part* part = delim->parts; part; part = part->next) {
+      if (part->kind == PART_TEXT) {
+        strbuf_append(&text, part->text, part->len);
+      }
+      else if (part->kind == PART_VAR) {
+        strbuf_putc(&text, '$');
+        strbuf_append(&text, part->text, part->len);
+      }
+    }
+    strip_glob_quotes(text.data ? text.data : "");
+    snprintf(delims[found], 256, "%s", text.data ? text.data : "");
+    strip_tabs[found] = strip;
+    found++;
+  }
+  free(text.data);
+  arena_free(&arena);
+  return found;
+}
+
+// Runs fn with args as its positional parameters
+int call_function(struct shell_function* fn, int argc, char** argv) {
+  char** saved_positional = positional;
+  int saved_npositional = npositional;
+  int saved_loop_depth = loop_depth;
+  struct program* saved_program = running_program;
+  struct program* prog = fn->program;
+  struct node* body = fn->body;
+
+  // The function may redefine itself while running, so hold its program
+  prog->refs++;
+  positional = argv + 1;
+  npositional = argc - 1;
+  loop_depth = 0;
+  running_program = prog;
+  function_depth++;
+
+  int status = run_node(body);
+
+  function_depth--;
+  returning = false;
+  running_program = saved_program;
+  loop_depth = saved_loop_depth;
+  positional = saved_positional;
+  npositional = saved_npositional;
+  program_release(prog);
+  return status;
+}
+
+void define_function(struct node* node) {
+  struct shell_function* fn = find_function(node->name);
+  if (!fn) {
+    if (nfunctions == functions_cap) {
+      int cap = functions_cap ? functions_cap * 2 : 16;
+      struct shell_function* grown = realloc(functions, cap * sizeof(*grown));
+      if (!grown) {
+        fprintf(stderr, "%s: %s\n", node->name, strerror(ENOMEM));
+        return;
+      }
+      functions = grown;
+      functions_cap = cap;
+    }
+    fn = &functions[nfunctions++];
+  }
+  else {
+    program_release(fn->program);
+  }
+  fn->name = node->name;
+  fn->body = node->a;
+  fn->program = running_program;
+  running_program->refs++;
+}
+
+// Runs a function call with redirections. The body's commands write to
+// the shell's own descriptors, so those are swapped for the duration.
+int call_function_redirected(struct shell_function* fn, int argc, char** argv, const int fds[3]) {
+  int saved[3] = { -1, -1, -1 };
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] < 0)
+      continue;
+    saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    dup2(fds[i], i);
+  }
+  int status = call_function(fn, argc, argv);
+  for (int i = 0; i < 3; i++) {
+    if (saved[i] >= 0) {
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+  return status;
+}
+
+// What a variable held before a NAME=value word in front of a command
+// replaced it
+struct saved_var {
+  char* name;
+  char* entry;
+  bool exported;
+};
+
+// Sets the n NAME=value words in front of a command for as long as it
+// runs, exported so that a program it starts sees them too. Returns what
+// vars_restore() needs to put the old values back.
+struct saved_var* vars_assign_temporary(struct word* w, int n) {
+  struct saved_var* saved = n > 0 ? calloc(n, sizeof(*saved)) : NULL;
+  for (int i = 0; i < n && saved; i++, w = w->next) {
+    char* text = expand_word_string(w);
+    if (!text)
+      continue;
+    size_t len = strchr(text, '=') - text;
+    struct shell_var* v = var_lookup_or_add(text, len);
+    if (v && (saved[i].name = strndup(text, len))) {
+      saved[i].entry = v->entry;
+      saved[i].exported = v->exported;
+      v->entry = NULL;
+      if (!var_set(text, len, text + len + 1))
+        dprintf(2, "%.*s: %s\n", (int)len, text, strerror(ENOMEM));
+      // Adding the entry may have moved the table
+      if ((v = var_find(text, len)))
+        var_export(v);
+    }
+    free(text);
+  }
+  return saved;
+}
+
+void vars_restore(struct saved_var* saved, int n) {
+  if (!saved)
+    return;
+  // Backwards, so a name given twice gets its oldest value back
+  for (int i = n - 1; i >= 0; i--) {
+    if (!saved[i].name)
+      continue;
+    struct shell_var* v = var_find(saved[i].name, strlen(saved[i].name));
+    if (v) {
+      free(v->entry);
+      v->entry = saved[i].entry;
+      v->exported = saved[i].exported;
+      v->generation = ++var_generation_counter;
+      env_generation++;
+    }
+    else {
+      free(saved[i].entry);
+    }
+    free(saved[i].name);
+  }
+  free(saved);
+}
+
+// Runs an expanded command: a function, a builtin or an external program
+int run_command_argv(int argc, char** argv, const int fds[3]) {
+  struct shell_function* fn = find_function(argv[0]);
+  if (fn)
+    return call_function_redirected(fn, argc, argv, fds);
+  if (is_builtin(argv[0]))
+    return run_builtin(argc, argv, fds[0] >= 0 ? fds[0] : 0, fds[1] >= 0 ? fds[1] : 1, fds[2] >= 0 ? fds[2] : 2);
+  return execute_external(argv, fds);
+}
+
+// Runs one simple command: assignments, a function, a builtin or an
+// external program
+int run_simple(struct node* node) {
+  // A command made only of NAME=value words sets shell variables. The
+  // values aren't split or glob-expanded.
+  if (node->nassign == node->nwords) {
+    last_substitution_status = 0;
+    for (struct word* w = node->words; w; w = w->next) {
+      char* text = expand_word_string(w);
+      if (!text)
+        continue;
+      size_t len = strchr(text, '=') - text;
+      if (!var_set(text, len, text + len + 1))
+        dprintf(2, "%.*s: %s\n", (int)len, text, strerror(ENOMEM));
+      free(text);
+    }
+    // Redirections without a command still create or truncate files
+    if (node->redirects) {
+      struct redirections redir;
+      int fds[3];
+      expand_redirections(node, &redir);
+      int opened = open_redirections(&redir, fds, (const int[3]){ 0, 1, 2 });
+      close_redirections(fds);
+      redirections_free(&redir);
+      if (opened != 0)
+        return 1;
+    }
+    return last_substitution_status;
+  }
+
+  struct word_list words;
+  expand_command_words(command_words(node), node->nwords - node->nassign, &words);
+  char** argvv = words.words;
+  int argc = words.count;
+  if (argc == 0) {
+    word_list_free(&words);
+    return 0;
+  }
+  struct redirections redir;
+  expand_redirections(node, &redir);
+
+  // EXIT COMMAND
+  if (argc <= 2 && strcmp(argvv[0], "exit") == 0) {
+    int status = last_status;
+    if (argc == 2) {
+      char* end;
+      status = strtol(argvv[1], &end, 10) & 255;
+      if (!argvv[1][0] || *end) {
+        dprintf(2, "exit: %s: numeric argument required\n", argvv[1]);
+        status = 2;
+      }
+    }
+    exit(status);
+  }
+
+  int status = 1;
+  int fds[3];
+  if (open_redirections(&redir, fds, (const int[3]){ 0, 1, 2 }) == 0) {
+    struct saved_var* saved = vars_assign_temporary(node->words, node->nassign);
+    status = run_command_argv(argc, argvv, fds);
+    vars_restore(saved, node->nassign);
+    close_redirections(fds);
+  }
+  redirections_free(&redir);
+  word_list_free(&words);
+  return status;
+}
+
+// A builtin pipeline stage running on its own thread, so that it can't
+// stall the shell on a full pipe while the stages reading it aren't
+// started yet. The thread owns fds and closes them when the builtin returns.
+struct builtin_stage {
+  int argc;
+  char** argv;
+  int fds[3];
+  pthread_t thread;
+  bool started;
+};
+
+void* builtin_stage_thread(void* arg) {
+  struct builtin_stage* stage = arg;
+  int* fds = stage->fds;
+  run_builtin(stage->argc, stage->argv, fds[0] >= 0 ? fds[0] : 0, fds[1] >= 0 ? fds[1] : 1, fds[2] >= 0 ? fds[2] : 2);
+  close_redirections(fds);
+  return NULL;
+}
+
+// With shopt pipestats, every pipe between two stages becomes two pipes
+// joined by a relay thread that splices from one to the other and records
+// what went through: the bytes, how long the writer was held up because
+// the reader wasn't draining (writer blocked) and how long the reader had
+// nothing to read (reader starved).
+struct pipe_edge {
+  int in;  // read end of the pipe the upstream stage writes
+  int out; // write end of the pipe the downstream stage reads
+  unsigned long long bytes;
+  long long writer_blocked_ns;
+  long long reader_starved_ns;
+  pthread_t thread;
+  bool started;
+};
+
+long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void* pipe_edge_relay(void* arg) {
+  struct pipe_edge* edge = arg;
+  while (true) {
+    ssize_t n = splice(edge->in, NULL, edge->out, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      edge->bytes += n;
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+      break;
+
+    // Nothing to read means the reader is starved; otherwise the data is
+    // there and the downstream pipe is full, so the writer is blocked
+    struct pollfd in = { edge->in, POLLIN, 0 };
+    struct pollfd out = { edge->out, POLLOUT, 0 };
+    bool starved = poll(&in, 1, 0) == 0;
+    long long start = monotonic_ns();
+    if (poll(starved ? &in : &out, 1, -1) < 0 && errno != EINTR)
+      break;
+    if (starved)
+      edge->reader_starved_ns += monotonic_ns() - start;
+    else
+      edge->writer_blocked_ns += monotonic_ns() - start;
+    if (out.revents & POLLERR)
+      break; // reader went away
+  }
+  close(edge->in);
+  close(edge->out);
+  return NULL;
+}
+
+// Applies shopt pipesize to a new pipe. The kernel rounds the size up to
+// a power-of-two number of pages; unprivileged users are capped at
+// /proc/sys/fs/pipe-max-size.
+void set_pipe_size(int fd) {
+  if (opt_pipesize > 0 && fcntl(fd, F_SETPIPE_SZ, (int)opt_pipesize) < 0) {
+    fprintf(stderr, "pipe: cannot set size to %ld: %s\n", opt_pipesize, strerror(errno));
+    opt_pipesize = 0;
+  }
+}
+
+// What pipestats calls a stage that isn't a simple command
+const char* node_label(struct node* node) {
+  switch (node->kind) {
+  case NODE_IF: return "if";
+  case NODE_WHILE: return "while";
+  case NODE_UNTIL: return "until";
+  case NODE_FOR: return "for";
+  default: return "{";
+  }
+}
+
+// Runs the stages of a pipeline connected by pipes. Each stage may carry
+// its own redirections, which take precedence over the pipe on the same
+// descriptor. Compound commands and function calls run in a forked
+// subshell. Returns the status of the last stage.
+int run_pipeline(struct node* node) {
+  int num_commands = node->nstages;
+  char** argv[32];
+  int argc[32];
+  struct word_list words[32];
+  int is_builtin_cmd[32];
+  bool in_child[32];
+  struct redirections redirs[32];
+
+  for (int i = 0; i < num_commands; i++) {
+    struct node* stage = node->stages[i];
+    memset(&words[i], 0, sizeof(words[i]));
+    memset(&redirs[i], 0, sizeof(redirs[i]));
+    argv[i] = NULL;
+    argc[i] = 0;
+    is_builtin_cmd[i] = 0;
+    in_child[i] = stage->kind != NODE_SIMPLE || stage->nassign == stage->nwords;
+    if (in_child[i])
+      continue;
+
+    expand_command_words(command_words(stage), stage->nwords - stage->nassign, &words[i]);
+    argv[i] = words[i].words;
+    argc[i] = words[i].count;
+    expand_redirections(stage, &redirs[i]);
+
+    if (argc[i] == 0) {
+      fprintf(stderr, "Invalid pipeline\n");
+      for (int j = 0; j <= i; j++) {
+        word_list_free(&words[j]);
+        redirections_free(&redirs[j]);
+      }
+      return 2;
+    }
+
+    // Stage threads can't change variables, so a stage with a NAME=value
+    // prefix gets its own process too
+    in_child[i] = find_function(argv[i][0]) != NULL || stage->nassign > 0;
+    is_builtin_cmd[i] = !in_child[i] && is_builtin(argv[i][0]);
+  }
+
+  int pipes[32][2];
+  struct pipe_edge edges[32];
+  for (int i = 0; i < num_commands - 1; i++) {
+    edges[i].started = false;
+    if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+      perror("pipe");
+      for (int j = 0; j < i; j++) {
+        close(pipes[j][0]);
+        close(pipes[j][1]);
+      }
+      for (int j = 0; j < num_commands; j++) {
+        word_list_free(&words[j]);
+        redirections_free(&redirs[j]);
+      }
+      return 1;
+    }
+    set_pipe_size(pipes[i][1]);
+
+    // The relay takes over the read end; the downstream stage reads from
+    // the second pipe instead
+    int relay[2];
+    if (opt_pipestats && pipe2(relay, O_CLOEXEC) == 0) {
+      set_pipe_size(relay[1]);
+      edges[i] = (struct pipe_edge){ .in = pipes[i][0], .out = relay[1] };
+      if (pthread_create(&edges[i].thread, NULL, pipe_edge_relay, &edges[i]) == 0) {
+        edges[i].started = true;
+        pipes[i][0] = relay[0];
+      }
+      else {
+        close(relay[0]);
+        close(relay[1]);
+      }
+    }
+  }
+
+  pid_t pids[32];
+  struct builtin_stage stages[32];
+
+  // Stage threads read variables and the PATH cache, so nothing may change
+  // them until every stage is done; building the cache now means they only
+  // ever read it
+  int ndirs;
+  path_dirs(&ndirs);
+  vars_frozen = true;
+
+  int status = 0;
+  for (int i = 0; i < num_commands; i++) {
+    pids[i] = -1;
+    stages[i].started = false;
+
+    int fds[3];
+    const int defaults[3] = { i > 0 ? pipes[i - 1][0] : 0, i < num_commands - 1 ? pipes[i][1] : 1, 2 };
+    if (open_redirections(&redirs[i], fds, defaults) == 0) {
+      if (fds[0] < 0 && i > 0)
+        fds[0] = dup_pipe_end(pipes[i - 1][0]);
+      if (fds[1] < 0 && i < num_commands - 1)
+        fds[1] = dup_pipe_end(pipes[i][1]);
+
+      // The last stage has nobody downstream to wait for, so a builtin
+      // there runs on the shell's own thread. Variables are still frozen
+      // then: cd only checks its target and exit does nothing.
+      if (in_child[i]) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+          in_subshell = true;
+          events_after_fork();
+          vars_frozen = false;
+          for (int fd = 0; fd < 3; fd++) {
+            if (fds[fd] >= 0)
+              dup2(fds[fd], fd);
+          }
+          // Builtin stages running on threads hold pipe ends; this copy
+          // of them would keep the readers from ever seeing EOF
+          for (int j = 0; j < i; j++) {
+            for (int fd = 0; fd < 3 && stages[j].started; fd++) {
+              if (stages[j].fds[fd] > 2)
+                close(stages[j].fds[fd]);
+            }
+          }
+          if (!argv[i])
+            _exit(run_node(node->stages[i]));
+          vars_assign_temporary(node->stages[i]->words, node->stages[i]->nassign);
+          _exit(run_command_argv(argc[i], argv[i], (const int[3]){ -1, -1, -1 }));
+        }
+        if (pids[i] < 0) {
+          perror("fork");
+          if (i == num_commands - 1)
+            status = 1;
+        }
+      }
+      else if (is_builtin_cmd[i] && i < num_commands - 1) {
+        struct builtin_stage* stage = &stages[i];
+        stage->argc = argc[i];
+        stage->argv = argv[i];
+        memcpy(stage->fds, fds, sizeof(stage->fds));
+        if (pthread_create(&stage->thread, NULL, builtin_stage_thread, stage) == 0) {
+          stage->started = true;
+          fds[0] = fds[1] = fds[2] = -1;
+        }
+        else {
+          run_builtin(argc[i], argv[i], fds[0] >= 0 ? fds[0] : 0, fds[1] >= 0 ? fds[1] : 1, fds[2] >= 0 ? fds[2] : 2);
+        }
+      }
+      else if (is_builtin_cmd[i]) {
+        status = run_builtin(argc[i], argv[i], fds[0] >= 0 ? fds[0] : 0, fds[1] >= 0 ? fds[1] : 1, fds[2] >= 0 ? fds[2] : 2);
+      }
+      else {
+        char* exe = find_executable(argv[i][0]);
+        if (!exe) {
+          dprintf(fds[2] >= 0 ? fds[2] : 2, "%s: command not found\n", argv[i][0]);
+          status = 127;
+        }
+        else {
+          pids[i] = spawn_command(exe, argv[i], fds);
+          free(exe);
+          if (pids[i] < 0 && i == num_commands - 1)
+            status = 126;
+        }
+      }
+      close_redirections(fds);
+    }
+    else if (i == num_commands - 1) {
+      status = 1;
+    }
+
+    // Drop the shell's copies of this stage's pipe ends so the readers
+    // downstream see EOF once the writers are done
+    if (i > 0) {
+      close(pipes[i - 1][0]);
+    }
+    if (i < num_commands - 1) {
+      close(pipes[i][1]);
+    }
+  }
+
+  for (int i = 0; i < num_commands; i++) {
+    if (pids[i] > 0) {
+      int child_status = wait_for_child(pids[i]);
+      if (i == num_commands - 1)
+        status = child_status;
+    }
+    if (stages[i].started) {
+      pthread_join(stages[i].thread, NULL);
+    }
+  }
+  vars_frozen = false;
+
+  for (int i = 0; i < num_commands - 1; i++) {
+    if (!edges[i].started)
+      continue;
+    pthread_join(edges[i].thread, NULL);
+    fprintf(stderr, "pipestats: %s | %s: %llu bytes, writer blocked %.1f ms, reader starved %.1f ms\n",
+      argv[i] ? argv[i][0] : node_label(node->stages[i]),
+      argv[i + 1] ? argv[i + 1][0] : node_label(node->stages[i + 1]), edges[i].bytes,
+      edges[i].writer_blocked_ns / 1e6, edges[i].reader_starved_ns / 1e6);
+  }
+
+  for (int i = 0; i < num_commands; i++) {
+    word_list_free(&words[i]);
+    redirections_free(&redirs[i]);
+  }
+  return status;
+}
+
+// After a loop's condition or body has run, consumes a break or continue
+// aimed at this loop. Returns true when the loop has to end.
+bool loop_should_stop() {
+  // A loop of builtins never waits in the event loop, so look for Ctrl-C here
+  signals_dispatch();
+  if (got_sigint || returning)
+    return true;
+  if (break_count > 0) {
+    break_count--;
+    return true;
+  }
+  if (continue_count > 0)
+    return --continue_count > 0;
+  return false;
+}
+
+bool flow_interrupted() {
+  return got_sigint || returning || break_count > 0 || continue_count > 0;
+}
+
+int run_while(struct node* node) {
+  int status = 0;
+  loop_depth++;
+  while (true) {
+    int cond = run_node(node->a);
+    if (loop_should_stop() || (cond == 0) == (node->kind == NODE_UNTIL))
+      break;
+    status = run_node(node->b);
+    if (loop_should_stop())
+      break;
+  }
+  loop_depth--;
+  return status;
+}
+
+int run_for(struct node* node) {
+  struct word_list values = { 0 };
+  if (node->has_list)
+    expand_command_words(node->words, node->nwords, &values);
+  else
+    for (int i = 0; i < npositional; i++)
+      word_list_add(&values, positional[i]);
+
+  int status = 0;
+  loop_depth++;
+  for (int i = 0; i < values.count; i++) {
+    var_set(node->name, strlen(node->name), values.words[i]);
+    status = run_node(node->b);
+    if (loop_should_stop())
+      break;
+  }
+  loop_depth--;
+  word_list_free(&values);
+  return status;
+}
+
+// Runs a compiled node and records its status in $?
+int run_node(struct node* node) {
+  if (!node)
+    return 0;
+
+  int status = 0;
+  switch (node->kind) {
+  case NODE_SIMPLE:
+    status = run_simple(node);
+    break;
+  case NODE_PIPELINE:
+    status = run_pipeline(node);
+    break;
+  case NODE_NOT:
+    status = run_node(node->a) == 0;
+    break;
+  case NODE_AND:
+  case NODE_OR:
+    status = run_node(node->a);
+    if ((status == 0) == (node->kind == NODE_AND) && !flow_interrupted())
+      status = run_node(node->b);
+    break;
+  case NODE_SEQ:
+    status = run_node(node->a);
+    if (!flow_interrupted())
+      status = run_node(node->b);
+    break;
+  case NODE_GROUP:
+    status = run_node(node->a);
+    break;
+  case NODE_IF:
+    status = run_node(node->a);
+    if (flow_interrupted())
+      break;
+    if (status == 0)
+      status = run_node(node->b);
+    else
+      status = node->c ? run_node(node->c) : 0;
+    break;
+  case NODE_WHILE:
+  case NODE_UNTIL:
+    status = run_while(node);
+    break;
+  case NODE_FOR:
+    status = run_for(node);
+    break;
+  case NODE_FUNCTION:
+    define_function(node);
+    break;
+  }
+  last_status = status;
+  return status;
+}
+
+// Directory listings used by tab completion, kept in a small LRU cache.
+// An entry is valid while the directory's (dev, ino, mtime) is unchanged,
+// so repeated Tabs into a huge directory cost one stat() instead of a rescan.
+// Completion workers share the cache under dir_cache_lock; the slow parts
+// (stat, readdir) run without holding it.
+#define DIR_CACHE_SLOTS 16
+
+struct dir_listing {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  char* names;          // packed, NUL-separated entry names
+  int* offsets;         // offsets into names, sorted by name
+  unsigned char* types; // d_type per entry, indexed like offsets
+  int count;
+  unsigned long last_used;
+};
+
+struct dir_listing dir_cache[DIR_CACHE_SLOTS];
+unsigned long dir_cache_clock = 0;
+pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int cmp_packed_names(const void* a, const void* b, void* names) {
+  return strcmp((const char*)names + *(const int*)a, (const char*)names + *(const int*)b);
+}
+
+void dir_listing_free(struct dir_listing* dl) {
+  free(dl->names);
+  free(dl->offsets);
+  free(dl->types);
+  memset(dl, 0, sizeof(*dl));
+}
+
+int dir_listing_load(struct dir_listing* dl, const char* path, atomic_bool* cancelled) {
+  DIR* dp = opendir(path);
+  if (!dp)
+    return -1;
+
+  size_t names_cap = 4096, names_len = 0;
+  int cap = 64, count = 0;
+  char* names = malloc(names_cap);
+  int* offsets = malloc(cap * sizeof(int));
+  unsigned char* types = malloc(cap);
+  if (!names || !offsets || !types)
+    goto fail;
+
+  struct dirent* entry;
+  while ((entry = readdir(dp))) {
+    if (cancelled && atomic_load(cancelled))
+      goto fail;
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+
+    size_t n = strlen(entry->d_name) + 1;
+    if (names_len + n > names_cap) {
+      while (names_len + n > names_cap)
+        names_cap *= 2;
+      char* grown = realloc(names, names_cap);
+      if (!grown)
+        goto fail;
+      names = grown;
+    }
+    if (count == cap) {
+      cap *= 2;
+      int* grown_offsets = realloc(offsets, cap * sizeof(int));
+      if (!grown_offsets)
+        goto fail;
+      offsets = grown_offsets;
+      unsigned char* grown_types = realloc(types, cap);
+      if (!grown_types)
+        goto fail;
+      types = grown_types;
+    }
+
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      // Resolve what the entry really is so directories get a trailing '/'
+      struct stat st;
+      if (fstatat(dirfd(dp), entry->d_name, &st, 0) == 0)
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : type;
+    }
+
+    memcpy(names + names_len, entry->d_name, n);
+    offsets[count] = names_len;
+    types[count] = type;
+    names_len += n;
+    count++;
+  }
+  closedir(dp);
+  dp = NULL;
+
+  // Sort by name so prefix lookups can binary search. Each offset carries
+  // its entry index along so the d_type array can be permuted to match.
+  int* pairs = malloc(2 * count * sizeof(int) + 1);
+  unsigned char* sorted_types = malloc(count + 1);
+  if (!pairs || !sorted_types) {
+    free(pairs);
+    free(sorted_types);
+    goto fail;
+  }
+  for (int i = 0; i < count; i++) {
+    pairs[2 * i] = offsets[i];
+    pairs[2 * i + 1] = i;
+  }
+  qsort_r(pairs, count, 2 * sizeof(int), cmp_packed_names, names);
+  for (int i = 0; i < count; i++) {
+    offsets[i] = pairs[2 * i];
+    sorted_types[i] = types[pairs[2 * i + 1]];
+  }
+  free(pairs);
+  free(types);
+
+  dl->names = names;
+  dl->offsets = offsets;
+  dl->types = sorted_types;
+  dl->count = count;
+  return 0;
+
+fail:
+  if (dp)
+    closedir(dp);
+  free(names);
+  free(offsets);
+  free(types);
+  return -1;
+}
+
+// Returns the cached listing of path, reading the directory only when it is
+// not cached or has changed since it was cached. On success dir_cache_lock
+// is held and the caller must release it once done with the listing.
+// NULL (lock not held) if the directory can't be read.
+struct dir_listing* get_dir_listing(const char* path, atomic_bool* cancelled) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  pthread_mutex_lock(&dir_cache_lock);
+  for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+    struct dir_listing* dl = &dir_cache[i];
+    if (dl->names && dl->dev == st.st_dev && dl->ino == st.st_ino &&
+      dl->mtime.tv_sec == st.st_mtim.tv_sec && dl->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+      dl->last_used = ++dir_cache_clock;
+      return dl;
+    }
+  }
+  pthread_mutex_unlock(&dir_cache_lock);
+
+  struct dir_listing fresh = { 0 };
+  if (dir_listing_load(&fresh, path, cancelled) != 0)
+    return NULL;
+  fresh.dev = st.st_dev;
+  fresh.ino = st.st_ino;
+  fresh.mtime = st.st_mtim;
+
+  pthread_mutex_lock(&dir_cache_lock);
+  struct dir_listing* victim = &dir_cache[0];
+  for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+    struct dir_listing* dl = &dir_cache[i];
+    if (dl->names && dl->dev == st.st_dev && dl->ino == st.st_ino) {
+      victim = dl; // older copy of the same directory, replace it
+      break;
+    }
+    if (!dl->names)
+      victim = dl;
+    else if (victim->names && dl->last_used < victim->last_used)
+      victim = dl;
+  }
+  dir_listing_free(victim);
+  *victim = fresh;
+  victim->last_used = ++dir_cache_clock;
+  return victim;
+}
+
+// Index of the first entry whose name is >= prefix
+int dir_listing_lower_bound(struct dir_listing* dl, const char* prefix) {
+  int lo = 0, hi = dl->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (strcmp(dl->names + dl->offsets[mid], prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Fuzzy completion matching. A query matches a candidate when its bytes
+// appear in order (a subsequence); matching is case-insensitive unless the
+// query has an uppercase letter. The byte search that drives the filter is
+// vectorized (AVX2, SSE2) with a scalar fallback, picked once at startup.
+const char* find_byte2_scalar(const char* s, size_t n, char a, char b) {
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] == a || s[i] == b)
+      return s + i;
+  }
+  return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char* find_byte2_sse2(const char* s, size_t n, char a, char b) {
+  __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    if (mask)
+      return s + i + __builtin_ctz(mask);
+  }
+  return find_byte2_scalar(s + i, n - i, a, b);
+}
+
+__attribute__((target("avx2")))
+const char* find_byte2_avx2(const char* s, size_t n, char a, char b) {
+  __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    if (mask)
+      return s + i + __builtin_ctz(mask);
+  }
+  return find_byte2_sse2(s + i, n - i, a, b);
+}
+
+// True if needle (at most 16 bytes) occurs in s, using PCMPESTRI
+__attribute__((target("sse4.2")))
+bool contains_sse42(const char* s, size_t n, const char* needle, size_t needle_len) {
+  char padded[16] = { 0 };
+  memcpy(padded, needle, needle_len);
+  __m128i vneedle = _mm_loadu_si128((const __m128i*)padded);
+
+  size_t i = 0;
+  while (i + needle_len <= n) {
+    char chunk[16];
+    size_t avail = n - i < 16 ? n - i : 16;
+    const char* p = s + i;
+    if (avail < 16) {
+      memcpy(chunk, p, avail);
+      p = chunk;
+    }
+    int idx = _mm_cmpestri(vneedle, needle_len, _mm_loadu_si128((const __m128i*)p), avail,
+      _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ORDERED);
+    if (idx == 16) {
+      i += 16;
+      continue;
+    }
+    if (idx + needle_len <= avail)
+      return true;
+    if (avail < 16)
+      return false;
+    i += idx; // partial match across the chunk boundary, retry from its start
+  }
+  return false;
+}
+#endif
+
+bool contains_scalar(const char* s, size_t n, const char* needle, size_t needle_len) {
+  return memmem(s, n, needle, needle_len) != NULL;
+}
+
+const char* (*find_byte2)(const char*, size_t, char, char) = find_byte2_scalar;
+bool (*contains_bytes)(const char*, size_t, const char*, size_t) = contains_scalar;
+
+void init_simd_dispatch() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  find_byte2 = __builtin_cpu_supports("avx2") ? find_byte2_avx2 : find_byte2_sse2;
+  count_byte = __builtin_cpu_supports("avx2") ? count_byte_avx2 : count_byte_sse2;
+  span_plain = __builtin_cpu_supports("avx2") ? span_plain_avx2 : span_plain_sse2;
+  if (__builtin_cpu_supports("sse4.2"))
+    contains_bytes = contains_sse42;
+#endif
+}
+
+bool query_is_case_sensitive(const char* query) {
+  for (; *query; query++) {
+    if (*query >= 'A' && *query <= 'Z')
+      return true;
+  }
+  return false;
+}
+
+char fold_byte(char c) {
+  return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+char other_case(char c) {
+  if (c >= 'a' && c <= 'z')
+    return c - 32;
+  if (c >= 'A' && c <= 'Z')
+    return c + 32;
+  return c;
+}
+
+// Scores name against query, or returns -1 if it isn't a subsequence.
+// Matches earn more at word starts and when consecutive, lose a little for
+// every skipped byte, and a contiguous (substring) or prefix hit wins outright.
+int fuzzy_score(const char* name, size_t len, const char* query, size_t query_len, bool case_sensitive) {
+  if (query_len == 0)
+    return 0;
+  if (query_len > len)
+    return -1;
+
+  int score = 0;
+  size_t pos = 0;
+  ssize_t prev = -1;
+  for (size_t i = 0; i < query_len; i++) {
+    char q = query[i];
+    const char* hit = find_byte2(name + pos, len - pos, q, case_sensitive ? q : other_case(q));
+    if (!hit)
+      return -1;
+
+    size_t at = hit - name;
+    score += 16;
+    if (prev >= 0 && at == (size_t)prev + 1)
+      score += 8;
+    if (at == 0 || strchr("/_-. ", name[at - 1]) ||
+      (name[at - 1] >= 'a' && name[at - 1] <= 'z' && name[at] >= 'A' && name[at] <= 'Z'))
+      score += 10;
+    score -= at - pos;
+    prev = at;
+    pos = at + 1;
+  }
+
+  // Bonus for the query appearing as a whole; needs the folded form when
+  // matching case-insensitively, and PCMPESTRI handles up to 16 bytes
+  if (query_len <= 16 && len <= 256) {
+    char folded[256], folded_query[16];
+    const char* hay = name;
+    const char* needle = query;
+    if (!case_sensitive) {
+      for (size_t i = 0; i < len; i++)
+        folded[i] = fold_byte(name[i]);
+      for (size_t i = 0; i < query_len; i++)
+        folded_query[i] = fold_byte(query[i]);
+      hay = folded;
+      needle = folded_query;
+    }
+    if (memcmp(hay, needle, query_len) == 0)
+      score += 40;
+    else if (contains_bytes(hay, len, needle, query_len))
+      score += 20;
+  }
+
+  return score - (int)(len / 4);
+}
+
+// The filter only needs the subsequence test; scoring is left for the survivors
+bool name_matches(const char* name, const char* query, size_t query_len, bool fuzzy, bool case_sensitive) {
+  if (!fuzzy)
+    return strncmp(name, query, query_len) == 0;
+
+  size_t len = strlen(name), pos = 0;
+  for (size_t i = 0; i < query_len; i++) {
+    char q = query[i];
+    const char* hit = find_byte2(name + pos, len - pos, q, case_sensitive ? q : other_case(q));
+    if (!hit)
+      return false;
+    pos = hit - name + 1;
+  }
+  return true;
+}
+
+struct completion_job;
+
+// Candidates gathered for a single Tab press. A completion owned by a
+// background job hands its candidates over to the job in batches.
+struct completion {
+  char** items;
+  int count;
+  int cap;
+  struct completion_job* job;
+  long long batch_start; // when the oldest candidate not handed over was added
+};
+
+// A completion scan running on a worker thread. The input thread polls
+// event_fd, collects batches from found as they arrive, and sets cancelled
+// when a key is pressed. Whichever side drops the last reference frees it,
+// so a worker stuck on a hung mount can simply be abandoned. A batch is
+// handed over once it is full or has waited COMPLETION_BATCH_MS.
+#define COMPLETION_BATCH 64
+#define COMPLETION_BATCH_MS 20
+
+struct completion_job {
+  char* prefix;
+  bool command_position;
+  bool fuzzy;
+  char* path_env; // PATH and HOME as seen by the input thread at Tab time
+  char* home;
+  atomic_bool cancelled;
+  int event_fd;
+  pthread_mutex_t lock;
+  struct completion found;
+  bool done;
+  int refs;
+};
+
+bool completion_cancelled(struct completion* comp) {
+  return comp->job && atomic_load(&comp->job->cancelled);
+}
+
+void completion_append(struct completion* comp, char* item) {
+  if (comp->count == comp->cap) {
+    int cap = comp->cap ? comp->cap * 2 : 64;
+    char** grown = realloc(comp->items, cap * sizeof(char*));
+    if (!grown) {
+      free(item);
+      return;
+    }
+    comp->items = grown;
+    comp->cap = cap;
+  }
+  comp->items[comp->count++] = item;
+}
+
+// Moves the candidates gathered so far over to the job and wakes the input thread
+void completion_flush(struct completion* comp) {
+  struct completion_job* job = comp->job;
+  if (!job || comp->count == 0)
+    return;
+
+  pthread_mutex_lock(&job->lock);
+  for (int i = 0; i < comp->count; i++)
+    completion_append(&job->found, comp->items[i]);
+  pthread_mutex_unlock(&job->lock);
+  comp->count = 0;
+
+  uint64_t one = 1;
+  write(job->event_fd, &one, sizeof(one));
+}
+
+// Hands the candidates over if the oldest has waited long enough, so a
+// scan that slows down (a hung mount) still shows what it found
+void completion_flush_due(struct completion* comp) {
+  if (comp->job && comp->count > 0 && monotonic_ns() - comp->batch_start >= COMPLETION_BATCH_MS * 1000000LL)
+    completion_flush(comp);
+}
+
+void completion_add(struct completion* comp, const char* head, const char* name, bool is_dir) {
+  size_t head_len = strlen(head), name_len = strlen(name);
+  char* item = malloc(head_len + name_len + 2);
+  if (!item)
+    return;
+  memcpy(item, head, head_len);
+  memcpy(item + head_len, name, name_len);
+  if (is_dir)
+    item[head_len + name_len++] = '/';
+  item[head_len + name_len] = '\0';
+  completion_append(comp, item);
+
+  if (comp->job && comp->count == 1)
+    comp->batch_start = monotonic_ns();
+  if (comp->job && comp->count >= COMPLETION_BATCH)
+    completion_flush(comp);
+  else
+    completion_flush_due(comp);
+}
+
+void completion_free(struct completion* comp) {
+  for (int i = 0; i < comp->count; i++)
+    free(comp->items[i]);
+  free(comp->items);
+  memset(comp, 0, sizeof(*comp));
+}
+
+int cmp_string_ptrs(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Sorts candidates and drops duplicates (the same command in several PATH dirs)
+void completion_sort_unique(struct completion* comp) {
+  if (comp->count == 0)
+    return;
+  qsort(comp->items, comp->count, sizeof(char*), cmp_string_ptrs);
+  int out = 1;
+  for (int i = 1; i < comp->count; i++) {
+    if (strcmp(comp->items[i], comp->items[out - 1]) == 0)
+      free(comp->items[i]);
+    else
+      comp->items[out++] = comp->items[i];
+  }
+  comp->count = out;
+}
+
+void complete_command(const char* prefix, const char* path_env, bool fuzzy, struct completion* comp) {
+  size_t prefix_len = strlen(prefix);
+  bool case_sensitive = query_is_case_sensitive(prefix);
+
+  for (int b = 0; builtin[b]; b++) {
+    if (name_matches(builtin[b], prefix, prefix_len, fuzzy, case_sensitive))
+      completion_add(comp, "", builtin[b], false);
+  }
+  // A prefix that names a builtin is taken to mean it; a fuzzy query
+  // matches some builtin far too easily for that, so PATH is searched
+  // too and the ranking sorts them out
+  if ((comp->count > 0 && !fuzzy) || !path_env)
+    return;
+
+  char* path_copy = strdup(path_env);
+  if (!path_copy)
+    return;
+
+  char* saveptr;
+  for (char* dir = strtok_r(path_copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr)) {
+    if (completion_cancelled(comp))
+      break;
+    struct dir_listing* dl = get_dir_listing(dir, comp->job ? &comp->job->cancelled : NULL);
+    if (!dl)
+      continue;
+
+    // Collect names under the cache lock, check them after releasing it
+    struct completion names = { 0 };
+    for (int k = fuzzy ? 0 : dir_listing_lower_bound(dl, prefix); k < dl->count; k++) {
+      const char* name = dl->names + dl->offsets[k];
+      if (!name_matches(name, prefix, prefix_len, fuzzy, case_sensitive)) {
+        if (!fuzzy)
+          break;
+        continue;
+      }
+      if (dl->types[k] != DT_DIR)
+        completion_add(&names, "", name, false);
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+
+    for (int k = 0; k < names.count && !completion_cancelled(comp); k++) {
+      completion_flush_due(comp);
+      char full_path[1024];
+      snprintf(full_path, sizeof(full_path), "%s/%s", dir, names.items[k]);
+
+      if (access(full_path, X_OK) == 0) {
+        struct stat st;
+        if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode))
+          completion_add(comp, "", names.items[k], false);
+      }
+    }
+    completion_free(&names);
+    // Each directory's matches go out before the next one is opened
+    completion_flush(comp);
+  }
+  free(path_copy);
+}
+
+// Completes word as a path. A leading ~ is looked up under $HOME but kept
+// as typed in the candidates, so the edited line still reads "~/...".
+void complete_path(const char* word, const char* home, bool executables_only, bool fuzzy, struct completion* comp) {
+  const char* slash = strrchr(word, '/');
+  size_t head_len = slash ? (size_t)(slash - word) + 1 : 0;
+  const char* base = word + head_len;
+
+  char head[1024];
+  if (head_len >= sizeof(head))
+    return;
+  memcpy(head, word, head_len);
+  head[head_len] = '\0';
+
+  char dir[2048];
+  if (head_len == 0) {
+    if (word[0] == '~' && word[1] == '\0') {
+      // A bare "~" completes to the home directory itself
+      completion_add(comp, "", "~", true);
+      return;
+    }
+    strcpy(dir, ".");
+  }
+  else if (word[0] == '~' && (word[1] == '/')) {
+    if (!home)
+      return;
+    snprintf(dir, sizeof(dir), "%s%s", home, head + 1);
+  }
+  else {
+    snprintf(dir, sizeof(dir), "%s", head);
+  }
+
+  struct dir_listing* dl = get_dir_listing(dir, comp->job ? &comp->job->cancelled : NULL);
+  if (!dl)
+    return;
+
+  // Copy matches out under the cache lock; the executable check for
+  // command-position paths needs syscalls and runs after releasing it
+  struct completion matches = { 0 };
+  size_t base_len = strlen(base);
+  bool case_sensitive = query_is_case_sensitive(base);
+  for (int k = fuzzy ? 0 : dir_listing_lower_bound(dl, base); k < dl->count; k++) {
+    const char* name = dl->names + dl->offsets[k];
+    if (!name_matches(name, base, base_len, fuzzy, case_sensitive)) {
+      if (!fuzzy)
+        break;
+      continue;
+    }
+    // Hidden entries only show up once the user has typed the dot
+    if (name[0] == '.' && base[0] != '.')
+      continue;
+    completion_add(&matches, "", name, dl->types[k] == DT_DIR);
+  }
+  pthread_mutex_unlock(&dir_cache_lock);
+
+  int dir_fd = -1;
+  for (int k = 0; k < matches.count && !completion_cancelled(comp); k++) {
+    char* name = matches.items[k];
+    size_t n = strlen(name);
+    bool is_dir = name[n - 1] == '/';
+    if (is_dir)
+      name[n - 1] = '\0';
+    else if (executables_only) {
+      completion_flush_due(comp);
+      if (dir_fd < 0)
+        dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+      if (dir_fd < 0 || faccessat(dir_fd, name, X_OK, 0) != 0)
+        continue;
+    }
+    completion_add(comp, head, name, is_dir);
+  }
+  if (dir_fd >= 0)
+    close(dir_fd);
+  completion_free(&matches);
+}
+
+void completion_job_release(struct completion_job* job) {
+  pthread_mutex_lock(&job->lock);
+  bool last = --job->refs == 0;
+  pthread_mutex_unlock(&job->lock);
+  if (!last)
+    return;
+
+  completion_free(&job->found);
+  close(job->event_fd);
+  pthread_mutex_destroy(&job->lock);
+  free(job->prefix);
+  free(job->path_env);
+  free(job->home);
+  free(job);
+}
+
+void* completion_worker(void* arg) {
+  struct completion_job* job = arg;
+  struct completion local = { .job = job };
+
+  if (job->command_position && !strchr(job->prefix, '/'))
+    complete_command(job->prefix, job->path_env, job->fuzzy, &local);
+  else
+    complete_path(job->prefix, job->home, job->command_position, job->fuzzy, &local);
+
+  completion_flush(&local);
+  completion_free(&local);
+
+  pthread_mutex_lock(&job->lock);
+  job->done = true;
+  pthread_mutex_unlock(&job->lock);
+  uint64_t one = 1;
+  write(job->event_fd, &one, sizeof(one));
+
+  completion_job_release(job);
+  return NULL;
+}
+
+struct ranked_item {
+  char* item;
+  int score;
+};
+
+int cmp_ranked_items(const void* a, const void* b) {
+  const struct ranked_item* ra = a;
+  const struct ranked_item* rb = b;
+  if (ra->score != rb->score)
+    return rb->score - ra->score;
+  return strcmp(ra->item, rb->item);
+}
+
+// Orders fuzzy matches best first. Only the survivors of the filter are
+// scored again here, so this stays cheap next to the scan itself.
+void completion_rank(struct completion* comp, const char* word) {
+  const char* slash = strrchr(word, '/');
+  size_t head_len = slash ? (size_t)(slash - word) + 1 : 0;
+  const char* query = word + head_len;
+  size_t query_len = strlen(query);
+  bool case_sensitive = query_is_case_sensitive(query);
+
+  struct ranked_item* ranked = malloc(comp->count * sizeof(*ranked) + 1);
+  if (!ranked)
+    return;
+  for (int i = 0; i < comp->count; i++) {
+    const char* name = comp->items[i] + (strlen(comp->items[i]) >= head_len ? head_len : 0);
+    ranked[i].item = comp->items[i];
+    ranked[i].score = fuzzy_score(name, strlen(name), query, query_len, case_sensitive);
+  }
+  qsort(ranked, comp->count, sizeof(*ranked), cmp_ranked_items);
+  for (int i = 0; i < comp->count; i++)
+    comp->items[i] = ranked[i].item;
+  free(ranked);
+}
+
+// Keys already typed ahead (or pasted) within this window after a Tab
+// don't cancel it, so fast completions behave the same as a blocking scan
+#define COMPLETION_GRACE_MS 50
+
+// Gathers completion candidates for prefix on a worker thread while
+// watching the terminal. Returns false if a keypress cancelled the scan;
+// that key is left unread for the caller to handle normally. Once the
+// scan outlasts the grace window, show is given the candidates as they
+// arrive.
+bool run_completion(const char* prefix, bool command_position, struct completion* out,
+  void (*show)(char** items, int count, void* ctx), void* ctx) {
+  struct completion_job* job = calloc(1, sizeof(*job));
+  if (!job)
+    return false;
+
+  const char* path_env = var_get("PATH");
+  const char* home = var_get("HOME");
+  job->prefix = strdup(prefix);
+  job->command_position = command_position;
+  job->fuzzy = opt_fuzzycomplete;
+  job->path_env = path_env ? strdup(path_env) : NULL;
+  job->home = home ? strdup(home) : NULL;
+  job->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  pthread_mutex_init(&job->lock, NULL);
+  job->refs = 2;
+
+  pthread_t thread;
+  if (!job->prefix || job->event_fd < 0 ||
+    pthread_create(&thread, NULL, completion_worker, job) != 0) {
+    job->refs = 1;
+    completion_job_release(job);
+    return false;
+  }
+  pthread_detach(thread);
+
+  // Scripted input isn't someone typing, so only a terminal can cancel
+  int grace = isatty(STDIN_FILENO) ? timer_after(COMPLETION_GRACE_MS) : -1;
+  bool in_grace = true;
+  bool finished = false;
+  int shown = 0;
+  while (true) {
+    // During the grace window the worker is watched with the grace timer,
+    // then with the terminal
+    struct event_source srcs[2] = { { .fd = job->event_fd }, { .fd = in_grace ? grace : STDIN_FILENO } };
+    int ready = event_wait(srcs, srcs[1].fd >= 0 ? 2 : 1);
+    bool typed = !in_grace && srcs[1].ready;
+    if (in_grace && srcs[1].ready)
+      in_grace = false;
+
+    uint64_t ticks;
+    read(job->event_fd, &ticks, sizeof(ticks));
+
+    pthread_mutex_lock(&job->lock);
+    for (int i = 0; i < job->found.count; i++)
+      completion_append(out, job->found.items[i]);
+    job->found.count = 0;
+    finished = job->done;
+    pthread_mutex_unlock(&job->lock);
+
+    if (finished || typed || ready < 0)
+      break;
+    if (!in_grace && out->count > shown) {
+      show(out->items + shown, out->count - shown, ctx);
+      shown = out->count;
+    }
+  }
+  if (grace >= 0)
+    close(grace);
+
+  if (!finished)
+    atomic_store(&job->cancelled, true);
+  completion_job_release(job);
+
+  if (finished && command_position && !strchr(prefix, '/'))
+    completion_sort_unique(out);
+  if (finished && opt_fuzzycomplete)
+    completion_rank(out, prefix);
+  return finished;
+}
+
+void get_terminal_size(int* rows, int* cols) {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+  }
+  else {
+    *rows = 0; // unknown: no paging
+    *cols = 80;
+  }
+}
+
+// Waits for a key at a paging prompt. Returns the number of further lines
+// to print: a full page for space, one for enter, 0 to stop.
+int wait_for_more(int page) {
+  write(STDOUT_FILENO, "--More--", 8);
+  char c;
+  int result = 0;
+  while (read(STDIN_FILENO, &c, 1) == 1) {
+    if (c == ' ') {
+      result = page;
+      break;
+    }
+    if (c == '\n' || c == '\r') {
+      result = 1;
+      break;
+    }
+    if (c == 'q' || c == 'Q' || c == 27 || c == 127)
+      break;
+  }
+  write(STDOUT_FILENO, "\r\033[K", 4);
+  return result;
+}
+
+// Prints candidates the way ls does: on one line when they fit, otherwise
+// in columns ordered top to bottom, stopping at each screenful on a tty
+// if paged.
+void print_completions(char** items, int count, bool paged) {
+  int rows, cols;
+  get_terminal_size(&rows, &cols);
+
+  size_t total_width = 0, max_len = 0;
+  for (int i = 0; i < count; i++) {
+    size_t n = strlen(items[i]);
+    total_width += n + 2;
+    if (n > max_len)
+      max_len = n;
+  }
+
+  if (total_width <= (size_t)cols + 2) {
+    for (int i = 0; i < count; i++) {
+      write(STDOUT_FILENO, items[i], strlen(items[i]));
+      if (i < count - 1)
+        write(STDOUT_FILENO, "  ", 2);
+    }
+    write(STDOUT_FILENO, "\n", 1);
+    return;
+  }
+
+  int col_width = max_len + 2;
+  int ncols = cols / col_width;
+  if (ncols < 1)
+    ncols = 1;
+  int nrows = (count + ncols - 1) / ncols;
+  int page = paged && rows > 1 ? rows - 1 : 0;
+  int budget = page;
+
+  char line[4096];
+  for (int r = 0; r < nrows; r++) {
+    if (page && budget == 0) {
+      budget = wait_for_more(page);
+      if (budget == 0)
+        return;
+    }
+
+    size_t pos = 0;
+    for (int c = 0; c < ncols; c++) {
+      int idx = c * nrows + r;
+      if (idx >= count)
+        break;
+      size_t n = strlen(items[idx]);
+      if (pos + col_width + 1 >= sizeof(line))
+        break;
+      memcpy(line + pos, items[idx], n);
+      pos += n;
+      if (c < ncols - 1 && (c + 1) * nrows + r < count) {
+        memset(line + pos, ' ', col_width - n);
+        pos += col_width - n;
+      }
+    }
+    line[pos++] = '\n';
+    write(STDOUT_FILENO, line, pos);
+    budget--;
+  }
+}
+
+// Asks before dumping a very long candidate list, like readline does
+bool confirm_long_listing(int count) {
+  if (count <= 100 || !isatty(STDIN_FILENO))
+    return true;
+
+  char prompt[64];
+  int n = snprintf(prompt, sizeof(prompt), "Display all %d possibilities? (y or n)", count);
+  write(STDOUT_FILENO, prompt, n);
+  char c = 0;
+  while (read(STDIN_FILENO, &c, 1) == 1) {
+    if (c == 'y' || c == 'Y' || c == ' ' || c == 'n' || c == 'N' || c == 127)
+      break;
+  }
+  write(STDOUT_FILENO, "\n", 1);
+  return c == 'y' || c == 'Y' || c == ' ';
+}
+
+// Compiles and runs the commands typed at the prompt, then drops their
+// here-documents. Returns false, running nothing, if the text ends inside
+// a construct so that more lines are needed.
+bool run_command_line(const char* text) {
+  bool incomplete;
+  struct program* prog = compile_program(text, &incomplete);
+  if (!prog) {
+    if (incomplete)
+      return false;
+    last_status = 2;
+  }
+  else {
+    got_sigint = false;
+    running_program = prog;
+    run_node(prog->root);
+    running_program = NULL;
+    break_count = continue_count = 0;
+    program_release(prog);
+  }
+  heredocs_clear();
+  return true;
+}
 
-      int start = history_count - n;
-      if (start < 0) start = 0;
+// HISTIGNORE patterns, compiled once and again only when the variable's
+// generation moves
+struct glob_component* histignore = NULL;
+int nhistignore = 0;
+unsigned long histignore_generation = 0;
 
-      for (int i = start; i < history_count; i++) {
-        printf("%5d  %s\n", i + 1, history_commands[i]);
-      }
-    }
+void histignore_update() {
+  unsigned long generation = var_generation("HISTIGNORE");
+  if (generation == histignore_generation)
+    return;
+  for (int i = 0; i < nhistignore; i++) {
+    free(histignore[i].text);
+    free(histignore[i].ops);
   }
-  else
-    execute_external(argvv);
+  free(histignore);
+  histignore = NULL;
+  nhistignore = 0;
+  histignore_generation = generation;
 
-cleanup:
-  if (out_stdout) {
-    dup2(saved_stdout, 1);
-    close(saved_stdout);
+  const char* value = var_get("HISTIGNORE");
+  if (!value || !*value)
+    return;
+  int n = 1;
+  for (const char* p = value; *p; p++)
+    n += *p == ':';
+  histignore = calloc(n, sizeof(*histignore));
+  if (!histignore)
+    return;
+  for (const char* p = value;; p++) {
+    const char* end = strchrnul(p, ':');
+    struct glob_component* gc = &histignore[nhistignore];
+    if (!compile_glob_component(p, end - p, gc)) {
+      free(gc->text);
+      free(gc->ops);
+      break;
+    }
+    gc->dot_ok = true;
+    nhistignore++;
+    if (!*end)
+      break;
+    p = end;
   }
+}
 
-  if (out_stderr) {
-    dup2(saved_stderr, 2);
-    close(saved_stderr);
+// Whether the colon-separated HISTCONTROL value has option
+bool histcontrol_has(const char* control, const char* option) {
+  size_t len = strlen(option);
+  for (const char* p = control; *p; p++) {
+    const char* end = strchrnul(p, ':');
+    if ((size_t)(end - p) == len && strncmp(p, option, len) == 0)
+      return true;
+    if (!*end)
+      break;
+    p = end;
   }
-  return;
+  return false;
+}
 
-cleanup_and_exit:
-  if (out_stdout) {
-    dup2(saved_stdout, 1);
-    close(saved_stdout);
+// Adds a line typed at the prompt to the history, unless HISTCONTROL or
+// HISTIGNORE says to leave it out
+void record_history(const char* line) {
+  if (history_limit() == 0)
+    return;
+  // Pick up other sessions' lines first so ignoredups sees the real
+  // previous line and the log stays in order
+  bool logged = history_log_sync(LOCK_EX);
+  const char* control = var_get("HISTCONTROL");
+  if (!control)
+    control = "";
+  bool both = histcontrol_has(control, "ignoreboth");
+  int last = history_prev(-1);
+  const char* previous = last >= 0 ? history_commands[last] : NULL;
+
+  bool ignore = false;
+  if ((both || histcontrol_has(control, "ignorespace")) && line[0] == ' ')
+    ignore = true;
+  if ((both || histcontrol_has(control, "ignoredups")) && previous && strcmp(previous, line) == 0)
+    ignore = true;
+
+  // '&' stands for the previous history line
+  histignore_update();
+  for (int i = 0; i < nhistignore && !ignore; i++) {
+    bool amp = strcmp(histignore[i].text, "&") == 0 && histignore[i].literal;
+    ignore = amp ? previous && strcmp(previous, line) == 0 : glob_match(&histignore[i], line);
   }
 
-  if (out_stderr) {
-    dup2(saved_stderr, 2);
-    close(saved_stderr);
-  }
-  return;
+  if (!ignore)
+    history_push(line, histcontrol_has(control, "erasedups"));
+  if (logged && !ignore)
+    history_log_append(line);
+  else if (logged)
+    history_lock(history_log.fd, LOCK_UN);
 }
 
-int is_builtin(const char* cmd) {
-  for (int i = 0; builtin[i]; i++) {
-    if (strcmp(builtin[i], cmd) == 0)
-      return 1;
-  }
-  return 0;
+// The line being typed, kept in a gap buffer: the text before the cursor
+// sits at the start of data and the text after it at the end, so typing
+// or deleting at the cursor never moves the rest of the line. shown holds
+// what the terminal has after the prompt, which lets a refresh send only
+// the span that changed.
+struct line_editor {
+  char* data;
+  size_t cap;
+  size_t gap_start; // the cursor
+  size_t gap_end;
+  size_t prompt_len;
+  struct strbuf text;  // the whole line, rebuilt by editor_line()
+  struct strbuf shown;
+  size_t shown_cursor;
+};
+
+size_t editor_len(const struct line_editor* e) {
+  return e->cap - (e->gap_end - e->gap_start);
 }
 
-void execute_builtin_in_pipeline(char** argv, int argc, int in_fd, int out_fd) {
-  int saved_stdin = -1, saved_stdout = -1;
+char editor_at(const struct line_editor* e, size_t i) {
+  return e->data[i < e->gap_start ? i : i + e->gap_end - e->gap_start];
+}
 
-  if (in_fd != STDIN_FILENO) {
-    saved_stdin = dup(STDIN_FILENO);
-    dup2(in_fd, STDIN_FILENO);
+void editor_insert(struct line_editor* e, const char* s, size_t n) {
+  if (n == 0)
+    return;
+  if (e->gap_end - e->gap_start < n) {
+    size_t after = e->cap - e->gap_end;
+    size_t cap = e->cap ? e->cap : 256;
+    while (cap - editor_len(e) < n)
+      cap *= 2;
+    char* grown = realloc(e->data, cap);
+    if (!grown)
+      return;
+    memmove(grown + cap - after, grown + e->gap_end, after);
+    e->data = grown;
+    e->gap_end = cap - after;
+    e->cap = cap;
   }
+  memcpy(e->data + e->gap_start, s, n);
+  e->gap_start += n;
+}
 
-  if (out_fd != STDOUT_FILENO) {
-    saved_stdout = dup(STDOUT_FILENO);
-    dup2(out_fd, STDOUT_FILENO);
-  }
+// Deletes up to before bytes left of the cursor and after bytes right of it
+void editor_delete(struct line_editor* e, size_t before, size_t after) {
+  e->gap_start -= before < e->gap_start ? before : e->gap_start;
+  e->gap_end += after < e->cap - e->gap_end ? after : e->cap - e->gap_end;
+}
 
-  if (strcmp(argv[0], "echo") == 0) {
-    for (int i = 1; i < argc && argv[i]; i++) {
-      printf("%s", argv[i]);
-      if (argv[i + 1])
-        printf(" ");
-    }
-    printf("\n");
-  }
-  else if (strcmp(argv[0], "type") == 0 && argc >= 2) {
-    const char* cmd = argv[1];
-    int found = 0;
-    for (int i = 0; builtin[i]; i++) {
-      if (strcmp(builtin[i], cmd) == 0) {
-        found = 1;
-        break;
-      }
-    }
-    if (found) {
-      printf("%s is a shell builtin\n", cmd);
-    }
-    else {
-      char* exe_path = find_executable(cmd);
-      if (exe_path) {
-        printf("%s is %s\n", cmd, exe_path);
-        free(exe_path);
-      }
-      else {
-        printf("%s: not found\n", cmd);
-      }
-    }
-  }
-  else if (strcmp(argv[0], "pwd") == 0) {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-      printf("%s\n", cwd);
-    }
+// Moves the cursor, and the gap with it, to pos
+void editor_move(struct line_editor* e, size_t pos) {
+  if (pos > editor_len(e))
+    pos = editor_len(e);
+  if (pos < e->gap_start) {
+    size_t n = e->gap_start - pos;
+    memmove(e->data + e->gap_end - n, e->data + pos, n);
+    e->gap_start -= n;
+    e->gap_end -= n;
   }
-  else if (strcmp(argv[0], "cd") == 0) {
-    const char* path = argc > 1 ? argv[1] : getenv("HOME");
-    if (path && chdir(path) != 0) {
-      fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
-    }
+  else {
+    size_t n = pos - e->gap_start;
+    memmove(e->data + e->gap_start, e->data + e->gap_end, n);
+    e->gap_start += n;
+    e->gap_end += n;
   }
-  else if (strcmp(argv[0], "history") == 0) {
-    if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
-      const char* filepath = argv[2];
-      FILE* fp = fopen(filepath, "r");
+}
 
-      if (!fp) {
-        fprintf(stderr, "history: %s: %s\n", filepath, strerror(errno));
-        return;
-      }
+// The whole line as a string, valid until the next call
+const char* editor_line(struct line_editor* e) {
+  e->text.len = 0;
+  strbuf_append(&e->text, e->data, e->gap_start);
+  strbuf_append(&e->text, e->data + e->gap_end, e->cap - e->gap_end);
+  return e->text.data;
+}
 
-      char line[1024];
-      while (fgets(line, sizeof(line), fp)) {
-        line[strcspn(line, "\n")] = '\0';
-        if (strlen(line) == 0) continue;
-        if (history_count < 50) {
-          strncpy(history_commands[history_count], line, sizeof(history_commands[0]) - 1);
-          history_commands[history_count][sizeof(history_commands[0]) - 1] = '\0';
-          history_count++;
-        }
-        else {
-          for (int i = 0; i < 49; i++) {
-            strcpy(history_commands[i], history_commands[i + 1]);
-          }
-          strncpy(history_commands[49], line, sizeof(history_commands[0]) - 1);
-          history_commands[49][sizeof(history_commands[0]) - 1] = '\0';
-        }
-      }
+void editor_set(struct line_editor* e, const char* s) {
+  e->gap_start = 0;
+  e->gap_end = e->cap;
+  editor_insert(e, s, strlen(s));
+}
 
-      fclose(fp);
-    }
-    else if (argc >= 3 && strcmp(argv[1], "-w") == 0) {
-      const char* filepath = argv[2];
-      FILE* fp = fopen(filepath, "w");
+// The terminal shows just the prompt now, as after printing a new one
+void editor_forget(struct line_editor* e) {
+  e->shown.len = 0;
+  e->shown_cursor = 0;
+}
 
-      if (!fp) {
-        fprintf(stderr, "history: %s: %s\n", filepath, strerror(errno));
-        return;
-      }
+void editor_reset(struct line_editor* e) {
+  editor_set(e, "");
+  editor_forget(e);
+}
 
-      for (int i = 0; i < history_count; i++) {
-        fprintf(fp, "%s\n", history_commands[i]);
-      }
+bool utf8_continuation(char c) {
+  return ((unsigned char)c & 0xC0) == 0x80;
+}
 
-      fclose(fp);
-    }
-    else if (argc >= 3 && strcmp(argv[1], "-a") == 0) {
-      const char* filepath = argv[2];
-      FILE* fp = fopen(filepath, "a");
+// Start of the character before pos, or of the one after it
+size_t editor_char_left(const struct line_editor* e, size_t pos) {
+  while (pos > 0 && utf8_continuation(editor_at(e, --pos)))
+    ;
+  return pos;
+}
 
-      if (!fp) {
-        fprintf(stderr, "history: %s: %s\n", filepath, strerror(errno));
-        return;
-      }
+size_t editor_char_right(const struct line_editor* e, size_t pos) {
+  size_t len = editor_len(e);
+  if (pos >= len)
+    return len;
+  // Position len is the end of the line, not a byte to look at
+  while (++pos < len && utf8_continuation(editor_at(e, pos)))
+    ;
+  return pos;
+}
 
-      for (int i = last_appended_index; i < history_count; i++) {
-        fprintf(fp, "%s\n", history_commands[i]);
-      }
+// Word motions stop at the start and end of runs of letters and digits,
+// like readline's backward-word and forward-word
+bool is_word_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c & 0x80);
+}
 
-      fclose(fp);
-      last_appended_index = history_count;
-    }
-    else {
-      int n = history_count;
+size_t editor_word_left(const struct line_editor* e) {
+  size_t pos = e->gap_start;
+  while (pos > 0 && !is_word_char(editor_at(e, pos - 1)))
+    pos--;
+  while (pos > 0 && is_word_char(editor_at(e, pos - 1)))
+    pos--;
+  return pos;
+}
 
-      if (argc == 2) {
-        n = atoi(argv[1]);
-        if (n < 0) n = 0;
-      }
+size_t editor_word_right(const struct line_editor* e) {
+  size_t pos = e->gap_start, len = editor_len(e);
+  while (pos < len && !is_word_char(editor_at(e, pos)))
+    pos++;
+  while (pos < len && is_word_char(editor_at(e, pos)))
+    pos++;
+  return pos;
+}
+
+// Asked once and again after each SIGWINCH
+int terminal_columns() {
+  struct winsize ws;
+  if (terminal_cols < 0)
+    terminal_cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 ? 0 : ws.ws_col;
+  return terminal_cols;
+}
 
-      int start = history_count - n;
-      if (start < 0) start = 0;
+// Terminal columns taken by n bytes of UTF-8 text
+size_t text_columns(const char* s, size_t n) {
+  size_t cols = 0;
+  for (size_t i = 0; i < n; i++)
+    cols += !utf8_continuation(s[i]);
+  return cols;
+}
 
-      for (int i = start; i < history_count; i++) {
-        printf("%5d  %s\n", i + 1, history_commands[i]);
-      }
+// Appends the escapes that move the cursor between two positions, given
+// in columns from the start of the prompt; lines wrap every cols columns
+// (never if cols is 0)
+void cursor_move(struct strbuf* out, size_t from, size_t to, int cols) {
+  size_t from_row = cols ? from / cols : 0, to_row = cols ? to / cols : 0;
+  size_t from_col = cols ? from % cols : from, to_col = cols ? to % cols : to;
+  char seq[32];
+  int n = 0;
+  if (to_row != from_row)
+    n += snprintf(seq + n, sizeof(seq) - n, "\033[%zu%c", to_row < from_row ? from_row - to_row : to_row - from_row, to_row < from_row ? 'A' : 'B');
+  if (to_col + 1 == from_col)
+    n += snprintf(seq + n, sizeof(seq) - n, "\b");
+  else if (to_col != from_col)
+    n += snprintf(seq + n, sizeof(seq) - n, "\033[%zu%c", to_col < from_col ? from_col - to_col : to_col - from_col, to_col < from_col ? 'D' : 'C');
+  strbuf_append(out, seq, n);
+}
+
+// Brings the terminal up to date with the line. Only the span between
+// the common prefix and suffix of the old and new text is sent: on a
+// single row it is patched in place with insert/delete-character
+// escapes; a line that wraps is rewritten from the first difference on.
+void editor_refresh(struct line_editor* e) {
+  const char* want = editor_line(e);
+  size_t len = e->text.len;
+  const char* have = e->shown.data ? e->shown.data : "";
+  size_t have_len = e->shown.len;
+
+  size_t p = 0;
+  while (p < len && p < have_len && want[p] == have[p])
+    p++;
+  while (p > 0 && p < len && utf8_continuation(want[p]))
+    p--;
+  size_t s = 0;
+  while (s < len - p && s < have_len - p && want[len - 1 - s] == have[have_len - 1 - s])
+    s++;
+  while (s > 0 && utf8_continuation(want[len - s]))
+    s--;
+
+  int cols = terminal_columns();
+  size_t at = e->prompt_len + text_columns(have, e->shown_cursor);
+  size_t start = e->prompt_len + text_columns(want, p);
+  size_t old_end = start + text_columns(have + p, have_len - p);
+  size_t new_end = start + text_columns(want + p, len - p);
+  struct strbuf out = { 0 };
+
+  if (p < len || p < have_len) {
+    cursor_move(&out, at, start, cols);
+    size_t old_mid = text_columns(have + p, have_len - s - p);
+    size_t new_mid = text_columns(want + p, len - s - p);
+    if (cols == 0 || (old_end < (size_t)cols && new_end < (size_t)cols)) {
+      // Text after the change only has to be shifted if there is any
+      char seq[32];
+      if (new_mid > old_mid && s > 0)
+        strbuf_append(&out, seq, snprintf(seq, sizeof(seq), "\033[%zu@", new_mid - old_mid));
+      strbuf_append(&out, want + p, len - s - p);
+      if (old_mid > new_mid && s > 0)
+        strbuf_append(&out, seq, snprintf(seq, sizeof(seq), "\033[%zuP", old_mid - new_mid));
+      else if (old_mid > new_mid)
+        strbuf_append(&out, "\033[K", 3);
+      at = start + new_mid;
+    }
+    else {
+      strbuf_append(&out, want + p, len - p);
+      // Past the last column the cursor only wraps on the next character
+      if (len > p && new_end % cols == 0)
+        strbuf_append(&out, "\r\n", 2);
+      if (old_end > new_end)
+        strbuf_append(&out, "\033[J", 3);
+      at = new_end;
     }
   }
+  cursor_move(&out, at, e->prompt_len + text_columns(want, e->gap_start), cols);
+  if (out.len > 0)
+    write(STDOUT_FILENO, out.data, out.len);
+  free(out.data);
+
+  e->shown.len = 0;
+  strbuf_append(&e->shown, want, len);
+  e->shown_cursor = e->gap_start;
+}
 
+// Lists the candidates of a slow completion scan under the line as they
+// arrive, up to a limit. The caller redraws the prompt and line after.
+#define STREAMED_LISTING_MAX 100
 
-  fflush(stdout);
+struct streamed_listing {
+  struct line_editor* ed;
+  size_t cursor; // where the cursor was on the line
+  int count;
+};
 
-  if (saved_stdin != -1) {
-    dup2(saved_stdin, STDIN_FILENO);
-    close(saved_stdin);
-  }
-  if (saved_stdout != -1) {
-    dup2(saved_stdout, STDOUT_FILENO);
-    close(saved_stdout);
+void list_streamed_completions(char** items, int count, void* ctx) {
+  struct streamed_listing* listing = ctx;
+  if (listing->count >= STREAMED_LISTING_MAX)
+    return;
+  if (listing->count == 0) {
+    editor_move(listing->ed, editor_len(listing->ed));
+    editor_refresh(listing->ed);
+    write(STDOUT_FILENO, "\n", 1);
   }
+  if (count > STREAMED_LISTING_MAX - listing->count)
+    count = STREAMED_LISTING_MAX - listing->count;
+  print_completions(items, count, false);
+  listing->count += count;
 }
 
-void execute_pipeline(char* input) {
-  int pipe_count = 0;
-  for (char* p = input; *p; p++) {
-    if (*p == '|') pipe_count++;
-  }
-
-  if (pipe_count == 0) return;
+// True if more input is already waiting, as while text is being pasted
+bool input_pending() {
+  int n = 0;
+  return ioctl(STDIN_FILENO, FIONREAD, &n) == 0 && n > 0;
+}
 
-  int num_commands = pipe_count + 1;
+enum { KEY_NONE, KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE, KEY_WORD_LEFT, KEY_WORD_RIGHT };
+
+// Reads the rest of an escape sequence after ESC: CSI and SS3 cursor
+// keys, Home/End/Delete in both their xterm and vt220 forms, Ctrl-Left/
+// Right and Alt-b/f
+int read_escape_key() {
+  char c;
+  if (read(STDIN_FILENO, &c, 1) != 1)
+    return KEY_NONE;
+  if (c == 'b')
+    return KEY_WORD_LEFT;
+  if (c == 'f')
+    return KEY_WORD_RIGHT;
+  if (c != '[' && c != 'O')
+    return KEY_NONE;
+
+  int params[2] = { 0, 0 }, nparams = 0;
+  while (read(STDIN_FILENO, &c, 1) == 1) {
+    if (c >= '0' && c <= '9') {
+      if (nparams < 2)
+        params[nparams] = params[nparams] * 10 + (c - '0');
+    }
+    else if (c == ';')
+      nparams++;
+    else
+      break;
+  }
+  bool ctrl = nparams >= 1 && params[1] == 5;
+  switch (c) {
+  case 'A': return KEY_UP;
+  case 'B': return KEY_DOWN;
+  case 'C': return ctrl ? KEY_WORD_RIGHT : KEY_RIGHT;
+  case 'D': return ctrl ? KEY_WORD_LEFT : KEY_LEFT;
+  case 'H': return KEY_HOME;
+  case 'F': return KEY_END;
+  case '~':
+    if (params[0] == 1 || params[0] == 7)
+      return KEY_HOME;
+    if (params[0] == 4 || params[0] == 8)
+      return KEY_END;
+    if (params[0] == 3)
+      return KEY_DELETE;
+  }
+  return KEY_NONE;
+}
 
-  char* commands[32];
-  int cmd_idx = 0;
-  char* start = input;
+// Command server mode (shell --serve PATH [N]). Local clients connect to
+// a Unix socket and send one command line each, ended by a NUL or by
+// shutting down their side. The server forks a worker per connection from
+// its warm state (environment, PATH cache, functions), at most N at a
+// time; further clients wait in the listen backlog. A client may attach
+// its stdin, stdout and stderr to the request with SCM_RIGHTS and the
+// command uses them directly. Otherwise stdin is /dev/null and the output
+// comes back over the socket in frames: a tag byte, a 4-byte big-endian
+// length, then the data. 'o' is stdout and 'e' stderr. The last frame is
+// always 'x' with the exit status as a 4-byte big-endian integer.
+bool serve_frame(int fd, char tag, const char* data, uint32_t len) {
+  char header[5] = { tag, len >> 24, len >> 16, len >> 8, len };
+  return write_all(fd, header, 5) == 0 && write_all(fd, data, len) == 0;
+}
 
-  for (char* p = input; *p; p++) {
-    if (*p == '|') {
-      *p = '\0';
-      commands[cmd_idx++] = start;
-      start = p + 1;
+// Reads the command line and any descriptors sent with it. Returns the
+// number of descriptors, 0 unless the client sent exactly three.
+int serve_read_request(int conn, struct strbuf* text, int fds[3]) {
+  int nfds = 0;
+  char buf[4096];
+  while (true) {
+    union {
+      struct cmsghdr header;
+      char space[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control, .msg_controllen = sizeof(control) };
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR)
+      continue;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+        continue;
+      int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int* received = (int*)CMSG_DATA(c);
+      for (int i = 0; i < count; i++) {
+        if (nfds == 0 && count == 3)
+          fds[i] = received[i];
+        else
+          close(received[i]);
+      }
+      if (nfds == 0 && count == 3)
+        nfds = 3;
     }
+    if (n <= 0)
+      break;
+    char* nul = memchr(buf, '\0', n);
+    strbuf_append(text, buf, nul ? nul - buf : n);
+    if (nul)
+      break;
   }
-  commands[cmd_idx++] = start;
+  if (!text->data)
+    strbuf_append(text, "", 0);
+  return nfds;
+}
 
-  for (int i = 0; i < num_commands; i++) {
-    while (*commands[i] == ' ') commands[i]++;
+// Runs a request's command line; it has to be complete on its own
+void serve_run(const char* text) {
+  if (!run_command_line(text)) {
+    fprintf(stderr, "syntax error: unexpected end of file\n");
+    heredocs_clear();
+    last_status = 2;
   }
+  exit(last_status);
+}
 
-  char* argv[32][32];
-  int argc[32];
-  char cmd_copies[32][1024];
-  int is_builtin_cmd[32];
-
-  for (int i = 0; i < num_commands; i++) {
-    strncpy(cmd_copies[i], commands[i], sizeof(cmd_copies[i]) - 1);
-    cmd_copies[i][sizeof(cmd_copies[i]) - 1] = '\0';
-    argc[i] = tokenize(cmd_copies[i], argv[i], 32);
-
-    if (argc[i] == 0) {
-      fprintf(stderr, "Invalid pipeline\n");
-      return;
+// Runs one client's request in a worker and exits with its status; the
+// server sends the status frame
+void serve_worker(int conn) {
+  struct strbuf text = { 0 };
+  int fds[3];
+  if (serve_read_request(conn, &text, fds) == 3) {
+    for (int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
     }
-
-    is_builtin_cmd[i] = is_builtin(argv[i][0]);
+    serve_run(text.data);
   }
 
-  int pipes[32][2];
-  for (int i = 0; i < num_commands - 1; i++) {
-    if (pipe(pipes[i]) < 0) {
-      perror("pipe");
-      for (int j = 0; j < i; j++) {
-        close(pipes[j][0]);
-        close(pipes[j][1]);
+  // The command writes into pipes, which are relayed as frames
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0)
+    _exit(126);
+  pid_t pid = fork();
+  if (pid < 0)
+    _exit(126);
+  if (pid == 0) {
+    events_after_fork();
+    int null = open("/dev/null", O_RDONLY);
+    dup2(null, STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    serve_run(text.data);
+  }
+  close(out[1]);
+  close(err[1]);
+
+  struct event_source srcs[2] = { { .fd = out[0] }, { .fd = err[0] } };
+  const char tags[2] = { 'o', 'e' };
+  bool open_fds[2] = { true, true };
+  char buf[65536];
+  while (open_fds[0] || open_fds[1]) {
+    // A closed pipe is dropped by swapping in the other one
+    int n = open_fds[0] && open_fds[1] ? 2 : 1;
+    int first = open_fds[0] ? 0 : 1;
+    struct event_source* watch = srcs + first;
+    if (event_wait(watch, n) <= 0)
+      continue;
+    for (int i = 0; i < n; i++) {
+      if (!watch[i].ready)
+        continue;
+      int which = first + i;
+      ssize_t got = read(srcs[which].fd, buf, sizeof(buf));
+      if (got < 0 && errno == EINTR)
+        continue;
+      // A client that went away stops the relay; the command gets EPIPE
+      if (got <= 0 || !serve_frame(conn, tags[which], buf, got)) {
+        close(srcs[which].fd);
+        open_fds[which] = false;
       }
-      return;
     }
   }
+  exit(wait_for_child(pid));
+}
 
-  pid_t pids[32];
-
-  for (int i = 0; i < num_commands; i++) {
-    int input_fd = (i == 0) ? STDIN_FILENO : pipes[i - 1][0];
-    int output_fd = (i == num_commands - 1) ? STDOUT_FILENO : pipes[i][1];
-
-    if (is_builtin_cmd[i]) {
-      execute_builtin_in_pipeline(argv[i], argc[i], input_fd, output_fd);
-      pids[i] = -1;
-
-      if (i > 0) {
-        close(pipes[i - 1][0]);
-      }
-      if (i < num_commands - 1) {
-        close(pipes[i][1]);
-      }
+// Binds the socket, replacing a stale one no server is listening on
+int serve_listen(const char* path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "shell: %s: %s\n", path, strerror(ENAMETOOLONG));
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  // Only this user may connect
+  mode_t mask = umask(077);
+  int rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  if (rc != 0 && errno == EADDRINUSE) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno == ECONNREFUSED) {
+      unlink(path);
+      rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
     }
     else {
-      pids[i] = fork();
-
-      if (pids[i] < 0) {
-        perror("fork");
-        for (int j = 0; j < i; j++) {
-          if (pids[j] > 0) kill(pids[j], SIGTERM);
-        }
-        for (int j = 0; j < num_commands - 1; j++) {
-          close(pipes[j][0]);
-          close(pipes[j][1]);
-        }
-        return;
-      }
-
-      if (pids[i] == 0) {
-        if (i > 0) {
-          dup2(pipes[i - 1][0], STDIN_FILENO);
-        }
+      errno = EADDRINUSE;
+    }
+    if (probe >= 0)
+      close(probe);
+  }
+  umask(mask);
+  if (rc != 0 || listen(fd, 128) != 0) {
+    fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-        if (i < num_commands - 1) {
-          dup2(pipes[i][1], STDOUT_FILENO);
-        }
+struct serve_worker_slot {
+  pid_t pid;
+  int pidfd;
+  int conn;
+};
+
+int serve(const char* path, int max_workers) {
+  int listener = serve_listen(path);
+  if (listener < 0)
+    return 1;
+  // Filled once here, so no worker has to
+  int ndirs;
+  path_dirs(&ndirs);
+  shell_environ();
+
+  struct serve_worker_slot* workers = calloc(max_workers, sizeof(*workers));
+  struct event_source* srcs = calloc(max_workers + 1, sizeof(*srcs));
+  int nworkers = 0;
+  while (workers && srcs) {
+    int n = 0;
+    for (; n < nworkers; n++)
+      srcs[n] = (struct event_source){ .fd = workers[n].pidfd };
+    if (nworkers < max_workers)
+      srcs[n++] = (struct event_source){ .fd = listener };
+    int ready = event_wait(srcs, n);
+    // Ctrl-C stops the server
+    if (ready < 0)
+      break;
 
-        for (int j = 0; j < num_commands - 1; j++) {
-          close(pipes[j][0]);
-          close(pipes[j][1]);
-        }
+    for (int i = nworkers - 1; i >= 0; i--) {
+      if (!srcs[i].ready)
+        continue;
+      struct serve_worker_slot* w = &workers[i];
+      uint32_t status = wait_for_child(w->pid);
+      char payload[4] = { status >> 24, status >> 16, status >> 8, status };
+      serve_frame(w->conn, 'x', payload, 4);
+      close(w->conn);
+      close(w->pidfd);
+      *w = workers[--nworkers];
+    }
 
-        char* exec = find_executable(argv[i][0]);
-        if (!exec) {
-          fprintf(stderr, "%s: command not found\n", argv[i][0]);
-          exit(1);
+    if (n > 0 && srcs[n - 1].ready && srcs[n - 1].fd == listener) {
+      int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0)
+        continue;
+      pid_t pid = fork();
+      if (pid == 0) {
+        in_subshell = true;
+        events_after_fork();
+        // Other clients must see EOF when their own worker is done, not
+        // when this one is
+        close(listener);
+        for (int i = 0; i < nworkers; i++) {
+          close(workers[i].conn);
+          close(workers[i].pidfd);
         }
-        execv(exec, argv[i]);
-        perror("execv");
-        exit(1);
+        serve_worker(conn);
       }
-
-      if (i > 0) {
-        close(pipes[i - 1][0]);
-      }
-      if (i < num_commands - 1) {
-        close(pipes[i][1]);
+      int pidfd = pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+      if (pidfd < 0) {
+        // Without a pidfd there is nothing to wait on, so the worker is
+        // finished synchronously
+        uint32_t status = pid > 0 ? wait_for_child(pid) : 126;
+        char payload[4] = { status >> 24, status >> 16, status >> 8, status };
+        serve_frame(conn, 'x', payload, 4);
+        close(conn);
+        continue;
       }
+      workers[nworkers++] = (struct serve_worker_slot){ pid, pidfd, conn };
     }
   }
 
-  for (int i = 0; i < num_commands - 1; i++) {
-    close(pipes[i][0]);
-    close(pipes[i][1]);
+  for (int i = 0; i < nworkers; i++) {
+    wait_for_child(workers[i].pid);
+    close(workers[i].conn);
+    close(workers[i].pidfd);
   }
+  free(workers);
+  free(srcs);
+  close(listener);
+  unlink(path);
+  return 0;
+}
 
-  for (int i = 0; i < num_commands; i++) {
-    if (pids[i] > 0) {
-      waitpid(pids[i], NULL, 0);
-    }
-  }
+// Adds a line typed at the prompt to script and runs script once it is a
+// complete command. Returns false if more lines are needed.
+bool submit_line(struct strbuf* script, const char* line) {
+  strbuf_append(script, line, strlen(line));
+  strbuf_putc(script, '\n');
+  if (!run_command_line(script->data))
+    return false;
+  script->len = 0;
+  return true;
 }
 
 int main(int argc, char* argv[])
@@ -1037,34 +8832,90 @@ int main(int argc, char* argv[])
   // REPL - Read Evaluate Print Loop
   // char input[100]; // declaring a char array to store input command of user
   // const char* builtin[] = { "echo", "exit", "type", "pwd", "cd" };
-  signal(SIGINT, handle_sigint);
+  signal(SIGPIPE, SIG_IGN);
+  events_init();
+  init_simd_dispatch();
+  lexer_init();
+  vars_init();
+  cwd_init();
+  shell_name = argv[0];
+
+  if (argc == 2 && strcmp(argv[1], "--selftest") == 0)
+    return selftest();
+  if (argc > 2 && strcmp(argv[1], "--serve") == 0) {
+    long workers = argc > 3 ? strtol(argv[3], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    return serve(argv[2], workers > 0 ? (int)workers : 1);
+  }
 
-  char* histfile = getenv("HISTFILE");
-  if (histfile) {
-    load_history_from_file(histfile);
+  const char* histfile = var_get("HISTFILE");
+  if (histfile && *histfile) {
+    history_log_open(histfile, true);
+    last_appended_index = history_count;
   }
 
   enable_raw_mode();
-  char buffer[1024];
-  int len = 0;
+  struct line_editor ed = { .prompt_len = 2 };
   bool last_was_tab = false;
   int history_index = -1;
-  char current_input[1024] = { 0 };
+  struct strbuf current_input = { 0 };
+  // A command line with here-documents waits in pending_line while the
+  // body lines for each delimiter are collected into heredocs[]
+  struct strbuf pending_line = { 0 };
+  char heredoc_delims[16][256];
+  bool heredoc_strip[16];
+  int heredoc_wanted = 0;
+  // Lines of a command that isn't complete yet, like an unfinished loop
+  struct strbuf script = { 0 };
+  editor_reset(&ed);
   write(STDOUT_FILENO, "$ ", 2);
   while (1)
   {
+    if (!input_pending()) {
+      editor_refresh(&ed);
+      struct event_source input = { .fd = STDIN_FILENO };
+      int ready = event_wait(&input, 1);
+      if (ready < 0) {
+        // Ctrl-C drops the line, and any command still being continued
+        editor_move(&ed, editor_len(&ed));
+        editor_refresh(&ed);
+        write(STDOUT_FILENO, "\n$ ", 3);
+        editor_reset(&ed);
+        script.len = 0;
+        heredoc_wanted = 0;
+        heredocs_clear();
+        history_index = -1;
+        got_sigint = false;
+        continue;
+      }
+      if (ready == 0)
+        continue;
+    }
+
     char c;
     ssize_t n = read(STDIN_FILENO, &c, 1);
     if (n < 0) {
-      if (errno == EINTR) {
-        len = 0;
+      if (errno == EINTR)
         continue;
-      }
       break;
     }
     if (n == 0) {
-      if (len == 0) {
+      if (heredoc_wanted > 0) {
+        // End of input also ends any unfinished here-documents
+        if (editor_len(&ed) > 0) {
+          heredoc_append(&heredocs[heredoc_count], editor_line(&ed), heredoc_strip[heredoc_count]);
+          editor_reset(&ed);
+        }
+        heredoc_count = heredoc_wanted;
+        heredoc_wanted = 0;
+        write(STDOUT_FILENO, "\n", 1);
+        submit_line(&script, pending_line.data);
+      }
+      if (editor_len(&ed) == 0) {
         write(STDOUT_FILENO, "\n", 1);
+        if (script.len > 0) {
+          fprintf(stderr, "syntax error: unexpected end of file\n");
+          heredocs_clear();
+        }
         break;
       }
       continue;
@@ -1073,155 +8924,174 @@ int main(int argc, char* argv[])
       last_was_tab = false;
     }
 
-    if (c == 27) {
-      char seq[2];
-      if (read(STDIN_FILENO, &seq[0], 1) != 1) continue;
-      if (read(STDIN_FILENO, &seq[1], 1) != 1) continue;
-
-      if (seq[0] == '[') {
-        if (seq[1] == 'A') {
-          if (history_count == 0) continue;
-          if (history_index == -1) {
-            strncpy(current_input, buffer, len);
-            current_input[len] = '\0';
-          }
-
-          if (history_index == -1) {
-            history_index = history_count - 1;
-          }
-          else if (history_index > 0) {
-            history_index--;
-          }
+    int key = KEY_NONE;
+    if (c == 27)
+      key = read_escape_key();
+    else if (c == 1)
+      key = KEY_HOME;
+    else if (c == 5)
+      key = KEY_END;
+    else if (c == 2)
+      key = KEY_LEFT;
+    else if (c == 6)
+      key = KEY_RIGHT;
+
+    if (key == KEY_UP) {
+      // Pick up what other sessions ran since the last command
+      if (history_index == -1 && history_log_sync(LOCK_SH))
+        history_lock(history_log.fd, LOCK_UN);
+      if (history_live == 0) continue;
+      if (history_index == -1) {
+        const char* line = editor_line(&ed);
+        current_input.len = 0;
+        strbuf_append(&current_input, line, strlen(line));
+      }
 
-          write(STDOUT_FILENO, "\r\033[K$ ", 6);
-          strcpy(buffer, history_commands[history_index]);
-          len = strlen(buffer);
-          write(STDOUT_FILENO, buffer, len);
-          continue;
-        }
-        else if (seq[1] == 'B') {
-          if (history_index == -1) continue;
-          history_index++;
-
-          if (history_index >= history_count) {
-            history_index = -1;
-            strcpy(buffer, current_input);
-            len = strlen(buffer);
-          }
-          else {
-            strcpy(buffer, history_commands[history_index]);
-            len = strlen(buffer);
-          }
+      int prev = history_prev(history_index);
+      if (prev >= 0) {
+        history_index = prev;
+      }
+      editor_set(&ed, history_commands[history_index]);
+      continue;
+    }
+    if (key == KEY_DOWN) {
+      if (history_index == -1) continue;
+      history_index = history_next(history_index);
 
-          write(STDOUT_FILENO, "\r\033[K$ ", 6);
-          write(STDOUT_FILENO, buffer, len);
-          continue;
-        }
+      if (history_index < 0) {
+        history_index = -1;
+        editor_set(&ed, current_input.data);
+      }
+      else {
+        editor_set(&ed, history_commands[history_index]);
       }
+      continue;
+    }
+    if (c == 27 || key != KEY_NONE) {
+      if (key == KEY_LEFT)
+        editor_move(&ed, editor_char_left(&ed, ed.gap_start));
+      else if (key == KEY_RIGHT)
+        editor_move(&ed, editor_char_right(&ed, ed.gap_start));
+      else if (key == KEY_HOME)
+        editor_move(&ed, 0);
+      else if (key == KEY_END)
+        editor_move(&ed, editor_len(&ed));
+      else if (key == KEY_WORD_LEFT)
+        editor_move(&ed, editor_word_left(&ed));
+      else if (key == KEY_WORD_RIGHT)
+        editor_move(&ed, editor_word_right(&ed));
+      else if (key == KEY_DELETE) {
+        editor_delete(&ed, 0, editor_char_right(&ed, ed.gap_start) - ed.gap_start);
+        history_index = -1;
+      }
+      continue;
     }
 
     if (c == '\n') {
-      buffer[len] = '\0';
+      // Show the whole line before leaving it
+      editor_move(&ed, editor_len(&ed));
+      editor_refresh(&ed);
+      const char* buffer = editor_line(&ed);
+      size_t len = ed.text.len;
       write(STDOUT_FILENO, "\n", 1);
       history_index = -1;
-      if (len > 0) {
-        if (history_count < 50) {
-          strncpy(history_commands[history_count], buffer, sizeof(history_commands[0]) - 1);
-          history_commands[history_count][sizeof(history_commands[0]) - 1] = '\0';
-          history_count++;
-        }
-        else {
-          for (int i = 0; i < 49; i++) {
-            strcpy(history_commands[i], history_commands[i + 1]);
-          }
-          strncpy(history_commands[49], buffer, sizeof(history_commands[0]) - 1);
-          history_commands[49][sizeof(history_commands[0]) - 1] = '\0';
-        }
-
-        if (strchr(buffer, '|')) {
-          execute_pipeline(buffer);
+      editor_forget(&ed);
+      if (heredoc_count < heredoc_wanted) {
+        bool strip = heredoc_strip[heredoc_count];
+        const char* line = buffer;
+        while (strip && *line == '\t')
+          line++;
+
+        if (strcmp(line, heredoc_delims[heredoc_count]) == 0)
+          heredoc_count++;
+        else
+          heredoc_append(&heredocs[heredoc_count], buffer, strip);
+        editor_set(&ed, "");
+
+        if (heredoc_count < heredoc_wanted) {
+          write(STDOUT_FILENO, "> ", 2);
+          continue;
         }
-        else {
-          handle_command(buffer);
+        heredoc_wanted = 0;
+        write(STDOUT_FILENO, submit_line(&script, pending_line.data) ? "$ " : "> ", 2);
+        continue;
+      }
+      if (len > 0) {
+        record_history(buffer);
+
+        // Lines with here-documents run once all their bodies are typed
+        int found = find_heredoc_delimiters(buffer, heredoc_delims + heredoc_count,
+          heredoc_strip + heredoc_count, 16 - heredoc_count);
+        if (found > 0) {
+          heredoc_wanted = heredoc_count + found;
+          pending_line.len = 0;
+          strbuf_append(&pending_line, buffer, len);
+          editor_set(&ed, "");
+          write(STDOUT_FILENO, "> ", 2);
+          continue;
         }
       }
-      len = 0;
-      write(STDOUT_FILENO, "$ ", 2);
+      // buffer is the editor's copy of the line, which outlives clearing it
+      editor_set(&ed, "");
+      if (len > 0 || script.len > 0)
+        write(STDOUT_FILENO, submit_line(&script, buffer) ? "$ " : "> ", 2);
+      else
+        write(STDOUT_FILENO, "$ ", 2);
       continue;
     }
 
-    if (c == '\t') {
-      int i = len - 1;
-      while (i >= 0 && buffer[i] != ' ')
-        i--;
-
-      int start = i + 1;
-      int prefix_len = len - start;
-
-      char prefix[256];
-      strncpy(prefix, buffer + start, prefix_len);
-      prefix[prefix_len] = '\0';
-
-      char all_matches[256][256];
-      int total = 0;
+    // Tabs inside a here-document body are text, not completion requests
+    if (c == '\t' && heredoc_wanted == 0) {
+      // The word before the cursor is completed, the rest of the line stays
+      const char* buffer = editor_line(&ed);
+      size_t start = ed.gap_start;
+      while (start > 0 && buffer[start - 1] != ' ')
+        start--;
+
+      size_t prefix_len = ed.gap_start - start;
+      char* prefix = strndup(buffer + start, prefix_len);
+      if (!prefix)
+        continue;
 
-      for (int b = 0; builtin[b]; b++) {
-        if (strncmp(builtin[b], prefix, prefix_len) == 0) {
-          strcpy(all_matches[total++], builtin[b]);
-        }
+      // The first word of a command, also right after a pipe, names a command;
+      // everything else (or anything with a slash) completes as a path
+      size_t k = start;
+      while (k > 0 && buffer[k - 1] == ' ')
+        k--;
+      bool command_position = k == 0 || buffer[k - 1] == '|';
+
+      // The scan runs in the background; a key typed meanwhile cancels it
+      // and is then read by the next iteration like any other key. A slow
+      // scan lists what it finds under the line, which is then redrawn.
+      const char* prompt = script.len > 0 ? "> " : "$ ";
+      struct completion comp = { 0 };
+      struct streamed_listing listing = { .ed = &ed, .cursor = ed.gap_start };
+      bool finished = run_completion(prefix, command_position, &comp, list_streamed_completions, &listing);
+      free(prefix);
+      if (listing.count > 0) {
+        editor_move(&ed, listing.cursor);
+        write(STDOUT_FILENO, prompt, 2);
+        editor_forget(&ed);
       }
-
-      if (total == 0) {
-        char* path_env = getenv("PATH");
-        if (path_env) {
-          char* path_copy = strdup(path_env);
-          char* dir = strtok(path_copy, ":");
-
-          while (dir && total < 256) {
-            DIR* dp = opendir(dir);
-            if (dp) {
-              struct dirent* entry;
-              while ((entry = readdir(dp)) && total < 256) {
-                if (strncmp(entry->d_name, prefix, prefix_len) == 0) {
-                  char full_path[1024];
-                  snprintf(full_path, sizeof(full_path), "%s/%s", dir, entry->d_name);
-
-                  if (access(full_path, X_OK) == 0) {
-                    struct stat st;
-                    if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
-                      int is_dup = 0;
-                      for (int k = 0; k < total; k++) {
-                        if (strcmp(all_matches[k], entry->d_name) == 0) {
-                          is_dup = 1;
-                          break;
-                        }
-                      }
-                      if (!is_dup) {
-                        strcpy(all_matches[total++], entry->d_name);
-                      }
-                    }
-                  }
-                }
-              }
-              closedir(dp);
-            }
-            dir = strtok(NULL, ":");
-          }
-          free(path_copy);
-        }
+      if (!finished) {
+        completion_free(&comp);
+        last_was_tab = false;
+        continue;
       }
 
+      int total = comp.count;
+      char** all_matches = comp.items;
+
       if (total == 0) {
         write(STDOUT_FILENO, "\x07", 1);
         last_was_tab = false;
+        completion_free(&comp);
         continue;
       }
 
-      qsort(all_matches, total, sizeof(all_matches[0]), cmp_strings);
-
-      int lcp_len = strlen(all_matches[0]);
+      size_t lcp_len = strlen(all_matches[0]);
       for (int j = 1; j < total; j++) {
-        int k = 0;
+        size_t k = 0;
         while (k < lcp_len &&
           all_matches[0][k] &&
           all_matches[j][k] &&
@@ -1232,64 +9102,54 @@ int main(int argc, char* argv[])
       }
 
       if (lcp_len > prefix_len) {
-        write(STDOUT_FILENO, "\r\033[K$ ", 6);
-        memcpy(buffer + start, all_matches[0], lcp_len);
-        len = start + lcp_len;
-        buffer[len] = '\0';
-        if (total == 1 && lcp_len == strlen(all_matches[0])) {
-          buffer[len++] = ' ';
-          buffer[len] = '\0';
-        }
-        write(STDOUT_FILENO, buffer, len);
+        editor_delete(&ed, prefix_len, 0);
+        editor_insert(&ed, all_matches[0], lcp_len);
+        // Directories keep the cursor right after the '/' to continue descending
+        if (total == 1 && lcp_len == strlen(all_matches[0]) && all_matches[0][lcp_len - 1] != '/')
+          editor_insert(&ed, " ", 1);
         last_was_tab = false;
+        completion_free(&comp);
         continue;
       }
 
       if (total == 1) {
-        write(STDOUT_FILENO, "\r\033[K$ ", 6);
-        int mlen = strlen(all_matches[0]);
-        memcpy(buffer + start, all_matches[0], mlen);
-        buffer[start + mlen] = ' ';
-        len = start + mlen + 1;
-        buffer[len] = '\0';
-        write(STDOUT_FILENO, buffer, len);
+        // Already as long as the match (a fuzzy match may still differ in case)
+        size_t mlen = strlen(all_matches[0]);
+        editor_delete(&ed, prefix_len, 0);
+        editor_insert(&ed, all_matches[0], mlen);
+        if (all_matches[0][mlen - 1] != '/')
+          editor_insert(&ed, " ", 1);
         last_was_tab = false;
+        completion_free(&comp);
         continue;
       }
 
       if (!last_was_tab) {
         write(STDOUT_FILENO, "\x07", 1);
         last_was_tab = true;
+        completion_free(&comp);
         continue;
       }
 
       last_was_tab = false;
+      editor_move(&ed, editor_len(&ed));
+      editor_refresh(&ed);
       write(STDOUT_FILENO, "\n", 1);
-      for (int j = 0; j < total; j++) {
-        write(STDOUT_FILENO, all_matches[j], strlen(all_matches[j]));
-        if (j < total - 1)
-          write(STDOUT_FILENO, "  ", 2);
-      }
-      write(STDOUT_FILENO, "\n$ ", 3);
-      write(STDOUT_FILENO, buffer, len);
+      if (confirm_long_listing(total))
+        print_completions(all_matches, total, true);
+      write(STDOUT_FILENO, prompt, 2);
+      editor_forget(&ed);
+      completion_free(&comp);
       continue;
     }
 
-    if (c == 127) {
-      if (len > 0) {
-        len--;
-        buffer[len] = '\0';
-        history_index = -1;
-
-
-        // Move cursor back, erase char, move back again
-        write(STDOUT_FILENO, "\b \b", 3);
-      }
+    if (c == 127 || c == 8) {
+      editor_delete(&ed, ed.gap_start - editor_char_left(&ed, ed.gap_start), 0);
+      history_index = -1;
       continue;
     }
 
-    buffer[len++] = c;
-    write(STDOUT_FILENO, &c, 1);
+    editor_insert(&ed, &c, 1);
     history_index = -1;
   }
   return 0;